@@ -0,0 +1,842 @@
+#include "Catalog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "StringHash.h"
+#include "UserRegistry.h"
+
+
+/** Log of a user's catalog, in the user's directory */
+#define CATALOG_FILE_NAME ".catalog"
+/** Checkpoint being written, which then replaces the log */
+#define CHECKPOINT_FILE_NAME ".catalog.new"
+
+#define CATALOG_RECORD_MAGIC 0x474c5443u // "CTLG"
+
+/** Types of records */
+enum CatalogRecordType {
+	/** An update of the file began */
+	RECORD_BEGIN = 1,
+	/** An update of the file finished, and stored the file as described */
+	RECORD_FINISH,
+	/** An update of the file finished without changing it */
+	RECORD_ABORT,
+	/** The file is as described, whatever updates began before */
+	RECORD_PUT,
+	/** The user directory matched the catalog when its modification and
+	 *  change times were as recorded (in mtime_ns and size) */
+	RECORD_DIRECTORY,
+};
+
+/** Name of the records of the user directory, which no file can have */
+#define DIRECTORY_RECORD_NAME "."
+
+/** Flags of the records describing a file */
+#define RECORD_PACKED 1
+#define RECORD_REMOVED 2
+
+/** Number of catalogs kept loaded while no thread uses them. Each holds
+ *  2 descriptors */
+#define MAX_IDLE_CATALOGS 128
+/** Number of buckets of the index of a catalog when first allocated */
+#define INITIAL_SLOT_BUCKETS 64
+
+/** Size of the reads when a log is replayed, and of the writes of a checkpoint */
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+/** A log is rewritten as a checkpoint once it is this long, and twice as
+ *  long as the checkpoint would be */
+#define MIN_CHECKPOINT_LEN (64 * 1024)
+
+
+/**
+ * What each record of the log starts with, followed by the name of the file
+ */
+struct CatalogRecordHeader {
+	uint32_t magic;
+	/** CRC-32 of the rest of the header and of the name, so that a record
+	 *  cut short by a crash is not replayed */
+	uint32_t header_checksum;
+	uint64_t generation;
+	uint64_t size;
+	int64_t mtime_ns;
+	uint32_t checksum;
+	uint16_t name_len;
+	uint8_t type;
+	uint8_t flags;
+};
+
+
+/**
+ * A file of the index
+ */
+struct CatalogSlot {
+	struct CatalogEntry entry;
+	uint32_t hash;
+	/** Number of updates of the file begun and not finished */
+	int n_pending;
+	/** Whether updates were pending when the log was replayed, so that
+	 *  they will never finish */
+	bool is_unsettled;
+	struct CatalogSlot* next;
+};
+
+
+/**
+ * The catalog of a user, with the index of its files
+ */
+struct Catalog {
+	struct UserRegistryEntry registry_entry;
+
+	pthread_mutex_t lock;
+	/** Whether the index was built from the log */
+	bool is_loaded;
+	/** Whether the catalog has a log, which new records are appended to */
+	bool is_saved;
+	/** Descriptor of the user directory, -1 until loaded */
+	int dir_fd;
+	/** Descriptor of the log, -1 until saved */
+	int log_fd;
+	/** Length of the valid records of the log, where the next is appended */
+	uint64_t log_len;
+	/** Length of the checkpoint of the index */
+	uint64_t live_len;
+	uint64_t generation;
+	/** Number of files with is_unsettled set */
+	int n_unsettled;
+	/** Number of updates begun and not finished, over all files. The
+	 *  catalog is held while there are some, so that it isn't evicted
+	 *  with updates in flight */
+	int n_pending_updates;
+	/** Modification and change times of the user directory when the
+	 *  catalog last matched it, in nanoseconds, as logged. 0 if never */
+	int64_t dir_mtime_ns;
+	int64_t dir_ctime_ns;
+	/** Whether the directory was found changed behind the server's back.
+	 *  It stays so until the files are listed again, even if the
+	 *  server's own updates change the directory meanwhile */
+	bool is_stale;
+
+	struct CatalogSlot** buckets;
+	int n_buckets;
+	int n_slots;
+};
+
+
+struct UserRegistryEntry* create_catalog();
+void destroy_catalog(struct UserRegistryEntry* entry);
+
+static struct UserRegistry catalogs = USER_REGISTRY_INITIALIZER(MAX_IDLE_CATALOGS,
+		create_catalog, destroy_catalog);
+
+
+/*
+ * Helper functions
+ */
+
+
+/**
+ * @return A time of a stat, in nanoseconds
+ */
+int64_t get_stat_time_ns(const struct timespec* time) {
+	return (int64_t)time->tv_sec * 1000000000 + time->tv_nsec;
+}
+
+
+uint64_t get_catalog_record_len(size_t name_len) {
+	return sizeof(struct CatalogRecordHeader) + name_len;
+}
+
+
+/**
+ * @return Length of the records a checkpoint holds for a file
+ */
+uint64_t get_catalog_slot_len(const struct CatalogSlot* slot) {
+	if (slot->entry.is_removed && slot->entry.generation == 0 && slot->n_pending == 0) {
+		// never stored, nothing to remember
+		return 0;
+	}
+	return get_catalog_record_len(strlen(slot->entry.name)) * (1 + slot->n_pending);
+}
+
+
+uint32_t checksum_catalog_header(const struct CatalogRecordHeader* header, const char* name) {
+	const size_t checked_offset = offsetof(struct CatalogRecordHeader, generation);
+	uint32_t checksum = crc32_update(0, (const char*)header + checked_offset,
+			sizeof(struct CatalogRecordHeader) - checked_offset);
+	return crc32_update(checksum, name, header->name_len);
+}
+
+
+struct CatalogSlot* find_catalog_slot(const struct Catalog* catalog, const char* name) {
+	if (catalog->n_buckets == 0) {
+		return NULL;
+	}
+	uint32_t hash = hash_string(name);
+	struct CatalogSlot* slot = catalog->buckets[hash & (catalog->n_buckets - 1)];
+	while (slot != NULL && (slot->hash != hash || strcmp(slot->entry.name, name) != 0)) {
+		slot = slot->next;
+	}
+	return slot;
+}
+
+
+/**
+ * Double the number of buckets of the index, once the chains get long
+ */
+void grow_catalog_index(struct Catalog* catalog) {
+	int new_n_buckets = catalog->n_buckets == 0 ? INITIAL_SLOT_BUCKETS : catalog->n_buckets * 2;
+	struct CatalogSlot** new_buckets = calloc(new_n_buckets, sizeof(struct CatalogSlot*));
+	if (new_buckets == NULL) {
+		// keep the longer chains
+		return;
+	}
+	int i;
+	for (i = 0; i < catalog->n_buckets; i++) {
+		struct CatalogSlot* slot = catalog->buckets[i];
+		while (slot != NULL) {
+			struct CatalogSlot* next = slot->next;
+			int bucket = slot->hash & (new_n_buckets - 1);
+			slot->next = new_buckets[bucket];
+			new_buckets[bucket] = slot;
+			slot = next;
+		}
+	}
+	free(catalog->buckets);
+	catalog->buckets = new_buckets;
+	catalog->n_buckets = new_n_buckets;
+}
+
+
+/**
+ * Count updates that began (positive) or finished (negative), holding the
+ * catalog while some are pending
+ */
+void count_pending_updates(struct Catalog* catalog, int delta) {
+	int old_count = catalog->n_pending_updates;
+	catalog->n_pending_updates += delta;
+	if (old_count == 0 && catalog->n_pending_updates > 0) {
+		pin_user_entry(&catalogs, &catalog->registry_entry);
+	} else if (old_count > 0 && catalog->n_pending_updates == 0) {
+		release_user_entry(&catalogs, &catalog->registry_entry);
+	}
+}
+
+
+/**
+ * Add a file to the index, as not stored yet
+ * @return The new slot, or NULL if out of memory
+ */
+struct CatalogSlot* add_catalog_slot(struct Catalog* catalog, const char* name) {
+	if (catalog->n_slots >= catalog->n_buckets) {
+		grow_catalog_index(catalog);
+	}
+	if (catalog->n_buckets == 0) {
+		return NULL;
+	}
+	struct CatalogSlot* slot = calloc(1, sizeof(struct CatalogSlot));
+	if (slot == NULL) {
+		return NULL;
+	}
+	strncpy(slot->entry.name, name, MAX_FILE_NAME_LEN - 1);
+	slot->entry.is_removed = true;
+	slot->hash = hash_string(name);
+	int bucket = slot->hash & (catalog->n_buckets - 1);
+	slot->next = catalog->buckets[bucket];
+	catalog->buckets[bucket] = slot;
+	catalog->n_slots++;
+	return slot;
+}
+
+
+/**
+ * Apply a record to the index, whether replayed or just appended
+ * @return 0 if success, -1 if out of memory
+ */
+int apply_catalog_record(struct Catalog* catalog, const struct CatalogRecordHeader* header,
+		const char* name) {
+	if (header->type == RECORD_DIRECTORY) {
+		catalog->dir_mtime_ns = header->mtime_ns;
+		catalog->dir_ctime_ns = (int64_t)header->size;
+		return 0;
+	}
+	struct CatalogSlot* slot = find_catalog_slot(catalog, name);
+	if (slot == NULL && header->type == RECORD_ABORT) {
+		return 0;
+	}
+	if (slot == NULL && (slot = add_catalog_slot(catalog, name)) == NULL) {
+		return -1;
+	}
+	catalog->live_len -= get_catalog_slot_len(slot);
+	int old_n_pending = slot->n_pending;
+	switch (header->type) {
+		case RECORD_BEGIN:
+			slot->n_pending++;
+			break;
+		case RECORD_ABORT:
+		case RECORD_FINISH:
+			if (slot->n_pending > 0) {
+				slot->n_pending--;
+			}
+			break;
+		case RECORD_PUT:
+			slot->n_pending = 0;
+			if (slot->is_unsettled) {
+				slot->is_unsettled = false;
+				catalog->n_unsettled--;
+			}
+			break;
+	}
+	if (header->type == RECORD_FINISH || header->type == RECORD_PUT) {
+		slot->entry.size = header->size;
+		slot->entry.mtime_ns = header->mtime_ns;
+		slot->entry.checksum = header->checksum;
+		slot->entry.generation = header->generation;
+		slot->entry.is_packed = (header->flags & RECORD_PACKED) != 0;
+		slot->entry.is_removed = (header->flags & RECORD_REMOVED) != 0;
+		if (header->generation > catalog->generation) {
+			catalog->generation = header->generation;
+		}
+	}
+	catalog->live_len += get_catalog_slot_len(slot);
+	count_pending_updates(catalog, slot->n_pending - old_n_pending);
+	return 0;
+}
+
+
+/**
+ * Empty the index of a catalog
+ */
+void clear_catalog_index(struct Catalog* catalog) {
+	int i;
+	for (i = 0; i < catalog->n_buckets; i++) {
+		while (catalog->buckets[i] != NULL) {
+			struct CatalogSlot* slot = catalog->buckets[i];
+			catalog->buckets[i] = slot->next;
+			free(slot);
+		}
+	}
+	catalog->n_slots = 0;
+	catalog->live_len = 0;
+	catalog->generation = 0;
+	catalog->n_unsettled = 0;
+	catalog->dir_mtime_ns = 0;
+	catalog->dir_ctime_ns = 0;
+	catalog->is_stale = false;
+	count_pending_updates(catalog, -catalog->n_pending_updates);
+}
+
+
+/**
+ * Allocate an unloaded catalog, for the registry
+ */
+struct UserRegistryEntry* create_catalog() {
+	struct Catalog* catalog = calloc(1, sizeof(struct Catalog));
+	if (catalog == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&catalog->lock, NULL);
+	catalog->dir_fd = -1;
+	catalog->log_fd = -1;
+	return &catalog->registry_entry;
+}
+
+
+/**
+ * Close and free a catalog evicted by the registry. It has no pending update
+ */
+void destroy_catalog(struct UserRegistryEntry* entry) {
+	struct Catalog* catalog = (struct Catalog*) entry;
+	clear_catalog_index(catalog);
+	free(catalog->buckets);
+	if (catalog->log_fd >= 0) {
+		close(catalog->log_fd);
+	}
+	if (catalog->dir_fd >= 0) {
+		close(catalog->dir_fd);
+	}
+	pthread_mutex_destroy(&catalog->lock);
+	free(catalog);
+}
+
+
+/**
+ * Build the index by reading the records of the log in order, through a
+ * large buffer. The log ends at the first invalid record, which is the one
+ * being appended when the server stopped: it is cut off.
+ * @return 0 if success, -1 if error
+ */
+int replay_catalog_log(struct Catalog* catalog) {
+	struct stat log_stat;
+	if (fstat(catalog->log_fd, &log_stat) < 0) {
+		return -1;
+	}
+	uint64_t file_len = log_stat.st_size;
+	char* buffer = malloc(LOG_BUFFER_SIZE);
+	if (buffer == NULL) {
+		return -1;
+	}
+	uint64_t buffer_start = 0;
+	size_t buffer_len = 0;
+	uint64_t offset = 0;
+	while (offset < file_len) {
+		// the whole record must be in the buffer
+		uint64_t needed_len = get_catalog_record_len(MAX_FILE_NAME_LEN);
+		if (needed_len > file_len - offset) {
+			needed_len = file_len - offset;
+		}
+		if (offset + needed_len > buffer_start + buffer_len) {
+			ssize_t n_read = pread(catalog->log_fd, buffer, LOG_BUFFER_SIZE, offset);
+			if (n_read < 0) {
+				free(buffer);
+				return -1;
+			}
+			buffer_start = offset;
+			buffer_len = n_read;
+		}
+		const char* record = buffer + (offset - buffer_start);
+		size_t available_len = buffer_start + buffer_len - offset;
+
+		struct CatalogRecordHeader header;
+		if (available_len < sizeof(header)) {
+			break;
+		}
+		memcpy(&header, record, sizeof(header));
+		const char* name = record + sizeof(header);
+		if (header.magic != CATALOG_RECORD_MAGIC || header.name_len == 0
+				|| header.name_len >= MAX_FILE_NAME_LEN
+				|| available_len < sizeof(header) + header.name_len
+				|| checksum_catalog_header(&header, name) != header.header_checksum) {
+			break;
+		}
+		char name_copy[MAX_FILE_NAME_LEN];
+		memcpy(name_copy, name, header.name_len);
+		name_copy[header.name_len] = 0;
+		if (apply_catalog_record(catalog, &header, name_copy) < 0) {
+			free(buffer);
+			return -1;
+		}
+		offset += get_catalog_record_len(header.name_len);
+	}
+	free(buffer);
+
+	if (offset < file_len) {
+		printf("Catalog: dropping %llu bytes of incomplete records\n",
+				(unsigned long long)(file_len - offset));
+		if (ftruncate(catalog->log_fd, offset) < 0) {
+			return -1;
+		}
+	}
+	catalog->log_len = offset;
+
+	// nothing is being updated yet, so the pending updates were cut short
+	int i;
+	for (i = 0; i < catalog->n_buckets; i++) {
+		struct CatalogSlot* slot;
+		for (slot = catalog->buckets[i]; slot != NULL; slot = slot->next) {
+			if (slot->n_pending > 0) {
+				slot->is_unsettled = true;
+				catalog->n_unsettled++;
+			}
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Open the log of a catalog and build its index. The catalog lock must be held.
+ * @return 0 if success, -1 if error
+ */
+int load_catalog(struct Catalog* catalog, int user_dir_fd) {
+	catalog->dir_fd = openat(user_dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (catalog->dir_fd < 0) {
+		return -1;
+	}
+	// left by a checkpoint that was interrupted
+	unlinkat(catalog->dir_fd, CHECKPOINT_FILE_NAME, 0);
+
+	catalog->log_fd = openat(catalog->dir_fd, CATALOG_FILE_NAME, O_RDWR | O_CLOEXEC);
+	if (catalog->log_fd >= 0 && replay_catalog_log(catalog) < 0) {
+		clear_catalog_index(catalog);
+		close(catalog->log_fd);
+		catalog->log_fd = -1;
+		errno = EIO;
+	}
+	if (catalog->log_fd < 0 && errno != ENOENT) {
+		close(catalog->dir_fd);
+		catalog->dir_fd = -1;
+		return -1;
+	}
+	// with no log, the catalog must be filled by the caller, then saved
+	catalog->is_saved = catalog->log_fd >= 0;
+	catalog->is_loaded = true;
+	return 0;
+}
+
+
+/**
+ * Write all the parts of a record at the given offset
+ * @return 0 if success, -1 if error
+ */
+int write_catalog_parts(int file_fd, struct iovec* parts, int n_parts, off_t offset) {
+	while (n_parts > 0) {
+		ssize_t n_written = pwritev(file_fd, parts, n_parts, offset);
+		if (n_written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n_written < 0) {
+			return -1;
+		}
+		offset += n_written;
+		// skip the parts written completely, and the start of the next one
+		while (n_parts > 0 && (size_t)n_written >= parts->iov_len) {
+			n_written -= parts->iov_len;
+			parts++;
+			n_parts--;
+		}
+		if (n_parts > 0) {
+			parts->iov_base = (char*)parts->iov_base + n_written;
+			parts->iov_len -= n_written;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Fill the header of a record
+ * @param entry File described by the record, or NULL if none
+ */
+void make_catalog_record(struct CatalogRecordHeader* header, uint8_t type, const char* name,
+		const struct CatalogEntry* entry, uint64_t generation) {
+	memset(header, 0, sizeof(struct CatalogRecordHeader));
+	header->magic = CATALOG_RECORD_MAGIC;
+	header->generation = generation;
+	if (entry != NULL) {
+		header->size = entry->size;
+		header->mtime_ns = entry->mtime_ns;
+		header->checksum = entry->checksum;
+		header->flags = (entry->is_packed ? RECORD_PACKED : 0) | (entry->is_removed ? RECORD_REMOVED : 0);
+	}
+	header->name_len = strlen(name);
+	header->type = type;
+	header->header_checksum = checksum_catalog_header(header, name);
+}
+
+
+/**
+ * Fill the header of the record of the user directory, as last matched
+ */
+void make_directory_record(const struct Catalog* catalog, struct CatalogRecordHeader* header) {
+	struct CatalogEntry times;
+	memset(&times, 0, sizeof(times));
+	times.mtime_ns = catalog->dir_mtime_ns;
+	times.size = (uint64_t)catalog->dir_ctime_ns;
+	make_catalog_record(header, RECORD_DIRECTORY, DIRECTORY_RECORD_NAME, &times, 0);
+}
+
+
+/**
+ * Write the checkpoint of the index: the record of the user directory,
+ * one record per file, then one per pending update
+ * @return Length of the checkpoint, or -1 if error
+ */
+int64_t write_catalog_checkpoint(const struct Catalog* catalog, int file_fd) {
+	char* buffer = malloc(LOG_BUFFER_SIZE);
+	if (buffer == NULL) {
+		return -1;
+	}
+	const size_t max_record_len = get_catalog_record_len(MAX_FILE_NAME_LEN);
+	struct CatalogRecordHeader header;
+	make_directory_record(catalog, &header);
+	memcpy(buffer, &header, sizeof(header));
+	memcpy(buffer + sizeof(header), DIRECTORY_RECORD_NAME, header.name_len);
+	size_t buffer_len = get_catalog_record_len(header.name_len);
+	uint64_t file_len = 0;
+	int i;
+	for (i = 0; i < catalog->n_buckets; i++) {
+		struct CatalogSlot* slot;
+		for (slot = catalog->buckets[i]; slot != NULL; slot = slot->next) {
+			if (get_catalog_slot_len(slot) == 0) {
+				continue;
+			}
+			int j;
+			for (j = -1; j < slot->n_pending; j++) {
+				if (buffer_len + max_record_len > LOG_BUFFER_SIZE) {
+					struct iovec part = {buffer, buffer_len};
+					if (write_catalog_parts(file_fd, &part, 1, file_len) < 0) {
+						free(buffer);
+						return -1;
+					}
+					file_len += buffer_len;
+					buffer_len = 0;
+				}
+				if (j < 0) {
+					make_catalog_record(&header, RECORD_PUT, slot->entry.name,
+							&slot->entry, slot->entry.generation);
+				} else {
+					make_catalog_record(&header, RECORD_BEGIN, slot->entry.name, NULL, 0);
+				}
+				memcpy(buffer + buffer_len, &header, sizeof(header));
+				memcpy(buffer + buffer_len + sizeof(header), slot->entry.name, header.name_len);
+				buffer_len += get_catalog_record_len(header.name_len);
+			}
+		}
+	}
+	struct iovec part = {buffer, buffer_len};
+	int result = write_catalog_parts(file_fd, &part, 1, file_len);
+	free(buffer);
+	return result < 0 ? -1 : (int64_t)(file_len + buffer_len);
+}
+
+
+/**
+ * Append a record to the log, then apply it to the index. The catalog
+ * lock must be held. Until the catalog is saved, only the index changes.
+ * @return 0 if success, -1 if error
+ */
+int append_catalog_record(struct Catalog* catalog, uint8_t type, const char* name,
+		const struct CatalogEntry* entry) {
+	size_t name_len = strlen(name);
+	if (name_len == 0 || name_len >= MAX_FILE_NAME_LEN) {
+		return -1;
+	}
+	// a change of a file gets a new generation
+	uint64_t generation = entry != NULL ? catalog->generation + 1 : 0;
+	struct CatalogRecordHeader header;
+	make_catalog_record(&header, type, name, entry, generation);
+	if (catalog->is_saved) {
+		struct iovec parts[2] = {
+			{&header, sizeof(header)},
+			{(void*)name, name_len},
+		};
+		if (write_catalog_parts(catalog->log_fd, parts, 2, catalog->log_len) < 0) {
+			// the next record overwrites what was written
+			return -1;
+		}
+		catalog->log_len += get_catalog_record_len(name_len);
+	}
+	if (apply_catalog_record(catalog, &header, name) < 0) {
+		return -1;
+	}
+
+	// rewrite the log once most of it is replaced records
+	if (catalog->is_saved && catalog->log_len >= MIN_CHECKPOINT_LEN
+			&& catalog->log_len > 2 * catalog->live_len) {
+		save_catalog(catalog);
+	}
+	return 0;
+}
+
+
+/*
+ * Public functions
+ */
+
+
+bool is_catalog_file(const char* name) {
+	return strcmp(name, CATALOG_FILE_NAME) == 0 || strcmp(name, CHECKPOINT_FILE_NAME) == 0;
+}
+
+
+struct Catalog* lock_catalog(const char* username, int user_dir_fd) {
+	struct Catalog* catalog = (struct Catalog*) acquire_user_entry(&catalogs, username);
+	if (catalog == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&catalog->lock);
+	if (!catalog->is_loaded && load_catalog(catalog, user_dir_fd) < 0) {
+		unlock_catalog(catalog);
+		return NULL;
+	}
+	return catalog;
+}
+
+
+void unlock_catalog(struct Catalog* catalog) {
+	pthread_mutex_unlock(&catalog->lock);
+	release_user_entry(&catalogs, &catalog->registry_entry);
+}
+
+
+bool is_catalog_saved(const struct Catalog* catalog) {
+	return catalog->is_saved;
+}
+
+
+int list_unsettled_files(const struct Catalog* catalog, struct FileTable* names) {
+	int i;
+	for (i = 0; i < catalog->n_buckets && catalog->n_unsettled > 0; i++) {
+		struct CatalogSlot* slot;
+		for (slot = catalog->buckets[i]; slot != NULL; slot = slot->next) {
+			if (slot->is_unsettled
+					&& add_file_info(names, slot->entry.name, strlen(slot->entry.name), 0) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+int put_catalog_entry(struct Catalog* catalog, const struct CatalogEntry* entry) {
+	return append_catalog_record(catalog, RECORD_PUT, entry->name, entry);
+}
+
+
+int save_catalog(struct Catalog* catalog) {
+	// the rename of the checkpoint changes the directory, but not its files
+	bool was_current = !catalog->is_stale && is_catalog_current(catalog);
+	int file_fd = openat(catalog->dir_fd, CHECKPOINT_FILE_NAME,
+			O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (file_fd < 0) {
+		return -1;
+	}
+	// the checkpoint must be on disk before it replaces the log
+	int64_t file_len = write_catalog_checkpoint(catalog, file_fd);
+	if (file_len < 0 || fdatasync(file_fd) < 0
+			|| renameat(catalog->dir_fd, CHECKPOINT_FILE_NAME, catalog->dir_fd, CATALOG_FILE_NAME) < 0) {
+		close(file_fd);
+		unlinkat(catalog->dir_fd, CHECKPOINT_FILE_NAME, 0);
+		return -1;
+	}
+	fsync(catalog->dir_fd);
+	if (catalog->log_fd >= 0) {
+		close(catalog->log_fd);
+	}
+	catalog->log_fd = file_fd;
+	catalog->log_len = file_len;
+	catalog->is_saved = true;
+	if (was_current) {
+		mark_catalog_current(catalog);
+	}
+	return 0;
+}
+
+
+int begin_catalog_update(struct Catalog* catalog, const char* file_name) {
+	// a change behind the server's back must be found before the update
+	// changes the directory too
+	if (catalog->n_pending_updates == 0) {
+		is_catalog_current(catalog);
+	}
+	return append_catalog_record(catalog, RECORD_BEGIN, file_name, NULL);
+}
+
+
+int finish_catalog_update(struct Catalog* catalog, const char* file_name,
+		const struct CatalogEntry* entry) {
+	int result = append_catalog_record(catalog, entry != NULL ? RECORD_FINISH : RECORD_ABORT,
+			file_name, entry);
+	// the directory changed only through the updates, which are now logged
+	if (result == 0 && catalog->n_pending_updates == 0 && !catalog->is_stale) {
+		mark_catalog_current(catalog);
+	}
+	return result;
+}
+
+
+const struct CatalogEntry* find_catalog_entry(const struct Catalog* catalog, const char* file_name) {
+	const struct CatalogSlot* slot = find_catalog_slot(catalog, file_name);
+	if (slot == NULL || slot->entry.is_removed) {
+		return NULL;
+	}
+	return &slot->entry;
+}
+
+
+bool is_catalog_current(struct Catalog* catalog) {
+	if (catalog->is_stale) {
+		return false;
+	}
+	// the directory changes while files are updated, as expected
+	if (catalog->n_pending_updates > 0) {
+		return true;
+	}
+	struct stat dir_stat;
+	if (fstat(catalog->dir_fd, &dir_stat) < 0) {
+		return false;
+	}
+	catalog->is_stale = get_stat_time_ns(&dir_stat.st_mtim) != catalog->dir_mtime_ns
+			|| get_stat_time_ns(&dir_stat.st_ctim) != catalog->dir_ctime_ns;
+	return !catalog->is_stale;
+}
+
+
+void mark_catalog_current(struct Catalog* catalog) {
+	struct stat dir_stat;
+	if (fstat(catalog->dir_fd, &dir_stat) < 0) {
+		return;
+	}
+	int64_t mtime_ns = get_stat_time_ns(&dir_stat.st_mtim);
+	int64_t ctime_ns = get_stat_time_ns(&dir_stat.st_ctim);
+	catalog->is_stale = false;
+	if (mtime_ns == catalog->dir_mtime_ns && ctime_ns == catalog->dir_ctime_ns) {
+		return;
+	}
+	catalog->dir_mtime_ns = mtime_ns;
+	catalog->dir_ctime_ns = ctime_ns;
+	// logged, so that the directory isn't listed again once loaded. If
+	// the record is lost, it is
+	if (catalog->is_saved) {
+		struct CatalogRecordHeader header;
+		make_directory_record(catalog, &header);
+		struct iovec parts[2] = {
+			{&header, sizeof(header)},
+			{(void*)DIRECTORY_RECORD_NAME, header.name_len},
+		};
+		if (write_catalog_parts(catalog->log_fd, parts, 2, catalog->log_len) == 0) {
+			catalog->log_len += get_catalog_record_len(header.name_len);
+		}
+	}
+}
+
+
+int list_catalog_files(const struct Catalog* catalog, struct FileTable* files) {
+	int i;
+	for (i = 0; i < catalog->n_buckets; i++) {
+		struct CatalogSlot* slot;
+		for (slot = catalog->buckets[i]; slot != NULL; slot = slot->next) {
+			if (!slot->entry.is_removed && add_file_info(files, slot->entry.name,
+					strlen(slot->entry.name), slot->entry.checksum) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+uint64_t get_catalog_generation(const struct Catalog* catalog) {
+	return catalog->generation;
+}
+
+
+int list_catalog_changes(const struct Catalog* catalog, uint64_t since_generation,
+		struct CatalogEntry** changes, int* n_changes) {
+	*changes = malloc((catalog->n_slots > 0 ? catalog->n_slots : 1) * sizeof(struct CatalogEntry));
+	if (*changes == NULL) {
+		return -1;
+	}
+	*n_changes = 0;
+	int i;
+	for (i = 0; i < catalog->n_buckets; i++) {
+		struct CatalogSlot* slot;
+		for (slot = catalog->buckets[i]; slot != NULL; slot = slot->next) {
+			if (slot->entry.generation > since_generation) {
+				(*changes)[(*n_changes)++] = slot->entry;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,184 @@
+/**
+ * A persistent catalog of the files of a user: name, size, checksum,
+ * modification time and generation of each file, so that listings and
+ * lookups are reads of an in-memory index rather than scans of the user's
+ * directory.
+ *
+ * The catalog is stored in the user's directory (.catalog), as a log of
+ * records replayed when the catalog is first used. Once the log holds
+ * mostly replaced records, it is rewritten as a checkpoint with one record
+ * per file, which replaces the log atomically.
+ *
+ * Records are appended without being synced: they reach the disk along
+ * with the files they describe when those are synced (see GroupCommit), or
+ * when the system writes them back. A crash may thus lose the last records
+ * of the log, which is read up to its last whole record. An update of a
+ * file is logged when it begins and when it finishes, so that the files
+ * whose update was cut short are looked at again.
+ *
+ * The catalog is only trusted while the user directory is as it left it:
+ * it logs the modification and change times of the directory whenever it
+ * matches it, so that a catalog loaded again is trusted as replayed. When
+ * the times differ, e.g. when the last records were lost, the files must
+ * be listed again and the catalog brought up to date. The updates of the
+ * catalog move those times along. A change made behind the server's back
+ * while an update of the user is in flight, or within the same timestamp
+ * as one, goes unnoticed, as does a file rewritten in place, which doesn't
+ * change its directory.
+ *
+ * Catalogs stay loaded while they are used. Past a bound, the catalogs
+ * no thread has used for the longest are closed (see UserRegistry), and
+ * loaded again from their log when needed.
+ */
+
+#ifndef CATALOG_H_
+#define CATALOG_H_
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "FileTable.h"
+#include "StorageService.h"
+
+
+/**
+ * What the catalog knows about a file
+ */
+struct CatalogEntry {
+	char name[MAX_FILE_NAME_LEN];
+	/** Length of the content */
+	uint64_t size;
+	/** Time the file was stored, in nanoseconds */
+	int64_t mtime_ns;
+	/** CRC-32 of the content */
+	uint32_t checksum;
+	/** Generation of the catalog when the file last changed */
+	uint64_t generation;
+	/** Whether the content is in the user's pack rather than in a file */
+	bool is_packed;
+	/** Whether the file was removed. Kept, with the generation of the
+	 *  removal, across checkpoints, so that changes can be queried */
+	bool is_removed;
+};
+
+
+struct Catalog;
+
+
+/**
+ * @return true if a file of a user directory belongs to the catalog
+ */
+bool is_catalog_file(const char* name);
+
+
+/**
+ * Find the catalog of a user, load it if needed, and lock it
+ * @param user_dir_fd Descriptor of the user's directory
+ * @return The locked catalog, or NULL if error
+ */
+struct Catalog* lock_catalog(const char* username, int user_dir_fd);
+
+
+/**
+ * Unlock a catalog locked by lock_catalog
+ */
+void unlock_catalog(struct Catalog* catalog);
+
+
+/**
+ * @return false if the catalog was never stored, in which case its files
+ *         must be added with put_catalog_entry, then save_catalog called
+ */
+bool is_catalog_saved(const struct Catalog* catalog);
+
+
+/**
+ * Give the names of the files whose update began but never finished,
+ * before the catalog was loaded. They must be looked at again, and set
+ * with put_catalog_entry.
+ * @param names [out] Initialized table the names are added to
+ * @return 0 if success, -1 if out of memory
+ */
+int list_unsettled_files(const struct Catalog* catalog, struct FileTable* names);
+
+
+/**
+ * Set the entry of a file, as it is now stored. Settles the updates of the
+ * file that began before.
+ * @return 0 if success, -1 if error
+ */
+int put_catalog_entry(struct Catalog* catalog, const struct CatalogEntry* entry);
+
+
+/**
+ * Write the whole catalog to its file, replacing the previous one
+ * @return 0 if success, -1 if error
+ */
+int save_catalog(struct Catalog* catalog);
+
+
+/**
+ * Log that a file is about to change
+ * @return 0 if success, -1 if error
+ */
+int begin_catalog_update(struct Catalog* catalog, const char* file_name);
+
+
+/**
+ * Log that an update begun by begin_catalog_update is over
+ * @param entry The file as stored by the update, or NULL if the update
+ *              didn't change the file
+ * @return 0 if success, -1 if error
+ */
+int finish_catalog_update(struct Catalog* catalog, const char* file_name,
+		const struct CatalogEntry* entry);
+
+
+/**
+ * @return false if the user directory changed since the catalog last
+ *         matched it, other than through updates in flight. Its files must
+ *         then be listed again, set with put_catalog_entry, and
+ *         mark_catalog_current called. Until then, the catalog stays
+ *         out of date, whatever the updates do to the directory
+ */
+bool is_catalog_current(struct Catalog* catalog);
+
+
+/**
+ * Record that the catalog matches the user directory as it is now, and
+ * log the times of the directory
+ */
+void mark_catalog_current(struct Catalog* catalog);
+
+
+/**
+ * @return The entry of a file, or NULL if the catalog has no such file
+ */
+const struct CatalogEntry* find_catalog_entry(const struct Catalog* catalog, const char* file_name);
+
+
+/**
+ * Add the name and checksum of each file of the catalog to a table
+ * @return 0 if success, -1 if out of memory
+ */
+int list_catalog_files(const struct Catalog* catalog, struct FileTable* files);
+
+
+/**
+ * @return The generation of the last change of the catalog
+ */
+uint64_t get_catalog_generation(const struct Catalog* catalog);
+
+
+/**
+ * Give the entries of the files changed or removed after a generation
+ * @param changes   [out] Array of the entries, to be freed by the caller
+ * @param n_changes [out] Number of entries
+ * @return 0 if success, -1 if out of memory
+ */
+int list_catalog_changes(const struct Catalog* catalog, uint64_t since_generation,
+		struct CatalogEntry** changes, int* n_changes);
+
+
+#endif // CATALOG_H_
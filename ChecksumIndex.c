@@ -0,0 +1,298 @@
+#include "ChecksumIndex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+
+/** Name of the index file in each directory */
+#define INDEX_FILE_NAME ".checksum_index"
+
+/** First bytes of an index file. Changed whenever the format changes */
+static const char INDEX_MAGIC[8] = "GMMCRC1";
+
+/** Number of tries at finding an unused name for a temporary copy of an
+ *  index, before giving up */
+#define MAX_TEMP_FILE_TRIES 16
+
+/** Name of the extended attribute holding the checksum attached to a file */
+#define CHECKSUM_ATTRIBUTE_NAME "user.gmm.crc32"
+
+
+/**
+ * Start of an index file, followed by the entries
+ */
+struct IndexFileHeader {
+	char magic[8];
+	/** Size of an entry, to reject files written with another layout */
+	uint32_t entry_size;
+	uint32_t n_entries;
+};
+
+
+/**
+ * Value of the checksum attribute of a file. The attribute belongs to the
+ * inode, so only the size and modification time need to be checked
+ */
+struct AttachedChecksum {
+	uint64_t size;
+	/** Last modification time, in nanoseconds */
+	int64_t mtime_ns;
+	uint32_t checksum;
+	uint32_t padding;
+};
+
+
+/*
+ * Helper functions
+ */
+
+
+int64_t get_mtime_ns(const struct stat* file_stat) {
+	return (int64_t)file_stat->st_mtim.tv_sec * 1000000000 + file_stat->st_mtim.tv_nsec;
+}
+
+
+int compare_index_entries(const void* a, const void* b) {
+	const struct ChecksumIndexEntry* entry_a = a;
+	const struct ChecksumIndexEntry* entry_b = b;
+	return strcmp(entry_a->name, entry_b->name);
+}
+
+
+/**
+ * Read exactly len bytes from a file
+ * @return 0 if success, -1 if error or the file is too short
+ */
+int read_index_data(int fd, void* data, size_t len) {
+	char* cursor = data;
+	while (len > 0) {
+		ssize_t n_read = read(fd, cursor, len);
+		if (n_read <= 0) {
+			return -1;
+		}
+		cursor += n_read;
+		len -= n_read;
+	}
+	return 0;
+}
+
+
+/**
+ * Write exactly len bytes to a file
+ * @return 0 if success, -1 if error
+ */
+int write_index_data(int fd, const void* data, size_t len) {
+	const char* cursor = data;
+	while (len > 0) {
+		ssize_t n_written = write(fd, cursor, len);
+		if (n_written <= 0) {
+			return -1;
+		}
+		cursor += n_written;
+		len -= n_written;
+	}
+	return 0;
+}
+
+
+/**
+ * Create a new temporary copy of the index in a directory. Its name starts
+ * with the name of the index, so that it is not listed either
+ * @param temp_name [out] Name of the file, in a buffer large enough for
+ *                  the name of the index and 32 more characters
+ * @return Descriptor of the file, or -1 if fail
+ */
+int open_temp_index_file(int dir_fd, char* temp_name) {
+	static unsigned int n_temp_files = 0;
+	int i;
+	for (i = 0; i < MAX_TEMP_FILE_TRIES; i++) {
+		// unique within the process. A name left by another process, or
+		// by a crash, is simply skipped
+		unsigned int id = __atomic_fetch_add(&n_temp_files, 1, __ATOMIC_RELAXED);
+		sprintf(temp_name, "%s.%d.%u", INDEX_FILE_NAME, (int)getpid(), id);
+		int fd = openat(dir_fd, temp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (fd >= 0 || errno != EEXIST) {
+			return fd;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Public functions
+ */
+
+
+void initialize_checksum_index(struct ChecksumIndex* index) {
+	index->entries = NULL;
+	index->n_entries = 0;
+	index->capacity = 0;
+}
+
+
+int load_checksum_index(struct ChecksumIndex* index, int dir_fd) {
+	initialize_checksum_index(index);
+	int fd = openat(dir_fd, INDEX_FILE_NAME, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		// no index yet
+		return 0;
+	}
+
+	// check that the file is an index of the expected layout and size
+	struct IndexFileHeader header;
+	struct stat file_stat;
+	if (read_index_data(fd, &header, sizeof(header)) < 0
+			|| memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+			|| header.entry_size != sizeof(struct ChecksumIndexEntry)
+			|| fstat(fd, &file_stat) < 0
+			|| file_stat.st_size != sizeof(header) + (off_t)header.n_entries * header.entry_size) {
+		close(fd);
+		return 0;
+	}
+
+	if (header.n_entries > 0) {
+		index->entries = malloc(header.n_entries * sizeof(struct ChecksumIndexEntry));
+		if (index->entries == NULL) {
+			close(fd);
+			return -1;
+		}
+		if (read_index_data(fd, index->entries, header.n_entries * sizeof(struct ChecksumIndexEntry)) < 0) {
+			free_checksum_index(index);
+			close(fd);
+			return 0;
+		}
+	}
+	close(fd);
+	index->n_entries = header.n_entries;
+	index->capacity = header.n_entries;
+
+	// don't trust the file to be well-formed
+	int i;
+	for (i = 0; i < index->n_entries; i++) {
+		index->entries[i].name[MAX_FILE_NAME_LEN - 1] = 0;
+	}
+	qsort(index->entries, index->n_entries, sizeof(struct ChecksumIndexEntry), compare_index_entries);
+	return 0;
+}
+
+
+const struct ChecksumIndexEntry* find_checksum_entry(const struct ChecksumIndex* index,
+		const char* name, const struct stat* file_stat) {
+	if (index->n_entries == 0) {
+		return NULL;
+	}
+	struct ChecksumIndexEntry key;
+	strncpy(key.name, name, MAX_FILE_NAME_LEN - 1);
+	key.name[MAX_FILE_NAME_LEN - 1] = 0;
+	const struct ChecksumIndexEntry* entry = bsearch(&key, index->entries, index->n_entries,
+			sizeof(struct ChecksumIndexEntry), compare_index_entries);
+
+	// the checksum is only valid for the version of the file it was computed on
+	if (entry == NULL
+			|| entry->inode != (uint64_t)file_stat->st_ino
+			|| entry->size != (uint64_t)file_stat->st_size
+			|| entry->mtime_ns != get_mtime_ns(file_stat)) {
+		return NULL;
+	}
+	return entry;
+}
+
+
+int add_checksum_entry(struct ChecksumIndex* index, const char* name,
+		const struct stat* file_stat, uint32_t checksum) {
+	if (index->n_entries == index->capacity) {
+		int new_capacity = index->capacity == 0 ? 16 : index->capacity * 2;
+		struct ChecksumIndexEntry* new_entries = realloc(index->entries,
+				new_capacity * sizeof(struct ChecksumIndexEntry));
+		if (new_entries == NULL) {
+			return -1;
+		}
+		index->entries = new_entries;
+		index->capacity = new_capacity;
+	}
+
+	struct ChecksumIndexEntry* entry = &index->entries[index->n_entries];
+	// zero the padding too, so that the file content is deterministic
+	memset(entry, 0, sizeof(struct ChecksumIndexEntry));
+	strncpy(entry->name, name, MAX_FILE_NAME_LEN - 1);
+	entry->inode = file_stat->st_ino;
+	entry->size = file_stat->st_size;
+	entry->mtime_ns = get_mtime_ns(file_stat);
+	entry->checksum = checksum;
+	index->n_entries++;
+	return 0;
+}
+
+
+int save_checksum_index(struct ChecksumIndex* index, int dir_fd) {
+	qsort(index->entries, index->n_entries, sizeof(struct ChecksumIndexEntry), compare_index_entries);
+
+	struct IndexFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	header.entry_size = sizeof(struct ChecksumIndexEntry);
+	header.n_entries = index->n_entries;
+
+	// write a temporary copy, then rename it over the index, so that
+	// concurrent listings never see a half-written index
+	char temp_name[sizeof(INDEX_FILE_NAME) + 32];
+	int fd = open_temp_index_file(dir_fd, temp_name);
+	int result = -1;
+	if (fd >= 0) {
+		bool is_written = write_index_data(fd, &header, sizeof(header)) == 0
+				&& write_index_data(fd, index->entries,
+						index->n_entries * sizeof(struct ChecksumIndexEntry)) == 0;
+		if (close(fd) == 0 && is_written) {
+			result = renameat(dir_fd, temp_name, dir_fd, INDEX_FILE_NAME);
+		}
+		if (result < 0) {
+			unlinkat(dir_fd, temp_name, 0);
+		}
+	}
+	return result;
+}
+
+
+void free_checksum_index(struct ChecksumIndex* index) {
+	free(index->entries);
+	initialize_checksum_index(index);
+}
+
+
+bool is_checksum_index_file(const char* name) {
+	return strncmp(name, INDEX_FILE_NAME, strlen(INDEX_FILE_NAME)) == 0;
+}
+
+
+int attach_file_checksum(int file_fd, const struct stat* file_stat, uint32_t checksum) {
+	struct AttachedChecksum value;
+	memset(&value, 0, sizeof(value));
+	value.size = file_stat->st_size;
+	value.mtime_ns = get_mtime_ns(file_stat);
+	value.checksum = checksum;
+	return fsetxattr(file_fd, CHECKSUM_ATTRIBUTE_NAME, &value, sizeof(value), 0);
+}
+
+
+int read_attached_checksum(int dir_fd, const char* name, const struct stat* file_stat, uint32_t* checksum) {
+	int file_fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+	if (file_fd < 0) {
+		return -1;
+	}
+	struct AttachedChecksum value;
+	ssize_t value_len = fgetxattr(file_fd, CHECKSUM_ATTRIBUTE_NAME, &value, sizeof(value));
+	close(file_fd);
+	if (value_len != sizeof(value)
+			|| value.size != (uint64_t)file_stat->st_size
+			|| value.mtime_ns != get_mtime_ns(file_stat)) {
+		return -1;
+	}
+	*checksum = value.checksum;
+	return 0;
+}
@@ -0,0 +1,122 @@
+/**
+ * A persistent index of the checksums of the files in a directory, so that
+ * listing a directory only hashes the files that changed since the last
+ * listing. Each entry remembers the stat data of the file when it was
+ * hashed, and is only trusted while that data still matches.
+ * The index is stored in the directory itself, in a hidden file that is
+ * not part of the listing.
+ * A checksum known when a file is written (e.g. computed while the file is
+ * uploaded) is attached to the file as an extended attribute instead, and
+ * moved to the index by the next listing.
+ */
+
+#ifndef CHECKSUM_INDEX_H_
+#define CHECKSUM_INDEX_H_
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "StorageService.h"
+
+
+/**
+ * The checksum of a file, together with the stat data it is valid for
+ */
+struct ChecksumIndexEntry {
+	char name[MAX_FILE_NAME_LEN];
+	uint64_t inode;
+	uint64_t size;
+	/** Last modification time, in nanoseconds */
+	int64_t mtime_ns;
+	uint32_t checksum;
+};
+
+
+/**
+ * The entries of one directory, sorted by name once loaded
+ */
+struct ChecksumIndex {
+	struct ChecksumIndexEntry* entries;
+	/** Number of entries in the index */
+	int n_entries;
+	/** Number of entries the array can hold */
+	int capacity;
+};
+
+
+/**
+ * Initialize an empty index
+ */
+void initialize_checksum_index(struct ChecksumIndex* index);
+
+
+/**
+ * Load the index stored in a directory. A missing or corrupt index file
+ * gives an empty index, so every file is hashed again.
+ * @return 0 if success, -1 if out of memory (the index is left empty)
+ */
+int load_checksum_index(struct ChecksumIndex* index, int dir_fd);
+
+
+/**
+ * Find the entry of a file, if it is still valid for the file
+ * @param file_stat Current stat data of the file
+ * @return The entry, or NULL if the file is not in the index or changed
+ *         since it was hashed
+ */
+const struct ChecksumIndexEntry* find_checksum_entry(const struct ChecksumIndex* index,
+		const char* name, const struct stat* file_stat);
+
+
+/**
+ * Add the checksum of a file to the index
+ * @param file_stat Stat data of the file, when the checksum was computed
+ * @return 0 if success, -1 if out of memory
+ */
+int add_checksum_entry(struct ChecksumIndex* index, const char* name,
+		const struct stat* file_stat, uint32_t checksum);
+
+
+/**
+ * Store the index in a directory, replacing the previous index atomically
+ * @return 0 if success, -1 if fail
+ */
+int save_checksum_index(struct ChecksumIndex* index, int dir_fd);
+
+
+/**
+ * Release the memory of the index
+ */
+void free_checksum_index(struct ChecksumIndex* index);
+
+
+/**
+ * @return true if a file name belongs to the index (or to one of its
+ *         temporary copies), rather than to a user file
+ */
+bool is_checksum_index_file(const char* name);
+
+
+/**
+ * Attach the checksum of a file to the file itself
+ * @param file_stat Stat data of the file, when the checksum was computed
+ * @return 0 if success, -1 if fail (e.g. the file system does not support
+ *         extended attributes)
+ */
+int attach_file_checksum(int file_fd, const struct stat* file_stat, uint32_t checksum);
+
+
+/**
+ * Read the checksum attached to a file, if it is still valid for the file
+ * @param dir_fd    Descriptor of the directory of the file
+ * @param file_stat Current stat data of the file
+ * @param checksum  [out] The checksum
+ * @return 0 if success, -1 if the file has no checksum attached or changed
+ *         since it was hashed
+ */
+int read_attached_checksum(int dir_fd, const char* name, const struct stat* file_stat, uint32_t* checksum);
+
+
+#endif // CHECKSUM_INDEX_H_
@@ -0,0 +1,497 @@
+#include "ChunkStore.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+
+#define DATABASE_DIR "serverdata"
+#define CHUNKS_DIR DATABASE_DIR "/" CHUNKS_DIR_NAME
+
+/** Chunks are cut between these sizes, around the average size. Large
+ *  enough to keep the number of chunk files low, small enough that an
+ *  edited tag costs a few chunks rather than a whole song */
+#define MIN_CHUNK_SIZE (64 * 1024)
+#define AVERAGE_CHUNK_SIZE (256 * 1024)
+#define MAX_CHUNK_SIZE (1024 * 1024)
+
+/** A boundary is where the masked bits of the rolling hash are all zero.
+ *  Before the average size, 2 more bits must be zero than the average size
+ *  needs, and 2 fewer after it, which keeps most chunks near the average
+ *  (normalized chunking). The top bits depend on the last 64 bytes */
+#define STRICT_MASK (((1ULL << 20) - 1) << 44)
+#define LOOSE_MASK (((1ULL << 16) - 1) << 48)
+
+/** Seed of the gear table. Changing it moves every boundary, which would
+ *  stop new uploads from sharing chunks with stored files */
+#define GEAR_SEED 0x676d6d6368756e6bULL
+
+/** Name of the extended attribute marking a chunk list */
+#define CHUNK_LIST_ATTRIBUTE_NAME "user.gmm.chunks"
+
+/** First bytes of a chunk list */
+#define CHUNK_LIST_MAGIC "GMMCHNK1"
+
+/** Prefix of the names chunks are written under before being linked, when
+ *  the filesystem has no anonymous files. Those left by a crash are removed
+ *  when the store is initialized */
+#define TEMPORARY_CHUNK_PREFIX ".chunk."
+
+/** Number of chunks a list holds when first allocated */
+#define INITIAL_CHUNK_CAPACITY 16
+
+
+/**
+ * What a chunk list file starts with, followed by its chunks
+ */
+struct ChunkListHeader {
+	char magic[8];
+	uint64_t file_size;
+	uint32_t checksum;
+	uint32_t n_chunks;
+};
+
+
+/** Random value of each byte, added to the rolling hash */
+static uint64_t gear_table[256];
+
+
+/*
+ * Helper functions
+ */
+
+
+/**
+ * Fill the gear table with the output of splitmix64, so that it is the
+ * same on every run
+ */
+void initialize_gear_table() {
+	uint64_t state = GEAR_SEED;
+	int i;
+	for (i = 0; i < 256; i++) {
+		state += 0x9e3779b97f4a7c15ULL;
+		uint64_t value = state;
+		value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+		gear_table[i] = value ^ (value >> 31);
+	}
+}
+
+
+int compare_chunk_digests(const void* a, const void* b) {
+	return memcmp(((const struct ChunkRef*)a)->digest, ((const struct ChunkRef*)b)->digest,
+			SHA256_DIGEST_LEN);
+}
+
+
+/**
+ * Make room for n more chunks in a list
+ * @return 0 if success, -1 if out of memory
+ */
+int reserve_chunk_refs(struct ChunkList* list, int n) {
+	if (list->n_chunks + n <= list->capacity) {
+		return 0;
+	}
+	int new_capacity = list->capacity == 0 ? INITIAL_CHUNK_CAPACITY : list->capacity;
+	while (new_capacity < list->n_chunks + n) {
+		new_capacity *= 2;
+	}
+	struct ChunkRef* new_chunks = realloc(list->chunks, new_capacity * sizeof(struct ChunkRef));
+	if (new_chunks == NULL) {
+		return -1;
+	}
+	list->chunks = new_chunks;
+	list->capacity = new_capacity;
+	return 0;
+}
+
+
+/**
+ * Read exactly len bytes at the given offset
+ * @return 0 if success, -1 if error or end of file
+ */
+int read_fully(int file_fd, void* buffer, size_t len, off_t offset) {
+	char* cursor = buffer;
+	while (len > 0) {
+		ssize_t n_read = pread(file_fd, cursor, len, offset);
+		if (n_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n_read <= 0) {
+			return -1;
+		}
+		cursor += n_read;
+		len -= n_read;
+		offset += n_read;
+	}
+	return 0;
+}
+
+
+/**
+ * Write all of a buffer to a file
+ * @return 0 if success, -1 if error
+ */
+int write_fully(int file_fd, const void* data, size_t len) {
+	const char* cursor = data;
+	while (len > 0) {
+		ssize_t n_written = write(file_fd, cursor, len);
+		if (n_written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n_written < 0) {
+			return -1;
+		}
+		cursor += n_written;
+		len -= n_written;
+	}
+	return 0;
+}
+
+
+/**
+ * Append the chunks of a chunk list file to a list
+ * @param header [out] Header of the file
+ * @return 0 if success, -1 if the file is not a valid chunk list
+ */
+int read_listed_chunks(struct ChunkList* list, int file_fd, struct ChunkListHeader* header) {
+	struct stat file_stat;
+	if (fstat(file_fd, &file_stat) < 0 || read_fully(file_fd, header, sizeof(*header), 0) < 0
+			|| memcmp(header->magic, CHUNK_LIST_MAGIC, sizeof(header->magic)) != 0
+			|| (uint64_t)file_stat.st_size != sizeof(*header) + (uint64_t)header->n_chunks * sizeof(struct ChunkRef)
+			|| reserve_chunk_refs(list, header->n_chunks) < 0) {
+		return -1;
+	}
+	struct ChunkRef* chunks = &list->chunks[list->n_chunks];
+	if (read_fully(file_fd, chunks, header->n_chunks * sizeof(struct ChunkRef), sizeof(*header)) < 0) {
+		return -1;
+	}
+	// the sizes must add up, or the file sent would not match its header
+	uint64_t file_size = 0;
+	uint32_t i;
+	for (i = 0; i < header->n_chunks; i++) {
+		file_size += chunks[i].len;
+	}
+	if (file_size != header->file_size) {
+		return -1;
+	}
+	list->n_chunks += header->n_chunks;
+	return 0;
+}
+
+
+/**
+ * Write a new unique path for a chunk being written
+ * @param path [out] Buffer of CHUNK_PATH_LEN bytes
+ */
+void format_temporary_chunk_path(char* path) {
+	static unsigned int n_temporary_chunks = 0;
+	unsigned int id = __atomic_fetch_add(&n_temporary_chunks, 1, __ATOMIC_RELAXED);
+	sprintf(path, "%s/" TEMPORARY_CHUNK_PREFIX "%u", CHUNKS_DIR, id);
+}
+
+
+/**
+ * Store a chunk under its digest, unless it is stored already
+ * @param ref [out] Digest and length of the chunk
+ * @return 0 if success, -1 if error
+ */
+int store_chunk(const unsigned char* data, size_t len, struct ChunkRef* ref) {
+	struct Sha256Context context;
+	initialize_sha256(&context);
+	update_sha256(&context, data, len);
+	finish_sha256(&context, ref->digest);
+	ref->len = len;
+
+	char chunk_path[CHUNK_PATH_LEN];
+	format_chunk_path(ref->digest, chunk_path);
+	if (access(chunk_path, F_OK) == 0) {
+		// nothing to write
+		return 0;
+	}
+
+	// written anonymously, then linked under its name once complete, so
+	// that a chunk is never seen half-written
+	char source_path[CHUNK_PATH_LEN];
+	bool is_named = false;
+	int chunk_fd = open(CHUNKS_DIR, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+	if (chunk_fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+		// the filesystem has no anonymous files
+		format_temporary_chunk_path(source_path);
+		chunk_fd = open(source_path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+		is_named = true;
+	}
+	if (chunk_fd < 0) {
+		return -1;
+	}
+	if (!is_named) {
+		sprintf(source_path, "/proc/self/fd/%d", chunk_fd);
+	}
+	int result = write_fully(chunk_fd, data, len);
+	if (result == 0) {
+		result = linkat(AT_FDCWD, source_path, AT_FDCWD, chunk_path, AT_SYMLINK_FOLLOW);
+		if (result < 0 && errno == ENOENT) {
+			// first chunk of its directory
+			char chunk_dir_path[CHUNK_PATH_LEN];
+			sprintf(chunk_dir_path, "%s/%02x", CHUNKS_DIR, ref->digest[0]);
+			mkdir(chunk_dir_path, 0777);
+			result = linkat(AT_FDCWD, source_path, AT_FDCWD, chunk_path, AT_SYMLINK_FOLLOW);
+		}
+		if (result < 0 && errno == EEXIST) {
+			// stored meanwhile by another upload
+			result = 0;
+		}
+	}
+	if (is_named) {
+		unlink(source_path);
+	}
+	close(chunk_fd);
+	return result;
+}
+
+
+/**
+ * Store the first len bytes of the buffer as the next chunk of the file,
+ * and drop them from the buffer
+ * @return 0 if success, -1 if error
+ */
+int cut_chunk(struct ChunkWriter* writer, size_t len) {
+	if (reserve_chunk_refs(&writer->list, 1) < 0) {
+		return -1;
+	}
+	struct ChunkRef* ref = &writer->list.chunks[writer->list.n_chunks];
+	if (store_chunk(writer->buffer, len, ref) < 0) {
+		return -1;
+	}
+	writer->list.n_chunks++;
+	writer->list.file_size += len;
+
+	// the rest was received along with the end of the chunk
+	memmove(writer->buffer, writer->buffer + len, writer->buffer_len - len);
+	writer->buffer_len -= len;
+	writer->scan_offset = 0;
+	writer->hash = 0;
+	return 0;
+}
+
+
+/**
+ * Search the buffer for the end of the chunk it starts with
+ * @return Length of the chunk, or 0 if more bytes are needed to find it
+ */
+size_t find_chunk_boundary(struct ChunkWriter* writer) {
+	const unsigned char* buffer = writer->buffer;
+	size_t end = writer->buffer_len < MAX_CHUNK_SIZE ? writer->buffer_len : MAX_CHUNK_SIZE;
+	// no boundary can be before the min size, whose bytes are not hashed
+	size_t i = writer->scan_offset > MIN_CHUNK_SIZE ? writer->scan_offset : MIN_CHUNK_SIZE;
+	uint64_t hash = writer->hash;
+
+	size_t strict_end = end < AVERAGE_CHUNK_SIZE ? end : AVERAGE_CHUNK_SIZE;
+	for (; i < strict_end; i++) {
+		hash = (hash << 1) + gear_table[buffer[i]];
+		if ((hash & STRICT_MASK) == 0) {
+			return i + 1;
+		}
+	}
+	for (; i < end; i++) {
+		hash = (hash << 1) + gear_table[buffer[i]];
+		if ((hash & LOOSE_MASK) == 0) {
+			return i + 1;
+		}
+	}
+	if (end == MAX_CHUNK_SIZE) {
+		return MAX_CHUNK_SIZE;
+	}
+	writer->scan_offset = i;
+	writer->hash = hash;
+	return 0;
+}
+
+
+/*
+ * Public functions
+ */
+
+
+void initialize_chunk_store() {
+	mkdir(CHUNKS_DIR, 0777);
+	initialize_gear_table();
+	DIR* dir = opendir(CHUNKS_DIR);
+	if (dir == NULL) {
+		return;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, TEMPORARY_CHUNK_PREFIX, strlen(TEMPORARY_CHUNK_PREFIX)) == 0) {
+			unlinkat(dirfd(dir), entry->d_name, 0);
+		}
+	}
+	closedir(dir);
+}
+
+
+int initialize_chunk_writer(struct ChunkWriter* writer) {
+	writer->buffer = malloc(MAX_CHUNK_SIZE);
+	writer->buffer_len = 0;
+	writer->scan_offset = 0;
+	writer->hash = 0;
+	initialize_chunk_list(&writer->list);
+	return writer->buffer != NULL ? 0 : -1;
+}
+
+
+int write_chunked_content(struct ChunkWriter* writer, const void* data, size_t data_len) {
+	const unsigned char* bytes = data;
+	while (data_len > 0) {
+		size_t n_copied = MAX_CHUNK_SIZE - writer->buffer_len;
+		if (n_copied > data_len) {
+			n_copied = data_len;
+		}
+		memcpy(writer->buffer + writer->buffer_len, bytes, n_copied);
+		writer->buffer_len += n_copied;
+		bytes += n_copied;
+		data_len -= n_copied;
+
+		size_t chunk_len;
+		while ((chunk_len = find_chunk_boundary(writer)) > 0) {
+			if (cut_chunk(writer, chunk_len) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+int finish_chunk_writer(struct ChunkWriter* writer, int list_fd, uint32_t checksum) {
+	if (writer->buffer_len > 0 && cut_chunk(writer, writer->buffer_len) < 0) {
+		return -1;
+	}
+	writer->list.checksum = checksum;
+
+	struct ChunkListHeader header;
+	memcpy(header.magic, CHUNK_LIST_MAGIC, sizeof(header.magic));
+	header.file_size = writer->list.file_size;
+	header.checksum = checksum;
+	header.n_chunks = writer->list.n_chunks;
+	if (write_fully(list_fd, &header, sizeof(header)) < 0
+			|| write_fully(list_fd, writer->list.chunks, writer->list.n_chunks * sizeof(struct ChunkRef)) < 0) {
+		return -1;
+	}
+	// without the mark, the list would be sent as the file
+	return fsetxattr(list_fd, CHUNK_LIST_ATTRIBUTE_NAME, "1", 1, 0);
+}
+
+
+void free_chunk_writer(struct ChunkWriter* writer) {
+	free(writer->buffer);
+	writer->buffer = NULL;
+	free_chunk_list(&writer->list);
+}
+
+
+bool is_chunk_list(int file_fd) {
+	return fgetxattr(file_fd, CHUNK_LIST_ATTRIBUTE_NAME, NULL, 0) >= 0;
+}
+
+
+void initialize_chunk_list(struct ChunkList* list) {
+	list->file_size = 0;
+	list->checksum = 0;
+	list->chunks = NULL;
+	list->n_chunks = 0;
+	list->capacity = 0;
+}
+
+
+int read_chunk_list(int file_fd, struct ChunkList* list) {
+	struct ChunkListHeader header;
+	if (read_listed_chunks(list, file_fd, &header) < 0) {
+		return -1;
+	}
+	list->file_size = header.file_size;
+	list->checksum = header.checksum;
+	return 0;
+}
+
+
+int add_listed_chunks(struct ChunkList* used, int file_fd) {
+	struct ChunkListHeader header;
+	return read_listed_chunks(used, file_fd, &header);
+}
+
+
+int remove_unlisted_chunks(struct ChunkList* used) {
+	if (used->n_chunks > 1) {
+		qsort(used->chunks, used->n_chunks, sizeof(struct ChunkRef), compare_chunk_digests);
+	}
+	int n_removed = 0;
+	DIR* dir = opendir(CHUNKS_DIR);
+	if (dir == NULL) {
+		return 0;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		int sub_dir_fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (sub_dir_fd < 0) {
+			continue;
+		}
+		DIR* sub_dir = fdopendir(sub_dir_fd);
+		if (sub_dir == NULL) {
+			close(sub_dir_fd);
+			continue;
+		}
+		struct dirent* chunk_entry;
+		while ((chunk_entry = readdir(sub_dir)) != NULL) {
+			// only names made of a digest are chunks
+			struct ChunkRef chunk;
+			const char* name = chunk_entry->d_name;
+			if (strlen(name) != 2 * SHA256_DIGEST_LEN) {
+				continue;
+			}
+			int i;
+			for (i = 0; i < SHA256_DIGEST_LEN; i++) {
+				unsigned int byte;
+				if (sscanf(name + 2 * i, "%2x", &byte) != 1) {
+					break;
+				}
+				chunk.digest[i] = byte;
+			}
+			if (i < SHA256_DIGEST_LEN) {
+				continue;
+			}
+			if (bsearch(&chunk, used->chunks, used->n_chunks, sizeof(struct ChunkRef),
+					compare_chunk_digests) == NULL) {
+				unlinkat(sub_dir_fd, name, 0);
+				n_removed++;
+			}
+		}
+		closedir(sub_dir);
+	}
+	closedir(dir);
+	return n_removed;
+}
+
+
+void free_chunk_list(struct ChunkList* list) {
+	free(list->chunks);
+	initialize_chunk_list(list);
+}
+
+
+void format_chunk_path(const unsigned char* digest, char* path) {
+	char* cursor = path + sprintf(path, "%s/%02x/", CHUNKS_DIR, digest[0]);
+	int i;
+	for (i = 0; i < SHA256_DIGEST_LEN; i++) {
+		cursor += sprintf(cursor, "%02x", digest[i]);
+	}
+}
@@ -0,0 +1,160 @@
+/**
+ * A store of file contents split into chunks at content-defined boundaries,
+ * so that files differing by a few bytes (e.g. a song whose tags were
+ * edited) share all of their chunks but those around the difference.
+ * Boundaries are found with a gear rolling hash (FastCDC), so they move
+ * along with the content when bytes are inserted or removed. Each chunk is
+ * stored once, under its SHA-256 digest, e.g. serverdata/chunks/ab/ab12...ef.
+ *
+ * A chunked file is stored as its chunk list: a small file naming its
+ * chunks in order, marked by an extended attribute that only the server
+ * sets, so that an uploaded file can never pass for a chunk list.
+ */
+
+#ifndef CHUNK_STORE_H_
+#define CHUNK_STORE_H_
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Sha256.h"
+
+
+/** Name of the chunk store, in the server's data directory */
+#define CHUNKS_DIR_NAME "chunks"
+
+/** Length of the path to a chunk, including null terminator */
+#define CHUNK_PATH_LEN 128
+
+
+/**
+ * A chunk of a file
+ */
+struct ChunkRef {
+	unsigned char digest[SHA256_DIGEST_LEN];
+	uint32_t len;
+};
+
+
+/**
+ * The chunks of a file, in order
+ */
+struct ChunkList {
+	/** Sum of the lengths of the chunks */
+	uint64_t file_size;
+	/** CRC-32 of the whole file */
+	uint32_t checksum;
+	struct ChunkRef* chunks;
+	int n_chunks;
+	int capacity;
+};
+
+
+/**
+ * Splits a file into chunks as it arrives, and stores the chunks that are
+ * not stored yet
+ */
+struct ChunkWriter {
+	/** Bytes of the current chunk, received so far */
+	unsigned char* buffer;
+	size_t buffer_len;
+	/** Offset in the buffer where the search for a boundary resumes */
+	size_t scan_offset;
+	/** Rolling hash at scan_offset */
+	uint64_t hash;
+	/** Chunks of the file so far */
+	struct ChunkList list;
+};
+
+
+/**
+ * Create the chunk store if missing, and remove the chunks a crash left
+ * half-written. Must be called before chunks are written.
+ */
+void initialize_chunk_store();
+
+
+/**
+ * Start splitting a new file
+ * @return 0 if success, -1 if out of memory
+ */
+int initialize_chunk_writer(struct ChunkWriter* writer);
+
+
+/**
+ * Add the next bytes of a file. Each chunk completed by these bytes is
+ * stored, unless a chunk with the same digest is stored already.
+ * @return 0 if success, -1 if error
+ */
+int write_chunked_content(struct ChunkWriter* writer, const void* data, size_t data_len);
+
+
+/**
+ * Store the last chunk of a file, then write its chunk list
+ * @param list_fd  Empty file to write the chunk list to
+ * @param checksum CRC-32 of the whole file
+ * @return 0 if success, -1 if error (e.g. the file system does not support
+ *         extended attributes)
+ */
+int finish_chunk_writer(struct ChunkWriter* writer, int list_fd, uint32_t checksum);
+
+
+/**
+ * Release the memory of a writer, finished or not
+ */
+void free_chunk_writer(struct ChunkWriter* writer);
+
+
+/**
+ * @return true if the file is a chunk list written by finish_chunk_writer
+ */
+bool is_chunk_list(int file_fd);
+
+
+/**
+ * Initialize an empty chunk list
+ */
+void initialize_chunk_list(struct ChunkList* list);
+
+
+/**
+ * Read a chunk list written by finish_chunk_writer
+ * @param list [out] Initialized list, which is filled
+ * @return 0 if success, -1 if the file is not a valid chunk list
+ */
+int read_chunk_list(int file_fd, struct ChunkList* list);
+
+
+/**
+ * Add the chunks of a chunk list to a list of chunks in use
+ * @param used List the chunks are appended to
+ * @return 0 if success, -1 if the file is not a valid chunk list
+ */
+int add_listed_chunks(struct ChunkList* used, int file_fd);
+
+
+/**
+ * Delete the chunks of the store that are not in the given list. No chunk
+ * must be written meanwhile.
+ * @param used All the chunks in use. Sorted by this call
+ * @return Number of chunks deleted
+ */
+int remove_unlisted_chunks(struct ChunkList* used);
+
+
+/**
+ * Release the memory of a chunk list
+ */
+void free_chunk_list(struct ChunkList* list);
+
+
+/**
+ * Write the path of the chunk with the given digest
+ * @param path [out] Buffer of CHUNK_PATH_LEN bytes
+ */
+void format_chunk_path(const unsigned char* digest, char* path);
+
+
+#endif // CHUNK_STORE_H_
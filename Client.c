@@ -2,8 +2,12 @@
  * GetMyMusic client's main program
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "AuthenticationService.h"
 #include "NetworkHeader.h"
@@ -12,6 +16,12 @@
 
 
 #define CLIENT_DIR "clientdata"
+/** Downloads are written to their file in blocks of this size, aligned in the file */
+#define DOWNLOAD_BLOCK_SIZE (1024 * 1024)
+/** Length of the name a download is linked under before it replaces the
+ *  file, including null terminator. The name is reserved, so a link left by
+ *  a crash is neither listed nor uploaded */
+#define DOWNLOAD_STAGING_NAME_LEN (sizeof(STAGED_NAME_PREFIX) + 32)
 
 
 /**
@@ -49,42 +59,58 @@ void parse_arguments(int argc, char* argv[], char** server, char** port);
 int create_socket(const char* server, const char* server_port);
 
 
+/**
+ * Send data to the server, retrying on partial writes.
+ * If an error happens, log error message and exit the program.
+ */
+void send_to_server(int server_socket, const char* data, size_t data_len);
+
+
 /**
  * Query the server for the list of files belong to the user
  *
  * @param  server_socket Server socket
  * @param  buffer        Buffer to receive packet
  * @param  session_token Session token of current user
- * @param  n_files       [out] Address of variable to store number of files
- * @return Linked list of file infos at server. This is dynamically allocated,
- *         and require a call to free_file_info() to release memory.
+ * @param  server_files  [out] Initialized table, the files at server are
+ *                       added to. It must be released with free_file_table()
  */
-struct FileInfo* get_server_files(int server_socket, char* buffer, uint32_t session_token, int* n_files);
+void get_server_files(int server_socket, char* buffer, uint32_t session_token,
+        struct FileTable* server_files);
 
 
 /**
- * Return a linked list of files that appear in src but doesn't appear in dst.
+ * Find the files that appear in src but don't appear in dst.
  * The criteria for file equality is checksum
- * This method allocate memory for the returned list, while not changing the
- * original lists.
+ * Both tables must be sorted by checksum.
+ *
+ * @param  missing [out] Initialized table, the missing files are added to
  */
-struct FileInfo* get_missing_files(struct FileInfo* src, struct FileInfo* dst);
+void get_missing_files(const struct FileTable* src, const struct FileTable* dst,
+        struct FileTable* missing);
 
 
 /**
- * Get the files that only exist in client or in server. The 2 lists returned
- * are dynamically allocated, and must be freed using free_file_info()
+ * Get the files that only exist in client or in server. The 2 tables
+ * must be released using free_file_table()
  *
  * @param  server_socket   Server socket
  * @param  buffer          Buffer to receive packet
  * @param  session_token   Session token of current user
- * @param  client_missings [out] Address of variable to store list of files
+ * @param  client_missings [out] Address of table to store files
  *                         missing from client
- * @param  server_missings [out] Address of variable to store list of files
+ * @param  server_missings [out] Address of table to store files
  *                         missing from server
  */
 void get_client_server_diffs(int server_socket, char* buffer, uint32_t session_token, 
-        struct FileInfo** client_missings, struct FileInfo** server_missings);
+        struct FileTable* client_missings, struct FileTable* server_missings);
+
+
+/**
+ * Write a block of a downloaded file, retrying on partial writes.
+ * If an error happens, log error message and exit the program.
+ */
+void write_download_block(int file_fd, const char* block, size_t block_len);
 
 
 /**
@@ -178,8 +204,8 @@ int main (int argc, char *argv[]) {
     }
 
     // Request to leave
-    ssize_t packet_len = make_leave_request(buffer, BUFFSIZE, session_token);
-    send(server_socket, buffer, packet_len, 0);
+    ssize_t packet_len = make_leave_request(buffer, BUFFSIZE, VERSION, session_token);
+    send_to_server(server_socket, buffer, packet_len);
 
     // Release resource and exit
     close(server_socket);
@@ -292,10 +318,18 @@ int create_socket(const char* server, const char* server_port) {
 }
 
 
-struct FileInfo* get_server_files(int server_socket, char* buffer, uint32_t session_token, int* n_files) {
+void send_to_server(int server_socket, const char* data, size_t data_len) {
+    if (send_packet(server_socket, data, data_len) < 0) {
+        die_with_error("Lost connection to server", "send() failed");
+    }
+}
+
+
+void get_server_files(int server_socket, char* buffer, uint32_t session_token,
+        struct FileTable* server_files) {
     // Ask for list of files from server
-    ssize_t packet_len = make_list_request(buffer, BUFFSIZE, session_token);
-    send(server_socket, buffer, packet_len, 0);
+    ssize_t packet_len = make_list_request(buffer, BUFFSIZE, VERSION, session_token);
+    send_to_server(server_socket, buffer, packet_len);
 
     // receive list of files from server
     packet_len = receive_packet(server_socket, buffer, BUFFSIZE);
@@ -304,66 +338,68 @@ struct FileInfo* get_server_files(int server_socket, char* buffer, uint32_t sess
         exit(1);
     }
 
-    // parse packet into a list of files
-    struct FileInfo* server_files = NULL;
-    *n_files = (packet_len - HEADER_LEN) / (MAX_FILE_NAME_LEN+4);
-    char* cur_entry = buffer + HEADER_LEN;
+    // parse packet into a table of files
+    size_t header_len = get_header_len(buffer[0]);
+    int n_files = (packet_len - header_len) / (MAX_FILE_NAME_LEN+4);
+    char* cur_entry = buffer + header_len;
     int i;
-    for (i = 0; i < *n_files; i++) {
-        struct FileInfo* cur_file = malloc(sizeof(struct FileInfo));
-        // copy file name
-        memcpy(cur_file->name, cur_entry, MAX_FILE_NAME_LEN);
+    for (i = 0; i < n_files; i++) {
+        // file name, which is padded with null characters
+        const char* file_name = cur_entry;
         cur_entry += MAX_FILE_NAME_LEN;
-        // copy file checksum (with endian corrected)
-        memcpy(&cur_file->checksum, cur_entry, 4);
-        cur_file->checksum = ntohl(cur_file->checksum);
+        // file checksum (with endian corrected)
+        uint32_t checksum;
+        memcpy(&checksum, cur_entry, 4);
         cur_entry += 4;
-        // add file to head of server file list
-        cur_file->next = server_files;
-        server_files = cur_file;
+        if (add_file_info(server_files, file_name, strnlen(file_name, MAX_FILE_NAME_LEN - 1),
+                ntohl(checksum)) < 0) {
+            die_with_error("Out of memory", "add_file_info() failed");
+        }
     }
-    return server_files;
 }
 
 
-struct FileInfo* get_missing_files(struct FileInfo* src, struct FileInfo* dst) {
-    struct FileInfo* cur_src;
-    struct FileInfo* cur_dst;
-    struct FileInfo* missing = NULL;
-    for (cur_src = src; cur_src != NULL; cur_src = cur_src->next) {
-        // check if current file in src is found in dst
-        bool found = false;
-        for (cur_dst = dst; cur_dst != NULL; cur_dst = cur_dst->next) {
-            if (cur_src->checksum == cur_dst->checksum) {
-                found = true;
-                break;
-            }
+void get_missing_files(const struct FileTable* src, const struct FileTable* dst,
+        struct FileTable* missing) {
+    // both tables are sorted by checksum, so a single pass over each finds
+    // the checksums of src that are not in dst
+    int i_dst = 0;
+    int i_src;
+    for (i_src = 0; i_src < src->n_files; i_src++) {
+        const struct FileInfo* cur_src = &src->files[i_src];
+        while (i_dst < dst->n_files && dst->files[i_dst].checksum < cur_src->checksum) {
+            i_dst++;
         }
-        // if not found, add current file to missing list
+        bool found = i_dst < dst->n_files && dst->files[i_dst].checksum == cur_src->checksum;
+        // if not found, add current file to missing table
         if (!found) {
-            // copy the info into new struct
-            struct FileInfo* cur_file = malloc(sizeof(struct FileInfo));
-            memcpy(cur_file, cur_src, sizeof(struct FileInfo));
-            // add to the head of the missing list
-            cur_file->next = missing;
-            missing = cur_file;
+            const char* file_name = get_file_name(src, cur_src);
+            if (add_file_info(missing, file_name, strlen(file_name), cur_src->checksum) < 0) {
+                die_with_error("Out of memory", "add_file_info() failed");
+            }
         }
     }
-    return missing;
 }
 
 
 void get_client_server_diffs(int server_socket, char* buffer, uint32_t session_token, 
-        struct FileInfo** client_missings, struct FileInfo** server_missings) {
-    int n_server_files, n_client_files;
-    struct FileInfo* server_files = get_server_files(server_socket, buffer, session_token, &n_server_files);
-    struct FileInfo* client_files = list_files(CLIENT_DIR, &n_client_files);
-
-    *client_missings = get_missing_files(server_files, client_files);
-    *server_missings = get_missing_files(client_files, server_files);
-
-    free_file_info(server_files);
-    free_file_info(client_files);
+        struct FileTable* client_missings, struct FileTable* server_missings) {
+    struct FileTable server_files;
+    struct FileTable client_files;
+    initialize_file_table(&server_files);
+    initialize_file_table(&client_files);
+    get_server_files(server_socket, buffer, session_token, &server_files);
+    list_files(CLIENT_DIR, &client_files);
+    sort_files_by_checksum(&server_files);
+    sort_files_by_checksum(&client_files);
+
+    initialize_file_table(client_missings);
+    initialize_file_table(server_missings);
+    get_missing_files(&server_files, &client_files, client_missings);
+    get_missing_files(&client_files, &server_files, server_missings);
+
+    free_file_table(&server_files);
+    free_file_table(&client_files);
 }
 
 
@@ -371,65 +407,166 @@ void upload_file(int server_socket, char* buffer, uint32_t session_token, const
     printf("Uploading file %s\n", file_name);
     // open file descriptor
     char* file_path = join_path(CLIENT_DIR, file_name);
-    FILE* file = fopen(file_path, "rb");
+    int file_fd = open(file_path, O_RDONLY | O_CLOEXEC);
     free(file_path);
-    if (file == NULL) {
+    struct stat file_stat;
+    if (file_fd < 0 || fstat(file_fd, &file_stat) < 0) {
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        return;
+    }
+    size_t file_size = file_stat.st_size;
+
+    // header and file name
+    ssize_t packet_len = make_file_upload_header(buffer, BUFFSIZE, VERSION, session_token,
+            file_name, file_size);
+    if (packet_len < 0) {
+        printf("File %s is too large\n", file_name);
+        close(file_fd);
         return;
     }
-    // get size of file
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    // send header
-    size_t packet_len = make_file_transfer_header(buffer, BUFFSIZE, session_token, MAX_FILE_NAME_LEN + file_size);
-    send(server_socket, buffer, packet_len, 0);
-    // send file name
-    send(server_socket, file_name, MAX_FILE_NAME_LEN, 0);
-    // send the entire file
-    while ((packet_len = make_file_transfer_body(buffer, BUFFSIZE, file)) > 0) {
-        send(server_socket, buffer, packet_len, 0);
-    }
-    fclose(file);
+
+    if (file_size <= BUFFSIZE - packet_len) {
+        // a small file goes out together with its header, in a single send
+        size_t n_read = 0;
+        while (n_read < file_size) {
+            ssize_t n_new_bytes = read(file_fd, buffer + packet_len + n_read, file_size - n_read);
+            if (n_new_bytes <= 0) {
+                printf("Error when reading file %s\n", file_name);
+                close(file_fd);
+                return;
+            }
+            n_read += n_new_bytes;
+        }
+        send_to_server(server_socket, buffer, packet_len + file_size);
+    } else {
+        // cork the socket so that the header shares its packet with the
+        // start of the file, instead of going out alone
+        set_socket_cork(server_socket, true);
+        send_to_server(server_socket, buffer, packet_len);
+        if (send_file_content(server_socket, file_fd, file_size, buffer, BUFFSIZE) < 0) {
+            die_with_error("Failed to upload file", file_name);
+        }
+        set_socket_cork(server_socket, false);
+    }
+    close(file_fd);
 }
 
 
 void download_file(int server_socket, char* buffer, uint32_t session_token, const char* file_name) {
     printf("Downloading file %s\n", file_name);
     // request the server to send the file
-    size_t packet_len = make_file_request(buffer, BUFFSIZE, session_token, file_name);
-    send(server_socket, buffer, packet_len, 0);
+    size_t packet_len = make_file_request(buffer, BUFFSIZE, VERSION, session_token, file_name);
+    send_to_server(server_socket, buffer, packet_len);
 
     // receive the file back
-    size_t n_received = receive_packet(server_socket, buffer, BUFFSIZE);
+    ssize_t n_received = receive_packet(server_socket, buffer, BUFFSIZE);
+    if (n_received <= 0) {
+        printf("Error when receiving file\n");
+        exit(1);
+    }
     struct PacketHeader* header = (struct PacketHeader*) buffer;
-    size_t response_len = ntohs(header->packet_len);
-
-    // open a new file to write to
-    char* file_path = join_path(CLIENT_DIR, file_name);
-    FILE* file = fopen(file_path, "wb");
+    if (header->type != TYPE_FILE_TRANSFER) {
+        printf("Server failed to send file %s\n", file_name);
+        return;
+    }
+    size_t header_len = get_header_len(header->version);
+    uint64_t response_len = get_packet_len(buffer);
+    uint64_t file_size = response_len - header_len;
+
+    // receive into an anonymous file, which replaces the local file only
+    // once complete, so the local file is never seen half-written.
+    // Its space is allocated at once, so that it is contiguous.
+    // The staging name is the process's, so clients sharing the directory
+    // don't mix
+    char staging_name[DOWNLOAD_STAGING_NAME_LEN];
+    sprintf(staging_name, STAGED_NAME_PREFIX "download.%d", (int)getpid());
+    char* staging_path = join_path(CLIENT_DIR, staging_name);
+    bool is_named = false;
+    int file_fd = open(CLIENT_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+    if (file_fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+        // the filesystem has no anonymous files: received under the
+        // staging name instead
+        file_fd = open(staging_path, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0666);
+        is_named = true;
+    }
+    if (file_fd < 0) {
+        die_with_error("Failed to create file", file_name);
+    }
+    if (file_size > 0 && fallocate(file_fd, 0, 0, file_size) < 0 && errno != EOPNOTSUPP) {
+        die_with_error("Not enough space for file", file_name);
+    }
+    char* block = malloc(DOWNLOAD_BLOCK_SIZE);
+    if (block == NULL) {
+        die_with_error("Failed to download file", "Out of memory");
+    }
 
-    // write the file content to file
-    fwrite(buffer + HEADER_LEN, 1, n_received - HEADER_LEN, file);
+    // the file content already received starts the first block
+    size_t block_len = n_received - header_len;
+    memcpy(block, buffer + header_len, block_len);
 
-    // continue to receive more file content and write to file
-    while(n_received < response_len) {
-        int n_new_bytes = recv(server_socket, buffer, BUFFSIZE, 0);
+    // continue to receive more file content, and write it to file once a
+    // block is full
+    while (n_received < response_len) {
+        if (block_len == DOWNLOAD_BLOCK_SIZE) {
+            write_download_block(file_fd, block, block_len);
+            block_len = 0;
+        }
+        uint64_t n_remaining = response_len - n_received;
+        size_t max_len = DOWNLOAD_BLOCK_SIZE - block_len;
+        ssize_t n_new_bytes = recv(server_socket, block + block_len,
+                n_remaining < max_len ? n_remaining : max_len, 0);
         if (n_new_bytes <= 0) {
-            // fail to recv
-            fclose(file);
-            remove(file_path);        
-            free(file_path);
+            // fail to recv. The file vanishes
+            if (is_named) {
+                unlink(staging_path);
+            }
+            close(file_fd);
+            free(block);
+            free(staging_path);
             return;
         }
         n_received += n_new_bytes;
-        fwrite(buffer, 1, n_new_bytes, file);
+        block_len += n_new_bytes;
     }
+    write_download_block(file_fd, block, block_len);
+    free(block);
 
-    fclose(file);
+    // put the file in place, under the staging name first, since a link
+    // can't replace a file
+    char fd_path[32];
+    sprintf(fd_path, "/proc/self/fd/%d", file_fd);
+    char* file_path = join_path(CLIENT_DIR, file_name);
+    if (!is_named) {
+        unlink(staging_path);
+    }
+    if ((!is_named && linkat(AT_FDCWD, fd_path, AT_FDCWD, staging_path, AT_SYMLINK_FOLLOW) < 0)
+            || rename(staging_path, file_path) < 0) {
+        unlink(staging_path);
+        printf("Failed to store file %s\n", file_name);
+    }
+    close(file_fd);
+    free(staging_path);
     free(file_path);
 }
 
 
+void write_download_block(int file_fd, const char* block, size_t block_len) {
+    while (block_len > 0) {
+        ssize_t n_written = write(file_fd, block, block_len);
+        if (n_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_written <= 0) {
+            die_with_error("Failed to write file", strerror(errno));
+        }
+        block += n_written;
+        block_len -= n_written;
+    }
+}
+
+
 int get_input(const char* prompt, int max_option) {
     static char input[BUFFSIZE];
     // repeatedly prompt for input, until read a valid input
@@ -456,8 +593,8 @@ uint32_t handle_logon(int server_socket, char* buffer) {
     fgets(buffer, BUFFSIZE, stdin); // consume new line character
 
     // Create logon request
-    ssize_t packet_len = make_logon_request(buffer, BUFFSIZE, is_new_user, username, password);
-    send(server_socket, buffer, packet_len, 0);
+    ssize_t packet_len = make_logon_request(buffer, BUFFSIZE, VERSION, is_new_user, username, password);
+    send_to_server(server_socket, buffer, packet_len);
 
     // Receive a session token
     packet_len = receive_packet(server_socket, buffer, BUFFSIZE);
@@ -470,7 +607,7 @@ uint32_t handle_logon(int server_socket, char* buffer) {
     
     // Check for error
     if (header->type == TYPE_ERROR) {
-        enum ErrorType error = buffer[HEADER_LEN] & 0xFF;
+        enum ErrorType error = buffer[get_header_len(header->version)] & 0xFF;
         const char* err_msg = "Failed to login";
         if (error == ERROR_SERVER_BUSY) {
             die_with_error(err_msg, "Server busy");
@@ -490,66 +627,70 @@ uint32_t handle_logon(int server_socket, char* buffer) {
 
 
 void handle_list(int server_socket, char* buffer, uint32_t session_token) {
-    int n_files;
-    struct FileInfo* server_files = get_server_files(server_socket, buffer, session_token, &n_files);
-    printf("Found %d files on server\n", n_files);
-    if (n_files == 0) {
+    struct FileTable server_files;
+    initialize_file_table(&server_files);
+    get_server_files(server_socket, buffer, session_token, &server_files);
+    printf("Found %d files on server\n", server_files.n_files);
+    if (server_files.n_files == 0) {
         return;        
     }
     printf("%-32s%8s\n", "File name", "Checksum");
-    struct FileInfo* cur_file;
-    // print all file infos in the linked list
-    for (cur_file = server_files; cur_file != NULL; cur_file = cur_file->next) {
-        printf("%-32s%8x\n", cur_file->name, cur_file->checksum);
+    // print all file infos in the table
+    int i;
+    for (i = 0; i < server_files.n_files; i++) {
+        struct FileInfo* cur_file = &server_files.files[i];
+        printf("%-32s%8x\n", get_file_name(&server_files, cur_file), cur_file->checksum);
     }
-    free_file_info(server_files);
+    free_file_table(&server_files);
 }
 
 
 void handle_diff(int server_socket, char* buffer, uint32_t session_token) {
     // get the diffs of server and client's files
-    struct FileInfo* client_missings;
-    struct FileInfo* server_missings;
+    struct FileTable client_missings;
+    struct FileTable server_missings;
     get_client_server_diffs(server_socket, buffer, session_token, &client_missings, &server_missings);
 
     // print the list of missing files
     printf("Files not in client:\n");
-    struct FileInfo* cur_file;
-    for (cur_file = client_missings; cur_file != NULL; cur_file = cur_file->next) {
-        printf("  %s\n", cur_file->name);
+    int i;
+    for (i = 0; i < client_missings.n_files; i++) {
+        printf("  %s\n", get_file_name(&client_missings, &client_missings.files[i]));
     }
     printf("\nFiles not in server:\n");
-    for (cur_file = server_missings; cur_file != NULL; cur_file = cur_file->next) {
-        printf("  %s\n", cur_file->name);
+    for (i = 0; i < server_missings.n_files; i++) {
+        printf("  %s\n", get_file_name(&server_missings, &server_missings.files[i]));
     }
 
     // release dynamically allocated resources
-    free_file_info(server_missings);
-    free_file_info(client_missings);
+    free_file_table(&server_missings);
+    free_file_table(&client_missings);
 }
 
 
 void handle_sync(int server_socket, char* buffer, uint32_t session_token) {
     // get the diffs of server and client's files
-    struct FileInfo* client_missings;
-    struct FileInfo* server_missings;
+    struct FileTable client_missings;
+    struct FileTable server_missings;
     get_client_server_diffs(server_socket, buffer, session_token, &client_missings, &server_missings);
 
-    struct FileInfo* cur_file;
+    int i;
     // upload to server the missing files
-    for (cur_file = server_missings; cur_file != NULL; cur_file = cur_file->next) {
+    for (i = 0; i < server_missings.n_files; i++) {
         // send file to server
-        upload_file(server_socket, buffer, session_token, cur_file->name);
+        upload_file(server_socket, buffer, session_token,
+                get_file_name(&server_missings, &server_missings.files[i]));
         // receive confirmation from server
         receive_packet(server_socket, buffer, BUFFSIZE);
     }
 
-    for (cur_file = client_missings; cur_file != NULL; cur_file = cur_file->next) {
+    for (i = 0; i < client_missings.n_files; i++) {
         // download from server
-        download_file(server_socket, buffer, session_token, cur_file->name);
+        download_file(server_socket, buffer, session_token,
+                get_file_name(&client_missings, &client_missings.files[i]));
     }
 
-    free_file_info(client_missings);
-    free_file_info(server_missings);
+    free_file_table(&client_missings);
+    free_file_table(&server_missings);
     printf("Sync completed\n");
 }
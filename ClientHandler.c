@@ -1,15 +1,52 @@
 #include "ClientHandler.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "AuthenticationService.h"
+#include "Catalog.h"
+#include "ChecksumIndex.h"
+#include "ListingCache.h"
+#include "PackStore.h"
 #include "StorageService.h"
 #include "NetworkHeader.h"
 #include "Protocol.h"
 
 
-/** Global buffer for reading/writing packet */
-static char packet_buffer[BUFFSIZE+1];
+/** Size of the pipe used to splice uploads. Larger pipes need fewer calls */
+#define UPLOAD_PIPE_SIZE (1024 * 1024)
+/** Capacity of a pipe unless changed */
+#define DEFAULT_PIPE_SIZE (64 * 1024)
+/** Uploads are written to their file in blocks of this size, aligned in the file */
+#define UPLOAD_BLOCK_SIZE (256 * 1024)
+
+/** Number of bytes a client may transfer per turn. Small enough to keep the
+ *  latency of other clients low, large enough to keep syscalls efficient */
+#define TRANSFER_QUANTUM (128 * 1024)
+
+/** Number of queued response bytes past which no new request is read from
+ *  a client, until it catches up. Bounds the memory held by slow readers */
+#define SEND_QUEUE_HIGH_WATER (256 * 1024)
+
+/** Number of spliced bytes read back at once to be digested */
+#define DIGEST_CHUNK_SIZE (64 * 1024)
+
+
+/**
+ * How a client's turn ended
+ */
+enum TurnResult {
+    /** The client is waiting for its socket to be ready */
+    TURN_IDLE,
+    /** The client used up its share of the turn, and has work left */
+    TURN_BUSY,
+    /** The client was removed */
+    TURN_CLOSED,
+};
 
 
 /*
@@ -17,6 +54,169 @@ static char packet_buffer[BUFFSIZE+1];
  */
 
 
+/**
+ * Readiness callback of the listening socket.
+ * Accept all pending connections.
+ */
+void on_server_socket_ready(struct EventSource* source, uint32_t events);
+
+
+/**
+ * Readiness callback of a commit request of the handler.
+ * Confirm the uploads of the request once it is done.
+ */
+void on_commit_ready(struct EventSource* source, uint32_t events);
+
+
+/**
+ * Callback: listings made by the storage workers are done. Answer the
+ * clients still waiting for them
+ */
+void on_listing_ready(struct EventSource* source, uint32_t events);
+
+
+/**
+ * Readiness callback of a client socket.
+ * Give the client a turn, unless it is already waiting for one.
+ */
+void on_client_socket_ready(struct EventSource* source, uint32_t events);
+
+
+/**
+ * Give a client a turn, adding a quantum to its deficit. If the client
+ * still has work left after the turn, it waits in the run queue.
+ */
+void serve_client(struct ClientInfo* client_info);
+
+
+/**
+ * Give one turn to each client currently in the run queue
+ */
+void serve_queued_clients(struct ClientHandler* handler);
+
+
+/**
+ * Accept a new client connection. The client is rejected if number of current connections
+ * already reached max number allowed.
+ * Also set up book-keeping data for the new client.
+ * @param handler       The handler to serve the new client
+ * @param client_socket Socket of the new client
+ */ 
+void accept_client(struct ClientHandler* handler, int client_socket);
+
+
+/**
+ * Make as much progress as possible on a client connection without blocking:
+ * send the pending responses, receive packets and handle complete requests.
+ * Return when the socket has no more data (or buffer space), when the client
+ * has used up its deficit, or when the client is removed.
+ */
+enum TurnResult handle_client(struct ClientInfo* client_info);
+
+
+/**
+ * Receive bytes of the current packet into the client's read buffer
+ * @return Length of the packet part to handle if it is complete,
+ *         0 if more data is needed and the socket has none for now,
+ *         -1 if error or the connection is closed
+ */
+ssize_t receive_request(struct ClientInfo* client_info);
+
+
+/**
+ * Handle a complete request in the client's read buffer, and update the
+ * client info if needed. The response (if any) is queued to be sent.
+ * @param request_len Length of the request in the read buffer
+ * @return true if the client is still connected, false if it was removed
+ */
+bool handle_request(struct ClientInfo* client_info, size_t request_len);
+
+
+/**
+ * Receive the content of an uploaded file and write it to disk.
+ * Bytes are moved socket -> pipe -> file with splice(), so they are
+ * never copied to user space, and hashed from the page cache right after.
+ * If splice is not supported, they are copied through the read buffer
+ * instead.
+ * @return 1 if the whole file is received, 0 if the socket has no data
+ *         for now, -1 if error
+ */
+int receive_file_content(struct ClientInfo* client_info);
+
+
+/**
+ * @return Length of the blocks the pipe of an upload is moved to the file
+ *         in: the largest that leaves room in the pipe for the next block
+ */
+size_t get_upload_block_len(const struct ClientInfo* client_info);
+
+
+/**
+ * Copy the rest of an uploaded file through the read buffer
+ * @return Same as receive_file_content
+ */
+int copy_file_content(struct ClientInfo* client_info);
+
+
+/**
+ * Write the whole data to a file, retrying on partial writes
+ * @return 0 if success, -1 if error
+ */
+int write_to_file(int file_fd, const char* data, size_t data_len);
+
+
+/**
+ * Write the next bytes of an uploaded file (or of its chunks, when storing
+ * chunks), and add them to its checksum (and digest, when storing blobs)
+ * @return 0 if success, -1 if error
+ */
+int write_upload_content(struct ClientInfo* client_info, const char* data, size_t data_len);
+
+
+/**
+ * Add the bytes just spliced into an uploaded file to its checksum (and
+ * digest, when storing blobs).
+ * The bytes are read back while they are still in the page cache.
+ * @return 0 if success, -1 if error
+ */
+int hash_spliced_content(struct ClientInfo* client_info, size_t data_len);
+
+
+/**
+ * Release the file and pipe of an upload. If the upload is not complete,
+ * the half-received file is discarded.
+ */
+void close_upload(struct ClientInfo* client_info, bool is_complete);
+
+
+/**
+ * Hand the response built in the write buffer over to the send queue
+ * @param response_len Length of the response
+ * @return 0 if success, -1 if out of memory
+ */
+int queue_response(struct ClientInfo* client_info, size_t response_len);
+
+
+/**
+ * Drop the first n bytes of the read buffer, keeping the bytes after them
+ */
+void consume_read_buffer(struct ClientInfo* client_info, size_t n);
+
+
+/**
+ * @return The write buffer of the client, allocated if needed,
+ *         or NULL if out of memory
+ */
+char* get_write_buffer(struct ClientInfo* client_info);
+
+
+/**
+ * Release the buffers of a client that is not in the middle of a packet,
+ * so that idle connections don't hold any buffer
+ */
+void release_idle_buffers(struct ClientInfo* client_info);
+
+
 /**
  * Close the connection to a client, and clear the client's info
  * @param client_info Address of the struct storing the client's info
@@ -29,7 +229,7 @@ void remove_client(struct ClientInfo* client_info);
  * @param request_len Length of request packet
  * @param client_info Address of the client info struct
  */
-ssize_t handle_logon(int request_len, struct ClientInfo* client_info, bool is_new_user, enum ErrorType* error);
+ssize_t handle_logon(size_t request_len, struct ClientInfo* client_info, bool is_new_user, enum ErrorType* error);
 
 
 /**
@@ -48,22 +248,75 @@ ssize_t handle_list(struct ClientInfo* client_info, enum ErrorType* error);
 
 /**
  * Handle a file request. Send back the file requested
+ * @param request_len Length of request packet
+ */
+ssize_t handle_file_request(size_t request_len, struct ClientInfo* client_info, enum ErrorType* error);
+
+
+/**
+ * Handle the start of a file transfer from client: open the file and
+ * write the part of the file already received. The rest of the file is
+ * received in STATE_RECEIVE_FILE.
+ * @param n_received Number of bytes of the packet in the read buffer
+ */
+ssize_t handle_file_transfer(size_t n_received, struct ClientInfo* client_info, enum ErrorType* error);
+
+
+/**
+ * Finish receiving an uploaded file, and respond with a confirmation
+ */
+ssize_t finish_file_transfer(struct ClientInfo* client_info);
+
+
+/**
+ * Have a storage worker list the files of a client, which waits for the
+ * listing without handling new requests
+ * @return 0 if success, -1 if error
+ */
+int start_listing(struct ClientInfo* client_info);
+
+
+/**
+ * Answer a client with the files a storage worker listed
  */
-ssize_t handle_file_request(struct ClientInfo* client_info, enum ErrorType* error);
+void finish_listing(struct ClientInfo* client_info, struct ListingRequest* listing);
 
 
 /**
- * Handle a file transfer from client
+ * Hold the confirmation of a stored upload until the handler's current
+ * commit request is done
  */
-ssize_t handle_file_transfer(int n_received, struct ClientInfo* client_info, enum ErrorType* error);
+void wait_for_commit(struct ClientInfo* client_info);
 
 
+/**
+ * Confirm the uploads waiting for a commit request of the handler, if the
+ * request is done. The clients get a turn to send the confirmations
+ */
+void confirm_committed_uploads(struct ClientHandler* handler, int slot);
+
+
+/**
+ * Put a completely received upload in place of the previous file of the
+ * same name
+ * @return 0 if success, -1 if error
+ */
+int store_upload(struct ClientInfo* client_info);
+
+
+/**
+ * Queue the chunks of a chunked file after its header
+ * @return 0 if success, -1 if out of memory
+ */
+int queue_chunks(struct ClientInfo* client_info, const struct ChunkList* chunks);
+
 
 /**
  * Generate a 32 bit random token. Warning: Not secure random.
  * Used because security is not considered in this project.
+ * @param random_seed State of the random generator
  */
-uint32_t generate_random_token();
+uint32_t generate_random_token(unsigned int* random_seed);
 
 
 /*
@@ -77,57 +330,352 @@ void initialize_client_handler() {
 }
 
 
-void accept_client(int server_socket, struct ClientInfo* client_infos, int max_connections) {
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    int client_socket = accept(server_socket, (struct sockaddr*) &client_addr, &client_addr_len);
-    if (client_socket < 0) {
-        // an error happens
-        char* error_detail = strerror(client_socket);
-        printf("Error when accepting new client: %s\n", error_detail);
+int create_client_handler(struct ClientHandler* handler, int server_socket, int max_connections) {
+    handler->random_seed = rand();
+    initialize_run_queue(&handler->run_queue);
+    if (initialize_connection_table(&handler->connections, max_connections) < 0) {
+        return -1;
+    }
+    if (initialize_event_loop(&handler->loop) < 0) {
+        return -1;
+    }
+    handler->commit_slot = 0;
+    int slot;
+    for (slot = 0; slot < 2 && is_durable_storage(); slot++) {
+        initialize_run_queue(&handler->commit_waiters[slot]);
+        if (initialize_commit_request(&handler->commits[slot]) < 0) {
+            return -1;
+        }
+        handler->commit_sources[slot].fd = handler->commits[slot].event_fd;
+        handler->commit_sources[slot].callback = on_commit_ready;
+        handler->commit_sources[slot].context = handler;
+        if (add_event_source(&handler->loop, &handler->commit_sources[slot], EPOLLIN) < 0) {
+            return -1;
+        }
+    }
+    handler->listings = NULL;
+    handler->listing_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (handler->listing_event_fd < 0) {
+        return -1;
+    }
+    handler->listing_source.fd = handler->listing_event_fd;
+    handler->listing_source.callback = on_listing_ready;
+    handler->listing_source.context = handler;
+    if (add_event_source(&handler->loop, &handler->listing_source, EPOLLIN) < 0) {
+        return -1;
+    }
+    handler->server_source.fd = server_socket;
+    handler->server_source.callback = on_server_socket_ready;
+    handler->server_source.context = handler;
+    return add_event_source(&handler->loop, &handler->server_source, EPOLLIN);
+}
+
+
+void run_client_handler(struct ClientHandler* handler) {
+    while (1) {
+        // don't wait for new events if some clients have work left
+        int timeout_ms = handler->run_queue.n_entries > 0 ? 0 : -1;
+        if (dispatch_events(&handler->loop, timeout_ms) < 0) {
+            printf("Error when waiting for events: %s\n", strerror(errno));
+        }
+        // the events of the batch are all dispatched, none refers to the
+        // clients removed meanwhile
+        recycle_connections(&handler->connections);
+        serve_queued_clients(handler);
+    }
+}
+
+
+/*
+ * Helper function implementations
+ */
+
+
+void on_server_socket_ready(struct EventSource* source, uint32_t events) {
+    struct ClientHandler* handler = source->context;
+    // edge-triggered: accept until there is no pending connection left
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_socket = accept4(source->fd, (struct sockaddr*) &client_addr, 
+                &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // an error happens
+                printf("Error when accepting new client: %s\n", strerror(errno));
+            }
+            return;
+        }
+        printf("\nHandling connection request\n");
+        accept_client(handler, client_socket);
+    }
+}
+
+
+void on_commit_ready(struct EventSource* source, uint32_t events) {
+    struct ClientHandler* handler = source->context;
+    confirm_committed_uploads(handler, source == &handler->commit_sources[0] ? 0 : 1);
+}
+
+
+void on_listing_ready(struct EventSource* source, uint32_t events) {
+    struct ClientHandler* handler = source->context;
+    // the event only tells that some listing is done, find which
+    uint64_t n_events;
+    while (read(handler->listing_event_fd, &n_events, sizeof(n_events)) > 0) {
+    }
+    struct ListingRequest** link = &handler->listings;
+    while (*link != NULL) {
+        struct ListingRequest* listing = *link;
+        if (!is_user_listing_done(listing)) {
+            link = &listing->next;
+            continue;
+        }
+        *link = listing->next;
+        // the client may have left meanwhile
+        if (listing->context != NULL) {
+            finish_listing(listing->context, listing);
+        }
+        free_user_listing(listing);
+    }
+}
+
+
+void on_client_socket_ready(struct EventSource* source, uint32_t events) {
+    struct ClientInfo* client_info = source->context;
+    if (events & EPOLLERR) {
+        printf("Error on client socket\n");
+        remove_client(client_info);
         return;
     }
-    // find an empty array slot to store client info
-    int i;
-    for (i = 0; i < max_connections; i++) {
-        if (client_infos[i].client_socket <= 0) {
-            client_infos[i].client_socket = client_socket;  
-            printf("Accepted new client, assigned client ID = %d\n", i);
+    // a queued client catches up on the new events in its next turn
+    if (!is_queued(&client_info->run_entry)) {
+        serve_client(client_info);
+    }
+}
+
+
+void serve_client(struct ClientInfo* client_info) {
+    client_info->deficit += TRANSFER_QUANTUM;
+    enum TurnResult result = handle_client(client_info);
+    if (result == TURN_BUSY) {
+        push_run_queue(&client_info->handler->run_queue, &client_info->run_entry);
+    } else if (result == TURN_IDLE) {
+        // an idle client doesn't save up its unused share
+        client_info->deficit = 0;
+    }
+}
+
+
+void serve_queued_clients(struct ClientHandler* handler) {
+    // clients going back to the queue wait for the next round
+    int n_turns = handler->run_queue.n_entries;
+    while (n_turns-- > 0) {
+        struct RunQueueEntry* entry = pop_run_queue(&handler->run_queue);
+        if (entry == NULL) {
+            break;
+        }
+        serve_client(entry->context);
+    }
+}
+
+
+void accept_client(struct ClientHandler* handler, int client_socket) {
+    struct ClientInfo* client_info = add_connection(&handler->connections, client_socket);
+    if (client_info != NULL) {
+        client_info->handler = handler;
+        client_info->user_dir_fd = -1;
+        client_info->upload_fd = -1;
+        client_info->upload_buffer = NULL;
+        initialize_run_queue_entry(&client_info->run_entry, client_info);
+        initialize_run_queue_entry(&client_info->commit_entry, client_info);
+        client_info->commit_slot = 0;
+        client_info->listing = NULL;
+        initialize_send_queue(&client_info->send_queue);
+        client_info->source.fd = client_socket;
+        client_info->source.callback = on_client_socket_ready;
+        client_info->source.context = client_info;
+        if (add_event_source(&handler->loop, &client_info->source, EPOLLIN | EPOLLOUT | EPOLLRDHUP) < 0) {
+            printf("Error when watching new client: %s\n", strerror(errno));
+            close(client_socket);
+            remove_connection(&handler->connections, client_info);
             return;
         }
+        printf("Accepted new client, assigned client ID = %d\n", client_socket);
+        return;
     }
     // if get to here, max number of clients has been reached
-    // so we reject this new client
+    // so we reject this new client. The client's version is not known yet,
+    // so use the oldest one, which all clients understand
     printf("Reject client, max number of connections exceeded\n");
+    char response[BUFFSIZE];
     ssize_t response_len = make_error_response(
-            packet_buffer, BUFFSIZE, 0, ERROR_SERVER_BUSY);
-    send(client_socket, packet_buffer, response_len, 0);
+            response, BUFFSIZE, VERSION_1, 0, ERROR_SERVER_BUSY);
+    send(client_socket, response, response_len, MSG_NOSIGNAL);
     close(client_socket);
 }
 
 
-void handle_client(struct ClientInfo* client_info) {
-    ssize_t request_len = receive_packet(client_info->client_socket, packet_buffer, BUFFSIZE);
-    if (request_len <= 0) {
-        // always close the session if any error happens
-        printf("Error when receiving packet\n");
-        remove_client(client_info);
-        return;
+enum TurnResult handle_client(struct ClientInfo* client_info) {
+    while (1) {
+        if (client_info->deficit <= 0) {
+            return TURN_BUSY;
+        }
+
+        // send what the socket accepts of the pending responses
+        ssize_t n_sent = flush_send_queue(&client_info->send_queue,
+                client_info->client_socket, client_info->deficit);
+        if (n_sent < 0) {
+            printf("Error when sending response\n");
+            remove_client(client_info);
+            return TURN_CLOSED;
+        }
+        client_info->deficit -= n_sent;
+        bool is_flushed = is_send_queue_empty(&client_info->send_queue);
+        if (!is_flushed && client_info->deficit <= 0) {
+            return TURN_BUSY;
+        }
+
+        if (client_info->state == STATE_CLOSING) {
+            if (is_flushed) {
+                remove_client(client_info);
+                return TURN_CLOSED;
+            }
+            // wait for the socket to be writable again
+            return TURN_IDLE;
+        }
+
+        if (client_info->state == STATE_AWAIT_COMMIT || client_info->state == STATE_AWAIT_LISTING) {
+            // the next requests wait for the upload to be confirmed, or
+            // for the files to be listed
+            return TURN_IDLE;
+        }
+
+        if (client_info->state == STATE_RECEIVE_FILE) {
+            int received = receive_file_content(client_info);
+            if (received < 0) {
+                printf("Error when receiving file\n");
+                remove_client(client_info);
+                return TURN_CLOSED;
+            }
+            if (received == 0) {
+                return client_info->deficit <= 0 ? TURN_BUSY : TURN_IDLE;
+            }
+            // the whole file is received, confirm it, unless the
+            // confirmation waits for a commit
+            ssize_t response_len = finish_file_transfer(client_info);
+            if (response_len < 0 || (response_len > 0 && queue_response(client_info, response_len) < 0)) {
+                remove_client(client_info);
+                return TURN_CLOSED;
+            }
+            continue;
+        }
+
+        if (client_info->send_queue.n_pending >= SEND_QUEUE_HIGH_WATER) {
+            // the client doesn't read its responses fast enough. Leave its
+            // requests in the socket until the queue drains
+            return TURN_IDLE;
+        }
+
+        ssize_t request_len = receive_request(client_info);
+        if (request_len == 0) {
+            // no more request for now, wait for the socket to be ready again
+            release_idle_buffers(client_info);
+            return TURN_IDLE;
+        }
+        if (request_len < 0) {
+            // always close the session if any error happens
+            printf("Error when receiving packet\n");
+            remove_client(client_info);
+            return TURN_CLOSED;
+        }
+        if (!handle_request(client_info, request_len)) {
+            return TURN_CLOSED;
+        }
+    }
+}
+
+
+ssize_t receive_request(struct ClientInfo* client_info) {
+    if (client_info->read_buffer == NULL) {
+        client_info->read_buffer = malloc(BUFFSIZE);
+        if (client_info->read_buffer == NULL) {
+            return -1;
+        }
     }
-    struct PacketHeader* header = (struct PacketHeader*)packet_buffer;
+
+    while (1) {
+        // once the header is received, the packet length is known.
+        // A packet longer than the buffer is handled in parts (file uploads)
+        if (client_info->n_read >= MIN_HEADER_LEN) {
+            size_t header_len = get_header_len(client_info->read_buffer[0]);
+            if (header_len == 0) {
+                printf("Unsupported protocol version\n");
+                return -1;
+            }
+            if (client_info->n_read >= header_len) {
+                uint64_t packet_len = get_packet_len(client_info->read_buffer);
+                if (packet_len < header_len) {
+                    return -1;
+                }
+                if (packet_len > BUFFSIZE) {
+                    packet_len = BUFFSIZE;
+                }
+                if (client_info->n_read >= packet_len) {
+                    return packet_len;
+                }
+            }
+        }
+
+        // read as much as the buffer can hold. Bytes past the current packet
+        // are kept for the next one
+        ssize_t n_new_bytes = recv(client_info->client_socket,
+                client_info->read_buffer + client_info->n_read,
+                BUFFSIZE - client_info->n_read, 0);
+        if (n_new_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n_new_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_new_bytes <= 0) {
+            // fail to recv, or the client closed the connection
+            return -1;
+        }
+        client_info->n_read += n_new_bytes;
+        client_info->deficit -= n_new_bytes;
+    }
+}
+
+
+bool handle_request(struct ClientInfo* client_info, size_t request_len) {
+    struct PacketHeader* header = (struct PacketHeader*)client_info->read_buffer;
+    // answer in the version the client speaks
+    client_info->version = header->version;
     
     // check if the header token is correct
     uint32_t session_token = header->session_token;
     if(session_token != client_info->session_token) {
         printf("Wrong session token!\n");
         remove_client(client_info);
-        return;
+        return false;
+    }
+
+    // the response is built in the write buffer
+    if (get_write_buffer(client_info) == NULL) {
+        printf("Out of memory\n");
+        remove_client(client_info);
+        return false;
     }
 
     // construct response packet
     ssize_t response_len = -1;
     enum ErrorType error = ERROR_UNKNOWN;
-    switch (header->type) {
+    uint8_t type = header->type;
+    switch (type) {
         case TYPE_SIGNUP_REQUEST:
             response_len = handle_logon(request_len, client_info, true, &error);
             break;
@@ -141,42 +689,292 @@ void handle_client(struct ClientInfo* client_info) {
             response_len = handle_list(client_info, &error);
             break;
         case TYPE_FILE_REQUEST:
-            response_len = handle_file_request(client_info, &error);
+            response_len = handle_file_request(request_len, client_info, &error);
             break;
         case TYPE_FILE_TRANSFER:
             response_len = handle_file_transfer(request_len, client_info, &error);
             break;
     }
+    // a file transfer consumes its packet itself, while streaming to disk
+    if (type != TYPE_FILE_TRANSFER) {
+        consume_read_buffer(client_info, request_len);
+    }
+
     if (response_len < 0) {
         // fatal error while handling client request
-        // close connection immediately
-        response_len = make_error_response(
-                packet_buffer, BUFFSIZE, client_info->session_token, error);
-        send(client_info->client_socket, packet_buffer, response_len, 0);
+        // close connection once the error response is sent
+        char* packet_buffer = get_write_buffer(client_info);
+        if (packet_buffer == NULL) {
+            remove_client(client_info);
+            return false;
+        }
+        response_len = make_error_response(packet_buffer,
+                BUFFSIZE, client_info->version, client_info->session_token, error);
+        client_info->state = STATE_CLOSING;
+    }
+
+    // the response is sent by the next flush of the send queue
+    if (response_len > 0 && queue_response(client_info, response_len) < 0) {
+        printf("Out of memory\n");
         remove_client(client_info);
-        return;
-    } else if (response_len == 0) {
-        return;
+        return false;
+    }
+    return true;
+}
+
+
+int receive_file_content(struct ClientInfo* client_info) {
+    if (client_info->upload_pipe[0] < 0) {
+        return copy_file_content(client_info);
+    }
+
+    // the pipe is emptied completely at the end of the file, or when it
+    // may be too full to take more from the socket
+    bool is_draining = false;
+    while (client_info->upload_remaining > 0 || client_info->upload_piped > 0) {
+        // move what is in the pipe to the file, up to a block boundary, so
+        // that the file is written in large aligned blocks
+        size_t move_len = client_info->upload_piped;
+        if (client_info->upload_remaining > 0 && !is_draining) {
+            size_t block_len = get_upload_block_len(client_info);
+            uint64_t block_end = (client_info->upload_offset + client_info->upload_piped)
+                    / block_len * block_len;
+            move_len = block_end > client_info->upload_offset ? block_end - client_info->upload_offset : 0;
+        }
+        while (move_len > 0) {
+            ssize_t n_new_bytes = splice(client_info->upload_pipe[0], NULL,
+                    client_info->upload_fd, NULL, move_len, SPLICE_F_MOVE);
+            if (n_new_bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n_new_bytes <= 0 || hash_spliced_content(client_info, n_new_bytes) < 0) {
+                return -1;
+            }
+            client_info->upload_piped -= n_new_bytes;
+            move_len -= n_new_bytes;
+        }
+        is_draining = false;
+        if (client_info->upload_remaining == 0) {
+            break;
+        }
+        if (client_info->deficit <= 0) {
+            // the rest waits for the next turn
+            return 0;
+        }
+
+        // fill the pipe from the socket
+        size_t max_len = client_info->upload_remaining;
+        if (max_len > (size_t)client_info->deficit) {
+            max_len = client_info->deficit;
+        }
+        if (max_len > client_info->upload_pipe_size - client_info->upload_piped) {
+            max_len = client_info->upload_pipe_size - client_info->upload_piped;
+        }
+        ssize_t n_new_bytes = splice(client_info->client_socket, NULL,
+                client_info->upload_pipe[1], NULL, max_len,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n_new_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+                && client_info->upload_piped > 0) {
+            // the pipe may be full of small packets: empty it, then try
+            // again, since the socket won't be reported readable again
+            is_draining = true;
+            continue;
+        }
+        if (n_new_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // the rest of the file is still in flight
+            return 0;
+        }
+        if (n_new_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_new_bytes < 0 && errno == EINVAL) {
+            // splice is not supported for this socket or file
+            close(client_info->upload_pipe[0]);
+            close(client_info->upload_pipe[1]);
+            client_info->upload_pipe[0] = client_info->upload_pipe[1] = -1;
+            return copy_file_content(client_info);
+        }
+        if (n_new_bytes <= 0) {
+            return -1;
+        }
+        client_info->upload_remaining -= n_new_bytes;
+        client_info->upload_piped += n_new_bytes;
+        client_info->deficit -= n_new_bytes;
     }
+    return 1;
+}
+
 
-    // send back response packet
-    send(client_info->client_socket, packet_buffer, response_len, 0);
+size_t get_upload_block_len(const struct ClientInfo* client_info) {
+    size_t block_len = client_info->upload_pipe_size / 2;
+    return block_len < UPLOAD_BLOCK_SIZE ? block_len : UPLOAD_BLOCK_SIZE;
 }
 
 
-/*
- * Helper function implementations
- */
+int copy_file_content(struct ClientInfo* client_info) {
+    while (client_info->upload_remaining > 0) {
+        if (client_info->deficit <= 0) {
+            // the rest waits for the next turn
+            return 0;
+        }
+        size_t max_len = client_info->upload_remaining < BUFFSIZE ? client_info->upload_remaining : BUFFSIZE;
+        ssize_t n_new_bytes = recv(client_info->client_socket,
+                client_info->read_buffer, max_len, 0);
+        if (n_new_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // the rest of the file is still in flight
+            return 0;
+        }
+        if (n_new_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_new_bytes <= 0) {
+            return -1;
+        }
+        client_info->upload_remaining -= n_new_bytes;
+        client_info->deficit -= n_new_bytes;
+        if (write_upload_content(client_info, client_info->read_buffer, n_new_bytes) < 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
 
 
-ssize_t handle_logon(int request_len, struct ClientInfo* client_info, bool is_new_user, enum ErrorType* error) {
-    char* request_end = packet_buffer + request_len;
+int write_to_file(int file_fd, const char* data, size_t data_len) {
+    while (data_len > 0) {
+        ssize_t n_written = write(file_fd, data, data_len);
+        if (n_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_written < 0) {
+            return -1;
+        }
+        data += n_written;
+        data_len -= n_written;
+    }
+    return 0;
+}
+
+
+int write_upload_content(struct ClientInfo* client_info, const char* data, size_t data_len) {
+    if (client_info->upload_buffer != NULL) {
+        memcpy(client_info->upload_buffer + client_info->upload_offset, data, data_len);
+    } else if (is_chunk_storage()) {
+        if (write_chunked_content(&client_info->upload_chunks, data, data_len) < 0) {
+            return -1;
+        }
+    } else if (write_to_file(client_info->upload_fd, data, data_len) < 0) {
+        return -1;
+    }
+    client_info->upload_checksum = crc32_update(client_info->upload_checksum, data, data_len);
+    if (is_blob_storage() && client_info->upload_buffer == NULL) {
+        update_sha256(&client_info->upload_digest, data, data_len);
+    }
+    client_info->upload_offset += data_len;
+    return 0;
+}
+
+
+int hash_spliced_content(struct ClientInfo* client_info, size_t data_len) {
+    if (!is_blob_storage()) {
+        uint64_t n_hashed = data_len;
+        uint32_t checksum;
+        if (crc32_file_range(client_info->upload_fd, client_info->upload_offset, &n_hashed, &checksum) < 0
+                || n_hashed != data_len) {
+            return -1;
+        }
+        client_info->upload_checksum = crc32_combine_checksums(client_info->upload_checksum,
+                checksum, data_len);
+        client_info->upload_offset += data_len;
+        return 0;
+    }
+
+    // both hashes are fed from a single read of each chunk
+    char chunk[DIGEST_CHUNK_SIZE];
+    while (data_len > 0) {
+        size_t chunk_len = data_len < DIGEST_CHUNK_SIZE ? data_len : DIGEST_CHUNK_SIZE;
+        ssize_t bytes_read = pread(client_info->upload_fd, chunk, chunk_len, client_info->upload_offset);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        client_info->upload_checksum = crc32_update(client_info->upload_checksum, chunk, bytes_read);
+        update_sha256(&client_info->upload_digest, chunk, bytes_read);
+        client_info->upload_offset += bytes_read;
+        data_len -= bytes_read;
+    }
+    return 0;
+}
+
+
+void close_upload(struct ClientInfo* client_info, bool is_complete) {
+    if (client_info->upload_buffer != NULL) {
+        // nothing was written to disk
+        free(client_info->upload_buffer);
+        client_info->upload_buffer = NULL;
+    } else {
+        close_upload_file(client_info->upload_fd);
+        if (client_info->upload_pipe[0] >= 0) {
+            close(client_info->upload_pipe[0]);
+            close(client_info->upload_pipe[1]);
+        }
+        client_info->upload_fd = -1;
+        if (is_chunk_storage()) {
+            free_chunk_writer(&client_info->upload_chunks);
+        }
+        // an incomplete upload vanishes with its file
+    }
+    if (!is_complete) {
+        abort_file_update(client_info->username, client_info->user_dir_fd, client_info->upload_name);
+    }
+    // the file changed, even if the directory didn't
+    invalidate_cached_listing(client_info->username);
+    client_info->state = STATE_RECEIVE_PACKET;
+}
+
+
+int queue_response(struct ClientInfo* client_info, size_t response_len) {
+    // the queue owns the buffer now, the next response gets a new one
+    char* response = client_info->write_buffer;
+    client_info->write_buffer = NULL;
+    return push_buffer_segment(&client_info->send_queue, response, response_len);
+}
+
+
+void consume_read_buffer(struct ClientInfo* client_info, size_t n) {
+    client_info->n_read -= n;
+    memmove(client_info->read_buffer, client_info->read_buffer + n, client_info->n_read);
+}
+
+
+char* get_write_buffer(struct ClientInfo* client_info) {
+    if (client_info->write_buffer == NULL) {
+        client_info->write_buffer = malloc(BUFFSIZE);
+    }
+    return client_info->write_buffer;
+}
+
+
+void release_idle_buffers(struct ClientInfo* client_info) {
+    if (client_info->state == STATE_RECEIVE_PACKET && client_info->n_read == 0) {
+        free(client_info->read_buffer);
+        client_info->read_buffer = NULL;
+    }
+    free(client_info->write_buffer);
+    client_info->write_buffer = NULL;
+}
+
+
+ssize_t handle_logon(size_t request_len, struct ClientInfo* client_info, bool is_new_user, enum ErrorType* error) {
+    char* request_end = client_info->read_buffer + request_len;
 
     /*
      * Extract username and password from packet
      */
-    char* username = packet_buffer + HEADER_LEN;
-    size_t username_len = strlen(username) + 1;  // include null terminator
+    char* username = client_info->read_buffer + get_header_len(client_info->version);
+    size_t username_len = strnlen(username, request_end - username) + 1;  // include null terminator
     char* password = username + username_len;
     if (password >= request_end) {
         // username is not null terminated properly
@@ -184,7 +982,7 @@ ssize_t handle_logon(int request_len, struct ClientInfo* client_info, bool is_ne
         return -1;
     }
 
-    size_t password_len = strlen(password) + 1;  // include null terminator
+    size_t password_len = strnlen(password, request_end - password) + 1;  // include null terminator
     if (password + password_len != request_end) {
         // password is not null terminated properly
         *error = ERROR_MALFORMED_REQUEST;
@@ -196,6 +994,11 @@ ssize_t handle_logon(int request_len, struct ClientInfo* client_info, bool is_ne
      */
     if (is_new_user) {
         printf("User signup: %s\n", username);
+        if (is_reserved_user_name(username)) {
+            printf("Username is reserved!\n");
+            *error = ERROR_USERNAME_TAKEN;
+            return -1;
+        }
         if (!create_user(username, password)) {
             printf("User already exist!\n");
             *error = ERROR_USERNAME_TAKEN;
@@ -214,16 +1017,27 @@ ssize_t handle_logon(int request_len, struct ClientInfo* client_info, bool is_ne
      * Save info about user
      */
     create_user_directory(username);
+    int user_dir_fd = open_user_directory(username);
+    if (user_dir_fd < 0) {
+        printf("ERROR: Can't open user directory\n");
+        *error = ERROR_UNKNOWN;
+        return -1;
+    }
+    if (client_info->user_dir_fd >= 0) {
+        // logged on again, maybe as another user
+        close(client_info->user_dir_fd);
+    }
+    client_info->user_dir_fd = user_dir_fd;
     memcpy(client_info->username, username, username_len);
 
     /*
      * Response with session token
      */
-    uint32_t token = generate_random_token();
+    uint32_t token = generate_random_token(&client_info->handler->random_seed);
     client_info->session_token = token;
 
     // response contains user's session token
-    return make_token_response(packet_buffer, BUFFSIZE, token);
+    return make_token_response(client_info->write_buffer, BUFFSIZE, client_info->version, token);
 }
 
 
@@ -234,109 +1048,460 @@ ssize_t handle_leave(struct ClientInfo* client_info) {
 
 
 ssize_t handle_list(struct ClientInfo* client_info, enum ErrorType* error) {
-    int n_files;
-    struct FileInfo* client_files = list_user_files(client_info->username, &n_files);
-    // print out list of files
-    printf("List: found %d files in user directory\n", n_files);
+    // the list is encoded right after the header of the response
+    size_t header_len = get_header_len(client_info->version);
+    char* list_body = client_info->write_buffer + header_len;
+    size_t max_body_len = BUFFSIZE - header_len;
+
+    // reuse the last listing if the directory didn't change since
+    struct stat dir_stat;
+    uint64_t generation;
+    ssize_t body_len = -1;
+    bool is_dir_stat = fstat(client_info->user_dir_fd, &dir_stat) == 0;
+    if (is_dir_stat) {
+        body_len = read_cached_listing(client_info->username, &dir_stat,
+                list_body, max_body_len, &generation);
+    }
+    if (body_len < 0) {
+        struct FileTable client_files;
+        initialize_file_table(&client_files);
+        if (list_known_user_files(client_info->username, client_info->user_dir_fd, &client_files) > 0) {
+            // the directory must be scanned first, which a storage worker
+            // does while this thread serves the other clients
+            free_file_table(&client_files);
+            return start_listing(client_info);
+        }
+        // print out list of files
+        printf("List: found %d files in user directory\n", client_files.n_files);
+        body_len = make_list_body(list_body, max_body_len, &client_files);
+        free_file_table(&client_files);
+        if (body_len >= 0 && is_dir_stat) {
+            store_cached_listing(client_info->username, generation, &dir_stat, list_body, body_len);
+        }
+    }
+    if (body_len < 0) {
+        return -1;
+    }
 
     // response packet
-    ssize_t packet_len = make_list_response(
-            packet_buffer, BUFFSIZE, client_info->session_token, client_files, n_files);
-    free_file_info(client_files);
-    return packet_len;
+    return make_list_response(client_info->write_buffer, BUFFSIZE, client_info->version,
+            client_info->session_token, list_body, body_len);
 }
 
 
-ssize_t handle_file_request(struct ClientInfo* client_info, enum ErrorType* error) {
+ssize_t handle_file_request(size_t request_len, struct ClientInfo* client_info, enum ErrorType* error) {
+    char* packet_buffer = client_info->write_buffer;
     // get file name from request
     char file_name[MAX_FILE_NAME_LEN];
-    memcpy(file_name, packet_buffer + HEADER_LEN, MAX_FILE_NAME_LEN);
+    size_t header_len = get_header_len(client_info->version);
+    size_t file_name_len = request_len - header_len;
+    if (file_name_len > MAX_FILE_NAME_LEN - 1) {
+        file_name_len = MAX_FILE_NAME_LEN - 1;
+    }
+    memcpy(file_name, client_info->read_buffer + header_len, file_name_len);
+    file_name[file_name_len] = 0;
     printf("File %s requested\n", file_name);
 
-    // open file descriptor
-    char* dir_path = path_to_user(client_info->username);
-    char* file_path = join_path(dir_path, file_name);
-    free(dir_path);
-    FILE* file = fopen(file_path, "rb");
-    free(file_path);
-    if (file == NULL) {
+    // open file descriptor. The catalog tells whether the file exists, and
+    // whether it is packed, in which case it is a range of the pack segment.
+    // A file added behind the server's back is only in the directory until
+    // the next listing
+    int file_fd = -1;
+    off_t file_offset = 0;
+    size_t file_size = 0;
+    struct CatalogEntry entry;
+    bool is_packed = false;
+    if (find_user_file(client_info->username, client_info->user_dir_fd, file_name, &entry) == 0) {
+        is_packed = entry.is_packed;
+        if (is_packed) {
+            file_fd = open_packed_file(client_info->username, client_info->user_dir_fd,
+                    file_name, &file_offset, &file_size);
+        } else {
+            file_fd = openat(client_info->user_dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+        }
+    } else if (!is_reserved_file_name(file_name)) {
+        file_fd = openat(client_info->user_dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+    }
+    struct stat file_stat;
+    if (file_fd < 0 || (!is_packed && (fstat(file_fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)))) {
         printf("ERROR: Requested file doesn't exist\n");
-        return make_error_response(packet_buffer, BUFFSIZE, client_info->session_token, ERROR_FILE_NOT_EXIST);
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        return make_error_response(packet_buffer, BUFFSIZE, client_info->version,
+                client_info->session_token, ERROR_FILE_NOT_EXIST);
     }
 
     // get size of file
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    if (!is_packed) {
+        file_size = file_stat.st_size;
+    }
+    // a chunked file is sent from its chunks
+    struct ChunkList chunks;
+    initialize_chunk_list(&chunks);
+    bool is_chunked = !is_packed && is_chunk_list(file_fd);
+    if (is_chunked) {
+        int result = read_chunk_list(file_fd, &chunks);
+        close(file_fd);
+        if (result < 0) {
+            printf("ERROR: Requested file is damaged\n");
+            free_chunk_list(&chunks);
+            return make_error_response(packet_buffer, BUFFSIZE, client_info->version,
+                    client_info->session_token, ERROR_FILE_NOT_EXIST);
+        }
+        file_size = chunks.file_size;
+    }
     // send header
-    size_t packet_len = make_file_transfer_header(packet_buffer, BUFFSIZE, client_info->session_token, file_size);
-    send(client_info->client_socket, packet_buffer, packet_len, 0);
-    // send the entire file
-    while ((packet_len = make_file_transfer_body(packet_buffer, BUFFSIZE, file)) > 0) {
-        send(client_info->client_socket, packet_buffer, packet_len, 0);
-    }
-    fclose(file);
-    printf("File sent to client\n");
+    ssize_t packet_len = make_file_transfer_header(packet_buffer, BUFFSIZE,
+            client_info->version, client_info->session_token, file_size);
+    if (packet_len < 0) {
+        // the file can't be described by the client's protocol version
+        printf("ERROR: Requested file is too large\n");
+        if (is_chunked) {
+            free_chunk_list(&chunks);
+        } else {
+            close(file_fd);
+        }
+        return make_error_response(packet_buffer, BUFFSIZE, client_info->version,
+                client_info->session_token, ERROR_FILE_TOO_LARGE);
+    }
+
+    // queue the header, then the file content, which is sent straight
+    // from the page cache a part per turn
+    if (queue_response(client_info, packet_len) < 0) {
+        if (is_chunked) {
+            free_chunk_list(&chunks);
+        } else {
+            close(file_fd);
+        }
+        return -1;
+    }
+    if (is_chunked) {
+        int result = queue_chunks(client_info, &chunks);
+        free_chunk_list(&chunks);
+        return result;
+    }
+    if (push_file_segment(&client_info->send_queue, file_fd, file_offset, file_size) < 0) {
+        return -1;
+    }
     return 0;
 }
 
 
-ssize_t handle_file_transfer(int n_received, struct ClientInfo* client_info, enum ErrorType* error) {
-    struct PacketHeader* header = (struct PacketHeader*)packet_buffer;
-    size_t request_len = ntohs(header->packet_len);
+int queue_chunks(struct ClientInfo* client_info, const struct ChunkList* chunks) {
+    // each chunk is opened only when it is sent
+    char chunk_path[CHUNK_PATH_LEN];
+    int i;
+    for (i = 0; i < chunks->n_chunks; i++) {
+        format_chunk_path(chunks->chunks[i].digest, chunk_path);
+        if (push_path_segment(&client_info->send_queue, chunk_path, 0, chunks->chunks[i].len) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+ssize_t handle_file_transfer(size_t n_received, struct ClientInfo* client_info, enum ErrorType* error) {
+    uint64_t request_len = get_packet_len(client_info->read_buffer);
+    size_t header_len = get_header_len(client_info->version) + MAX_FILE_NAME_LEN;
+    if (request_len < header_len || n_received < header_len) {
+        *error = ERROR_MALFORMED_REQUEST;
+        return -1;
+    }
 
     // get the file names
     char file_name[MAX_FILE_NAME_LEN];
-    memcpy(file_name, packet_buffer + HEADER_LEN, MAX_FILE_NAME_LEN);
-    printf("Client uploading file %s with size %ld\n", file_name, request_len - HEADER_LEN - MAX_FILE_NAME_LEN);
-
-    // open a new file to write to
-    char* dir_path = path_to_user(client_info->username);
-    char* file_path = join_path(dir_path, file_name);
-    free(dir_path);
-    FILE* file = fopen(file_path, "wb");
-
-    // write the packet content (except header and file name) to file
-    size_t header_len = HEADER_LEN + MAX_FILE_NAME_LEN;
-    fwrite(packet_buffer + header_len, 1, n_received - header_len, file);
-
-    // continue to receive more file content and write to file
-    while(n_received < request_len) {
-        int n_new_bytes = recv(client_info->client_socket, 
-                packet_buffer, BUFFSIZE, 0);
-        if (n_new_bytes <= 0) {
-            // fail to recv, delete the half-received file
-            fclose(file);
-            remove(file_path);
-            free(file_path);
-            return make_error_response(packet_buffer, BUFFSIZE, client_info->session_token, ERROR_FILE_UPLOAD_FAILED);
+    memcpy(file_name, client_info->read_buffer + get_header_len(client_info->version), MAX_FILE_NAME_LEN);
+    file_name[MAX_FILE_NAME_LEN - 1] = 0;
+    uint64_t file_size = request_len - header_len;
+    printf("Client uploading file %s with size %llu\n", file_name, (unsigned long long)file_size);
+    // the catalog knows which files may be half-written if the server stops
+    if (is_reserved_file_name(file_name)
+            || begin_file_update(client_info->username, client_info->user_dir_fd, file_name) < 0) {
+        *error = ERROR_FILE_UPLOAD_FAILED;
+        return -1;
+    }
+
+    // a small file is received in memory, then appended to the user's pack.
+    // Otherwise open a new file to write to.
+    // Readable too, the spliced bytes are read back to be hashed
+    char* upload_buffer = NULL;
+    int file_fd = -1;
+    if (should_pack_file(file_size)) {
+        upload_buffer = malloc(file_size > 0 ? file_size : 1);
+    } else {
+        file_fd = create_upload_file(file_size);
+    }
+    if (file_fd < 0 && upload_buffer == NULL) {
+        abort_file_update(client_info->username, client_info->user_dir_fd, file_name);
+        *error = ERROR_FILE_UPLOAD_FAILED;
+        return -1;
+    }
+    memcpy(client_info->upload_name, file_name, MAX_FILE_NAME_LEN);
+    client_info->upload_fd = file_fd;
+    client_info->upload_buffer = upload_buffer;
+    client_info->upload_pipe[0] = client_info->upload_pipe[1] = -1;
+    client_info->upload_piped = 0;
+    client_info->upload_remaining = request_len - n_received;
+    client_info->upload_offset = 0;
+    client_info->upload_checksum = 0;
+    if (is_blob_storage()) {
+        initialize_sha256(&client_info->upload_digest);
+    }
+    if (upload_buffer == NULL && is_chunk_storage() && initialize_chunk_writer(&client_info->upload_chunks) < 0) {
+        close_upload(client_info, false);
+        *error = ERROR_FILE_UPLOAD_FAILED;
+        return -1;
+    }
+
+    // the packet content already received (except header and file name)
+    // must be written before the rest of the file
+    if (write_upload_content(client_info, client_info->read_buffer + header_len, n_received - header_len) < 0) {
+        close_upload(client_info, false);
+        *error = ERROR_FILE_UPLOAD_FAILED;
+        return -1;
+    }
+    consume_read_buffer(client_info, n_received);
+    if (client_info->upload_remaining == 0) {
+        return finish_file_transfer(client_info);
+    }
+
+    // the rest of the file is received as it arrives, through a pipe
+    // if possible. A larger pipe means fewer splice calls. Chunks are
+    // hashed before they are written, so they go through the read buffer,
+    // as do packed files
+    if (upload_buffer == NULL && !is_chunk_storage() && pipe2(client_info->upload_pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+        int pipe_size = fcntl(client_info->upload_pipe[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+        if (pipe_size < 0) {
+            pipe_size = fcntl(client_info->upload_pipe[1], F_GETPIPE_SZ);
+        }
+        client_info->upload_pipe_size = pipe_size > 0 ? pipe_size : DEFAULT_PIPE_SIZE;
+    }
+    client_info->state = STATE_RECEIVE_FILE;
+    return 0;
+}
+
+
+int store_upload(struct ClientInfo* client_info) {
+    // what the catalog records once the file is stored
+    struct CatalogEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.name, client_info->upload_name, MAX_FILE_NAME_LEN);
+    entry.size = client_info->upload_offset;
+    entry.checksum = client_info->upload_checksum;
+    struct CatalogEntry old_entry;
+    bool was_packed = find_user_file(client_info->username, client_info->user_dir_fd,
+            client_info->upload_name, &old_entry) == 0 && old_entry.is_packed;
+
+    // a packed file hides no regular file once stored
+    if (client_info->upload_buffer != NULL) {
+        if (store_packed_file(client_info->username, client_info->user_dir_fd, client_info->upload_name,
+                client_info->upload_buffer, client_info->upload_offset, client_info->upload_checksum) < 0
+                || remove_user_file(client_info->user_dir_fd, client_info->upload_name) < 0) {
+            return -1;
         }
-        n_received += n_new_bytes;
-        fwrite(packet_buffer, 1, n_new_bytes, file);
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        entry.mtime_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        entry.is_packed = true;
+        return finish_file_update(client_info->username, client_info->user_dir_fd, &entry);
+    }
+    // a chunked file is stored as its chunk list
+    if (is_chunk_storage() && finish_chunk_writer(&client_info->upload_chunks,
+            client_info->upload_fd, client_info->upload_checksum) < 0) {
+        return -1;
+    }
+    // keep the checksum computed on the way, so that the next listing
+    // does not read the file again
+    struct stat file_stat;
+    if (fstat(client_info->upload_fd, &file_stat) == 0) {
+        attach_file_checksum(client_info->upload_fd, &file_stat, client_info->upload_checksum);
+        entry.mtime_ns = (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+    }
+    // the file replaces the previous one of the same name only now
+    unsigned char digest[SHA256_DIGEST_LEN];
+    if (is_blob_storage()) {
+        finish_sha256(&client_info->upload_digest, digest);
+    }
+    if (commit_upload_file(client_info->user_dir_fd, client_info->upload_name,
+            client_info->upload_fd, digest) < 0) {
+        return -1;
     }
+    // the packed file of the same name is hidden already, drop it.
+    // If that fails, it stays hidden
+    if (was_packed) {
+        remove_packed_file(client_info->username, client_info->user_dir_fd, client_info->upload_name);
+    }
+    return finish_file_update(client_info->username, client_info->user_dir_fd, &entry);
+}
 
-    fclose(file);
-    free(file_path);
-    printf("File received");
+
+ssize_t finish_file_transfer(struct ClientInfo* client_info) {
+    if (store_upload(client_info) < 0) {
+        close_upload(client_info, false);
+        char* packet_buffer = get_write_buffer(client_info);
+        if (packet_buffer == NULL) {
+            return -1;
+        }
+        printf("ERROR: Uploaded file can't be stored\n");
+        return make_error_response(packet_buffer, BUFFSIZE, client_info->version,
+                client_info->session_token, ERROR_FILE_UPLOAD_FAILED);
+    }
+    close_upload(client_info, true);
+    printf("File received\n");
+    if (is_durable_storage()) {
+        wait_for_commit(client_info);
+        return 0;
+    }
 
     // response with a confirmation
-    return make_file_received_packet(packet_buffer, BUFFSIZE, client_info->session_token);
+    char* packet_buffer = get_write_buffer(client_info);
+    if (packet_buffer == NULL) {
+        return -1;
+    }
+    return make_file_received_packet(packet_buffer, BUFFSIZE, client_info->version,
+            client_info->session_token);
+}
+
+
+int start_listing(struct ClientInfo* client_info) {
+    struct ClientHandler* handler = client_info->handler;
+    struct ListingRequest* listing = start_user_listing(client_info->username,
+            client_info->user_dir_fd, handler->listing_event_fd);
+    if (listing == NULL) {
+        return -1;
+    }
+    listing->context = client_info;
+    listing->next = handler->listings;
+    handler->listings = listing;
+    client_info->listing = listing;
+    client_info->state = STATE_AWAIT_LISTING;
+    return 0;
+}
+
+
+void finish_listing(struct ClientInfo* client_info, struct ListingRequest* listing) {
+    client_info->listing = NULL;
+    client_info->state = STATE_RECEIVE_PACKET;
+    char* packet_buffer = get_write_buffer(client_info);
+    if (packet_buffer == NULL) {
+        remove_client(client_info);
+        return;
+    }
+    // the list is encoded right after the header of the response. The
+    // listing isn't cached: scanning the directory changed it
+    size_t header_len = get_header_len(client_info->version);
+    char* list_body = packet_buffer + header_len;
+    printf("List: found %d files in user directory\n", listing->files.n_files);
+    ssize_t body_len = make_list_body(list_body, BUFFSIZE - header_len, &listing->files);
+    ssize_t response_len;
+    if (body_len < 0) {
+        response_len = make_error_response(packet_buffer, BUFFSIZE, client_info->version,
+                client_info->session_token, ERROR_UNKNOWN);
+        client_info->state = STATE_CLOSING;
+    } else {
+        response_len = make_list_response(packet_buffer, BUFFSIZE, client_info->version,
+                client_info->session_token, list_body, body_len);
+    }
+    if (queue_response(client_info, response_len) < 0) {
+        remove_client(client_info);
+        return;
+    }
+    // the client's socket may have no new event, give it a turn to send
+    // the listing and read its next requests
+    if (!is_queued(&client_info->run_entry)) {
+        push_run_queue(&client_info->handler->run_queue, &client_info->run_entry);
+    }
+}
+
+
+void wait_for_commit(struct ClientInfo* client_info) {
+    struct ClientHandler* handler = client_info->handler;
+    int slot = handler->commit_slot;
+    if (!add_to_commit_request(&handler->commits[slot])) {
+        // the request is syncing already, switch to the other one.
+        // Only one request syncs at a time, so the other one is idle,
+        // or done and waiting to be collected
+        slot = handler->commit_slot = 1 - slot;
+        confirm_committed_uploads(handler, slot);
+        add_to_commit_request(&handler->commits[slot]);
+    }
+    client_info->commit_slot = slot;
+    push_run_queue(&handler->commit_waiters[slot], &client_info->commit_entry);
+    client_info->state = STATE_AWAIT_COMMIT;
+}
+
+
+void confirm_committed_uploads(struct ClientHandler* handler, int slot) {
+    int result;
+    if (!collect_commit_result(&handler->commits[slot], &result)) {
+        return;
+    }
+    struct RunQueueEntry* entry;
+    while ((entry = pop_run_queue(&handler->commit_waiters[slot])) != NULL) {
+        struct ClientInfo* client_info = entry->context;
+        client_info->state = STATE_RECEIVE_PACKET;
+        char* packet_buffer = get_write_buffer(client_info);
+        if (packet_buffer == NULL) {
+            remove_client(client_info);
+            continue;
+        }
+        // the file is stored, but may not survive a crash
+        ssize_t response_len;
+        if (result < 0) {
+            printf("ERROR: Uploaded file can't be made durable\n");
+            response_len = make_error_response(packet_buffer, BUFFSIZE, client_info->version,
+                    client_info->session_token, ERROR_FILE_UPLOAD_FAILED);
+        } else {
+            response_len = make_file_received_packet(packet_buffer, BUFFSIZE,
+                    client_info->version, client_info->session_token);
+        }
+        if (queue_response(client_info, response_len) < 0) {
+            remove_client(client_info);
+            continue;
+        }
+        // the client's socket may have no new event, give it a turn to send
+        // the confirmation and read its next requests
+        if (!is_queued(&client_info->run_entry)) {
+            push_run_queue(&handler->run_queue, &client_info->run_entry);
+        }
+    }
 }
 
 
 void remove_client(struct ClientInfo* client_info) {
     printf("Connection closed\n");
-    // release resource for socket
+    // delete the half-received file
+    if (client_info->upload_fd >= 0 || client_info->upload_buffer != NULL) {
+        close_upload(client_info, false);
+    }
+    if (client_info->user_dir_fd >= 0) {
+        close(client_info->user_dir_fd);
+    }
+    clear_send_queue(&client_info->send_queue);
+    free(client_info->read_buffer);
+    free(client_info->write_buffer);
+
+    // stop watching, then release resource for socket
+    struct ClientHandler* handler = client_info->handler;
+    remove_event_source(&handler->loop, &client_info->source);
+    remove_from_run_queue(&handler->run_queue, &client_info->run_entry);
+    remove_from_run_queue(&handler->commit_waiters[client_info->commit_slot], &client_info->commit_entry);
+    // a listing in progress is freed once done
+    if (client_info->listing != NULL) {
+        client_info->listing->context = NULL;
+    }
     close(client_info->client_socket);
-    // clear client info
-    memset(client_info, 0, sizeof(struct ClientInfo));
+    // release the slot of client info
+    remove_connection(&handler->connections, client_info);
 }
 
 
-uint32_t generate_random_token() {
-    uint32_t x = rand() & 0xff;
-    x |= (rand() & 0xff) << 8;
-    x |= (rand() & 0xff) << 16;
-    x |= (rand() & 0xff) << 24;
+uint32_t generate_random_token(unsigned int* random_seed) {
+    uint32_t x = rand_r(random_seed) & 0xff;
+    x |= (rand_r(random_seed) & 0xff) << 8;
+    x |= (rand_r(random_seed) & 0xff) << 16;
+    x |= (uint32_t)(rand_r(random_seed) & 0xff) << 24;
     return x;
-}
\ No newline at end of file
+}
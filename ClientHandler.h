@@ -7,10 +7,40 @@
 
 
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "ChunkStore.h"
+#include "ConnectionTable.h"
+#include "EventLoop.h"
+#include "GroupCommit.h"
+#include "NetworkHeader.h"
+#include "RunQueue.h"
+#include "SendQueue.h"
+#include "Sha256.h"
+#include "StorageService.h"
 
 #define USERNAME_LEN 128
 #define USERNAME_LEN_WITH_NULL 129
-#define MAX_CONNECTIONS 64
+
+
+/**
+ * What a connection is waiting for. Each connection keeps its own state,
+ * so a partially received packet simply waits for the next readiness event
+ * without blocking other clients.
+ */
+enum ConnectionState {
+	/** Waiting for a packet (its header, then its body) */
+	STATE_RECEIVE_PACKET = 0,
+	/** Streaming the content of an uploaded file to disk */
+	STATE_RECEIVE_FILE,
+	/** Waiting for the stored upload to be durable before confirming it */
+	STATE_AWAIT_COMMIT,
+	/** Waiting for a storage worker to list the user's files */
+	STATE_AWAIT_LISTING,
+	/** Sending the last responses, then closing the connection */
+	STATE_CLOSING,
+};
 
 
 /**
@@ -19,30 +49,139 @@
 struct ClientInfo {
 	int client_socket;
 	char username[USERNAME_LEN_WITH_NULL];
+	/** Directory of the user's files, opened once logged on, so that the
+	 *  files are reached relative to it. -1 before logging on */
+	int user_dir_fd;
 	uint32_t session_token;
+	/** Protocol version of the last request. Responses use the same version */
+	uint8_t version;
+
+	enum ConnectionState state;
+	/** Buffer of received bytes. Only allocated while a packet is in flight */
+	char* read_buffer;
+	/** Number of bytes in the read buffer */
+	size_t n_read;
+	/** Buffer the next response is built in. It is handed over to the
+	 *  send queue once built */
+	char* write_buffer;
+	/** Responses waiting to be sent, flushed whenever the socket is writable */
+	struct SendQueue send_queue;
+
+	/** Name of the file being uploaded, in the user's directory */
+	char upload_name[MAX_FILE_NAME_LEN];
+	/** Descriptor of the file being uploaded. -1 if no upload is in progress
+	 *  or the upload is received in memory */
+	int upload_fd;
+	/** Content of an upload small enough to be packed, received in memory.
+	 *  NULL if the upload is written to a file */
+	char* upload_buffer;
+	/** Pipe moving the upload from the socket to the file with splice(),
+	 *  or -1 if the upload is copied through the read buffer instead */
+	int upload_pipe[2];
+	/** Capacity of the pipe */
+	size_t upload_pipe_size;
+	/** Number of bytes in the pipe, not written to the file yet */
+	size_t upload_piped;
+	/** Number of bytes of the upload packet not received yet */
+	size_t upload_remaining;
+	/** Number of bytes of the file written so far */
+	uint64_t upload_offset;
+	/** Checksum of the bytes written so far, so that the file does not
+	 *  need to be read again to be listed */
+	uint32_t upload_checksum;
+	/** Digest of the bytes written so far, which names the content in the
+	 *  blob store. Only computed when storing blobs */
+	struct Sha256Context upload_digest;
+	/** Splits the upload into chunks. Only used when storing chunks */
+	struct ChunkWriter upload_chunks;
+
+	/** Link in the handler's run queue, while the client has work left
+	 *  after using up its share of a turn */
+	struct RunQueueEntry run_entry;
+	/** Number of bytes the client may still transfer in its turn.
+	 *  Negative if the client went over its share in the last turn */
+	ssize_t deficit;
+
+	/** Link in the waiters of the handler's commit request, while the
+	 *  confirmation of an upload is held */
+	struct RunQueueEntry commit_entry;
+	/** Which of the handler's commit requests the client waits for */
+	int commit_slot;
+
+	/** Listing being made for the client by a storage worker, or NULL */
+	struct ListingRequest* listing;
+
+	/** Readiness callback of the client socket */
+	struct EventSource source;
+	/** The handler serving this client */
+	struct ClientHandler* handler;
+	/** Next client info in the connection table's free or retired list */
+	struct ClientInfo* next_free;
+};
+
+
+/**
+ * A reactor serving clients: the event loop, the listening socket,
+ * and the info about every connected client.
+ * Each server thread owns one handler, so nothing in here is shared
+ * between threads, except the commit requests, which the committer
+ * thread only reaches through GroupCommit.
+ */
+struct ClientHandler {
+	struct EventLoop loop;
+	/** Readiness callback of the listening socket */
+	struct EventSource server_source;
+	/** All connected clients, indexed by socket */
+	struct ConnectionTable connections;
+	/** Clients with work left, waiting for their next turn */
+	struct RunQueue run_queue;
+	/** State of the random generator for session tokens */
+	unsigned int random_seed;
+
+	/** Commit requests of the uploads stored by this handler, when uploads
+	 *  are durable. One gets new uploads while the other may be syncing */
+	struct CommitRequest commits[2];
+	/** Readiness callbacks of the commit requests, called once done */
+	struct EventSource commit_sources[2];
+	/** Clients waiting for each commit request */
+	struct RunQueue commit_waiters[2];
+	/** The commit request new uploads are added to */
+	int commit_slot;
+
+	/** Eventfd the storage workers signal the end of listings on */
+	int listing_event_fd;
+	/** Readiness callback of the listing eventfd */
+	struct EventSource listing_source;
+	/** Listings being made for the clients of this handler, including
+	 *  those of the clients gone meanwhile */
+	struct ListingRequest* listings;
 };
 
 
 /**
- * Initialize
+ * Initialize the services used by all handlers. Must be called once,
+ * before any handler is created.
  */
 void initialize_client_handler();
 
 
 /**
- * Accept a new client connection. The client is rejected if number of current connections
- * already reached max number allowed.
- * Also set up book-keeping data for the new client.
- * @param server_socekt   Server socket
- * @param client_infos    Array of slots to store client info for each connected client
- * @param max_connections Max number of connections allowed
- */ 
-void accept_client(int server_socket, struct ClientInfo* client_infos, int max_connections);
+ * Set up a handler serving the clients connecting to a server socket.
+ * The server socket must be non-blocking.
+ * @param handler         Address of the handler to set up
+ * @param server_socket   Listening server socket
+ * @param max_connections Max number of clients served by this handler
+ * @return 0 if success, -1 if fail
+ */
+int create_client_handler(struct ClientHandler* handler, int server_socket, int max_connections);
 
 
 /**
- * Handle a client request, and update the client info if needed
+ * Serve clients forever: wait for ready sockets, then accept new clients
+ * or handle requests from the connected ones.
+ * Clients take turns of bounded size (deficit round-robin), so a large
+ * transfer can't delay the small requests of other clients.
  */
-void handle_client(struct ClientInfo* client_info);
+void run_client_handler(struct ClientHandler* handler);
 
 #endif // CLIENT_HANDLER_H_
\ No newline at end of file
@@ -0,0 +1,115 @@
+#include "ConnectionTable.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ClientHandler.h"
+
+
+#define INITIAL_CAPACITY 64
+
+
+/*
+ * Helper function declarations
+ */
+
+
+/**
+ * Grow the descriptor index so that it has a slot for the given socket
+ * @return 0 if success, -1 if out of memory
+ */
+int reserve_slot(struct ConnectionTable* table, int client_socket);
+
+
+/*
+ * Public function implementations
+ */
+
+
+int initialize_connection_table(struct ConnectionTable* table, int max_connections) {
+	table->clients = calloc(INITIAL_CAPACITY, sizeof(struct ClientInfo*));
+	if (table->clients == NULL) {
+		return -1;
+	}
+	table->capacity = INITIAL_CAPACITY;
+	table->free_list = NULL;
+	table->retired_list = NULL;
+	table->n_connections = 0;
+	table->max_connections = max_connections;
+	return 0;
+}
+
+
+struct ClientInfo* add_connection(struct ConnectionTable* table, int client_socket) {
+	if (table->n_connections >= table->max_connections) {
+		return NULL;
+	}
+	if (reserve_slot(table, client_socket) < 0) {
+		return NULL;
+	}
+
+	// reuse a client info from the free list if possible
+	struct ClientInfo* client_info = table->free_list;
+	if (client_info != NULL) {
+		table->free_list = client_info->next_free;
+	} else {
+		client_info = malloc(sizeof(struct ClientInfo));
+		if (client_info == NULL) {
+			return NULL;
+		}
+	}
+	memset(client_info, 0, sizeof(struct ClientInfo));
+	client_info->client_socket = client_socket;
+
+	table->clients[client_socket] = client_info;
+	table->n_connections++;
+	return client_info;
+}
+
+
+void remove_connection(struct ConnectionTable* table, struct ClientInfo* client_info) {
+	table->clients[client_info->client_socket] = NULL;
+	table->n_connections--;
+
+	// keep the memory for the next connection, once no event is pending
+	// for this one
+	client_info->next_free = table->retired_list;
+	table->retired_list = client_info;
+}
+
+
+void recycle_connections(struct ConnectionTable* table) {
+	while (table->retired_list != NULL) {
+		struct ClientInfo* client_info = table->retired_list;
+		table->retired_list = client_info->next_free;
+		client_info->next_free = table->free_list;
+		table->free_list = client_info;
+	}
+}
+
+
+/*
+ * Helper function implementations
+ */
+
+
+int reserve_slot(struct ConnectionTable* table, int client_socket) {
+	if (client_socket < table->capacity) {
+		return 0;
+	}
+	// double the capacity until the socket fits
+	int new_capacity = table->capacity;
+	while (new_capacity <= client_socket) {
+		new_capacity *= 2;
+	}
+	struct ClientInfo** new_clients = realloc(table->clients, 
+			new_capacity * sizeof(struct ClientInfo*));
+	if (new_clients == NULL) {
+		return -1;
+	}
+	memset(new_clients + table->capacity, 0, 
+			(new_capacity - table->capacity) * sizeof(struct ClientInfo*));
+	table->clients = new_clients;
+	table->capacity = new_capacity;
+	return 0;
+}
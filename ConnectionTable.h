@@ -0,0 +1,70 @@
+/**
+ * A table of connected clients, indexed by socket descriptor.
+ * Adding and removing a client are both O(1), and the
+ * client infos of closed connections are kept in a free list to be
+ * reused by later connections. A client info is only reused once the
+ * events of the batch it was removed in are all dispatched, so that an
+ * event of the closed connection never reaches a new one.
+ */
+
+#ifndef CONNECTION_TABLE_H_
+#define CONNECTION_TABLE_H_
+
+
+struct ClientInfo;
+
+
+/**
+ * Contains all connected clients of one client handler
+ */
+struct ConnectionTable {
+	/** Client info of each socket, indexed by descriptor. NULL if unused */
+	struct ClientInfo** clients;
+	/** Number of slots in the clients array */
+	int capacity;
+	/** Client infos of closed connections, ready to be reused */
+	struct ClientInfo* free_list;
+	/** Client infos of connections closed during the current batch of
+	 *  events, which may still hold events for them */
+	struct ClientInfo* retired_list;
+	/** Number of connected clients */
+	int n_connections;
+	/** Max number of connections allowed */
+	int max_connections;
+};
+
+
+/**
+ * Initialize an empty table
+ * @param max_connections Max number of connections allowed
+ * @return 0 if success, -1 if fail
+ */
+int initialize_connection_table(struct ConnectionTable* table, int max_connections);
+
+
+/**
+ * Add a client to the table. The returned client info is zeroed, except
+ * for the client socket.
+ * @param client_socket Socket of the new client
+ * @return The client info of the new client, or NULL if the max number
+ *         of connections is reached (or out of memory)
+ */
+struct ClientInfo* add_connection(struct ConnectionTable* table, int client_socket);
+
+
+/**
+ * Remove a client from the table. The client info is kept, so its memory
+ * stays valid until it is reused by another connection, which can only
+ * happen after recycle_connections is called.
+ */
+void remove_connection(struct ConnectionTable* table, struct ClientInfo* client_info);
+
+
+/**
+ * Make the client infos removed so far reusable. To be called between
+ * batches of events, once none can refer to them anymore.
+ */
+void recycle_connections(struct ConnectionTable* table);
+
+
+#endif // CONNECTION_TABLE_H_
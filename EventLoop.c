@@ -0,0 +1,51 @@
+#include "EventLoop.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+
+
+int initialize_event_loop(struct EventLoop* loop) {
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	return loop->epoll_fd < 0 ? -1 : 0;
+}
+
+
+int add_event_source(struct EventLoop* loop, struct EventSource* source, uint32_t events) {
+	struct epoll_event event;
+	event.events = events | EPOLLET;
+	event.data.ptr = source;
+	return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &event);
+}
+
+
+int remove_event_source(struct EventLoop* loop, struct EventSource* source) {
+	source->callback = NULL;
+	return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+}
+
+
+int dispatch_events(struct EventLoop* loop, int timeout_ms) {
+	struct epoll_event events[MAX_EVENTS_PER_WAIT];
+	int n_events = epoll_wait(loop->epoll_fd, events, MAX_EVENTS_PER_WAIT, timeout_ms);
+	if (n_events < 0) {
+		// being interrupted by a signal is not an error
+		return errno == EINTR ? 0 : -1;
+	}
+
+	int i;
+	for (i = 0; i < n_events; i++) {
+		struct EventSource* source = events[i].data.ptr;
+		// the source may have been removed by an earlier callback in this batch
+		if (source->callback != NULL) {
+			source->callback(source, events[i].events);
+		}
+	}
+	return n_events;
+}
+
+
+void close_event_loop(struct EventLoop* loop) {
+	close(loop->epoll_fd);
+	loop->epoll_fd = -1;
+}
@@ -0,0 +1,96 @@
+/**
+ * A small edge-triggered epoll reactor.
+ * Each watched descriptor is described by an EventSource, whose callback is
+ * invoked whenever the descriptor becomes ready.
+ */
+
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+
+/** Maximum number of ready descriptors dispatched per wakeup */
+#define MAX_EVENTS_PER_WAIT 256
+
+
+struct EventSource;
+
+
+/**
+ * Callback invoked when a watched descriptor becomes ready
+ * @param source The event source whose descriptor is ready
+ * @param events Bitmask of the ready epoll events (EPOLLIN, EPOLLOUT, ...)
+ */
+typedef void (*event_callback)(struct EventSource* source, uint32_t events);
+
+
+/**
+ * A descriptor watched by the event loop, together with its readiness callback
+ */
+struct EventSource {
+	/** The watched descriptor */
+	int fd;
+	/** Called when the descriptor is ready. NULL means the source is dead */
+	event_callback callback;
+	/** Arbitrary data for the callback */
+	void* context;
+};
+
+
+/**
+ * An epoll instance
+ */
+struct EventLoop {
+	int epoll_fd;
+};
+
+
+/**
+ * Create the epoll instance backing an event loop
+ * @return 0 if success, -1 if fail
+ */
+int initialize_event_loop(struct EventLoop* loop);
+
+
+/**
+ * Start watching a descriptor. The descriptor is always watched in
+ * edge-triggered mode, so the callback must consume all available data
+ * (until EAGAIN) before returning.
+ * @param loop   The event loop
+ * @param source The event source, which must stay valid while being watched
+ * @param events Bitmask of events to watch for (EPOLLIN, EPOLLOUT, ...)
+ * @return 0 if success, -1 if fail
+ */
+int add_event_source(struct EventLoop* loop, struct EventSource* source, uint32_t events);
+
+
+/**
+ * Stop watching a descriptor. This must be called before the descriptor is
+ * closed. The source's callback is cleared, so a pending event for it in
+ * the current batch is ignored. The source must not be watched again
+ * before the batch is over, or the pending event would reach it.
+ * @return 0 if success, -1 if fail
+ */
+int remove_event_source(struct EventLoop* loop, struct EventSource* source);
+
+
+/**
+ * Wait for ready descriptors and invoke their callbacks.
+ * The cost of each call is proportional to the number of ready descriptors,
+ * not the number of watched ones.
+ * @param timeout_ms Maximum time to wait, or -1 to wait indefinitely
+ * @return Number of events dispatched, or -1 if fail
+ */
+int dispatch_events(struct EventLoop* loop, int timeout_ms);
+
+
+/**
+ * Release the epoll instance
+ */
+void close_event_loop(struct EventLoop* loop);
+
+
+#endif // EVENT_LOOP_H_
@@ -1,122 +1,379 @@
-#include "FileChecksum.h"
-
-#include <stdlib.h>
-#include <stdint.h>  /* integer types of exact size */
-#include <stdio.h>   /* file IO */
-
-typedef uint_fast32_t UINT32;
-
-static const UINT32 DEFAULT_INITAL_CHECKSUM = 0xFFFFFFFF;
-static const int BUFFER_SIZE = 8;
-
-/** Memoize the result of calculation performed on each byte */
-static const UINT32 CRC32_TABLE[] = {
-    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA,
-    0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
-    0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
-    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
-    0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE,
-    0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
-    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
-    0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
-    0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
-    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
-    0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940,
-    0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
-    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116,
-    0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-    0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
-    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
-    0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A,
-    0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
-    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818,
-    0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
-    0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
-    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
-    0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C,
-    0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
-    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2,
-    0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
-    0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
-    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
-    0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086,
-    0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
-    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4,
-    0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
-    0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
-    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
-    0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
-    0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
-    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE,
-    0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
-    0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
-    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
-    0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252,
-    0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
-    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60,
-    0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
-    0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
-    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
-    0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04,
-    0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
-    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
-    0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
-    0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
-    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
-    0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E,
-    0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
-    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
-    0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
-    0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
-    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
-    0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0,
-    0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
-    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6,
-    0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
-    0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
-    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-};
-
-
-/**
- * Calculate the running checksum of a byte array
- * by starting with the given initial_checksum instead of 0xFFFFFFFF
- * This is used as a helper for computing the checksum of a large file,
- * by reading the file in chunk, then compute the running checksum of
- * the chunks so far.
- *
- * @param  data             Byte array whose checksum need to be computed
- * @param  data_len         Length of the byte array
- * @param  initial_checksum The running checksum of the previous data
- * @return The running checksum of all previous data and the current data
- *         xor by 0xFFFFFFFF
- */
-UINT32 crc32_running_checksum(unsigned char *data, size_t data_len, UINT32 inital_checksum) {
-    UINT32 checksum = inital_checksum;
-    int i;
-    for (i = 0; i < data_len; i++) {
-        int lookup_ind = (checksum ^ data[i]) & 0xFF;
-        checksum = (checksum >> 8) ^ CRC32_TABLE[lookup_ind];
-    }
-    return checksum;
-}
-
-
-UINT32 crc32_file_checksum(FILE *fd) {
-    // create a buffer to store a large chunk of the file
-    unsigned char buffer[BUFFER_SIZE];
-
-    UINT32 checksum = DEFAULT_INITAL_CHECKSUM;
-
-    // the file will be processed in chunk of BUFFER_SIZE
-    // this loop repeatedly read a new chunk, then incrementally
-    // find the running checksum
-    size_t bytes_read = 0;
-    while((bytes_read = fread(buffer, 1, BUFFER_SIZE, fd)) > 0) {
-        checksum = crc32_running_checksum(buffer, bytes_read, checksum);
-    }
-
-    // the final running checksum is negated, according to CRC-32 specification
-    checksum ^= 0xFFFFFFFF;
-    return checksum;
-}
+#include "FileChecksum.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>  /* integer types of exact size */
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_PCLMUL_KERNEL 1
+#endif
+
+
+/** Size of the chunks a file is read in. Large reads keep syscalls rare */
+#define READ_CHUNK_SIZE (256 * 1024)
+
+/** Shortest input worth the setup cost of the folding kernel */
+#define MIN_FOLDING_LEN 64
+
+
+/** Memoize the result of calculation performed on each byte */
+static const uint32_t CRC32_TABLE[256] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA,
+    0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
+    0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+    0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE,
+    0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
+    0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
+    0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
+    0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940,
+    0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116,
+    0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+    0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
+    0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A,
+    0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818,
+    0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
+    0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
+    0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C,
+    0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2,
+    0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
+    0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+    0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086,
+    0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4,
+    0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
+    0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
+    0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
+    0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE,
+    0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
+    0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
+    0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252,
+    0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60,
+    0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
+    0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
+    0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04,
+    0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
+    0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
+    0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
+    0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E,
+    0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
+    0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+    0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
+    0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0,
+    0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6,
+    0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
+    0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+/**
+ * Tables for slicing-by-16: SLICING_TABLES[k][b] is the CRC of byte b
+ * followed by k zero bytes. SLICING_TABLES[0] is CRC32_TABLE
+ */
+static uint32_t SLICING_TABLES[16][256];
+
+
+/**
+ * A CRC-32 kernel, working on the raw (not inverted) CRC register
+ */
+typedef uint32_t (*crc32_kernel)(uint32_t crc, const unsigned char* data, size_t data_len);
+
+/** Fastest kernel supported by the CPU, picked once by initialize_kernel */
+static crc32_kernel best_kernel;
+
+/**
+ * X_POWERS[k] is x^(2^k) modulo the CRC-32 polynomial, to shift a CRC
+ * over any number of zero bytes in a logarithmic number of steps
+ */
+static uint32_t X_POWERS[32];
+
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * Helper functions
+ */
+
+
+/**
+ * Process 16 bytes per step with 16 table lookups, instead of one byte
+ * per lookup. Any data length is supported.
+ */
+uint32_t crc32_slicing_by_16(uint32_t crc, const unsigned char* data, size_t data_len) {
+    while (data_len >= 16) {
+        uint32_t word = crc
+                ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8
+                | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        crc = SLICING_TABLES[15][word & 0xFF]
+                ^ SLICING_TABLES[14][(word >> 8) & 0xFF]
+                ^ SLICING_TABLES[13][(word >> 16) & 0xFF]
+                ^ SLICING_TABLES[12][word >> 24]
+                ^ SLICING_TABLES[11][data[4]]
+                ^ SLICING_TABLES[10][data[5]]
+                ^ SLICING_TABLES[9][data[6]]
+                ^ SLICING_TABLES[8][data[7]]
+                ^ SLICING_TABLES[7][data[8]]
+                ^ SLICING_TABLES[6][data[9]]
+                ^ SLICING_TABLES[5][data[10]]
+                ^ SLICING_TABLES[4][data[11]]
+                ^ SLICING_TABLES[3][data[12]]
+                ^ SLICING_TABLES[2][data[13]]
+                ^ SLICING_TABLES[1][data[14]]
+                ^ SLICING_TABLES[0][data[15]];
+        data += 16;
+        data_len -= 16;
+    }
+    while (data_len-- > 0) {
+        crc = (crc >> 8) ^ CRC32_TABLE[(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+
+#ifdef HAVE_PCLMUL_KERNEL
+
+/*
+ * Constants of the folding kernel, for the bit-reflected CRC-32 polynomial
+ * (see Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction")
+ */
+/** x^(4*128+32) mod P and x^(4*128-32) mod P: fold 4 blocks by 64 bytes */
+static const uint64_t FOLD_BY_4[2] = {0x154442bd4, 0x1c6e41596};
+/** x^(128+32) mod P and x^(128-32) mod P: fold 1 block by 16 bytes */
+static const uint64_t FOLD_BY_1[2] = {0x1751997d0, 0x0ccaa009e};
+/** x^64 mod P: fold 64 bits into 32 */
+static const uint64_t FOLD_64[2] = {0x163cd6124, 0};
+/** The polynomial and its Barrett constant, for the final reduction */
+static const uint64_t BARRETT[2] = {0x1db710641, 0x1f7011641};
+
+
+/**
+ * Fold a 128-bit block forward by the distance encoded in the constants,
+ * and add the next block
+ */
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i fold_block(__m128i block, __m128i constants, __m128i next) {
+    __m128i low = _mm_clmulepi64_si128(block, constants, 0x00);
+    __m128i high = _mm_clmulepi64_si128(block, constants, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(low, high), next);
+}
+
+
+/**
+ * Fold the data with carry-less multiplications, 64 bytes per step in 4
+ * independent lanes, then reduce it to 32 bits with a Barrett reduction.
+ * Bytes past the last multiple of 16 are left to the slicing kernel.
+ */
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_pclmul(uint32_t crc, const unsigned char* data, size_t data_len) {
+    if (data_len < MIN_FOLDING_LEN) {
+        return crc32_slicing_by_16(crc, data, data_len);
+    }
+    size_t tail_len = data_len % 16;
+    data_len -= tail_len;
+
+    __m128i constants = _mm_loadu_si128((const __m128i*)FOLD_BY_4);
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    data += 64;
+    data_len -= 64;
+
+    // fold the 4 lanes over the data
+    while (data_len >= 64) {
+        x1 = fold_block(x1, constants, _mm_loadu_si128((const __m128i*)(data + 0x00)));
+        x2 = fold_block(x2, constants, _mm_loadu_si128((const __m128i*)(data + 0x10)));
+        x3 = fold_block(x3, constants, _mm_loadu_si128((const __m128i*)(data + 0x20)));
+        x4 = fold_block(x4, constants, _mm_loadu_si128((const __m128i*)(data + 0x30)));
+        data += 64;
+        data_len -= 64;
+    }
+
+    // fold the 4 lanes into one, then the remaining blocks into it
+    constants = _mm_loadu_si128((const __m128i*)FOLD_BY_1);
+    x1 = fold_block(x1, constants, x2);
+    x1 = fold_block(x1, constants, x3);
+    x1 = fold_block(x1, constants, x4);
+    while (data_len >= 16) {
+        x1 = fold_block(x1, constants, _mm_loadu_si128((const __m128i*)data));
+        data += 16;
+        data_len -= 16;
+    }
+
+    // fold 128 bits into 64, appending 32 zero bits
+    __m128i mask32 = _mm_setr_epi32(-1, 0, 0, 0);
+    x2 = _mm_clmulepi64_si128(x1, constants, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    // fold 64 bits into 32
+    constants = _mm_loadu_si128((const __m128i*)FOLD_64);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), constants, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to the 32-bit remainder
+    constants = _mm_loadu_si128((const __m128i*)BARRETT);
+    x2 = x1;
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), constants, 0x10);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), constants, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = _mm_extract_epi32(x1, 1);
+
+    return crc32_slicing_by_16(crc, data, tail_len);
+}
+
+
+/**
+ * @return true if the CPU supports the instructions of the folding kernel
+ */
+bool has_pclmul() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+
+#endif // HAVE_PCLMUL_KERNEL
+
+
+/**
+ * Multiply two polynomials modulo the CRC-32 polynomial. Polynomials are
+ * bit-reflected, like the CRC itself: the highest bit is x^0
+ */
+uint32_t multiply_modulo_polynomial(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    uint32_t bit;
+    for (bit = 1u << 31; bit != 0; bit >>= 1) {
+        if (a & bit) {
+            product ^= b;
+        }
+        // b = b * x modulo the polynomial
+        b = (b & 1) ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+    }
+    return product;
+}
+
+
+/**
+ * @return x^(8 * n_bytes) modulo the CRC-32 polynomial
+ */
+uint32_t x_power_of_bytes(uint64_t n_bytes) {
+    uint32_t power = 1u << 31;  // x^0
+    int k = 3;  // one byte is 2^3 bits
+    while (n_bytes != 0) {
+        if (n_bytes & 1) {
+            power = multiply_modulo_polynomial(X_POWERS[k & 31], power);
+        }
+        n_bytes >>= 1;
+        k++;
+    }
+    return power;
+}
+
+
+/**
+ * Build the slicing tables and the powers of x, and pick the fastest
+ * kernel for this CPU
+ */
+void initialize_kernel() {
+    int i, k;
+    for (i = 0; i < 256; i++) {
+        SLICING_TABLES[0][i] = CRC32_TABLE[i];
+    }
+    for (k = 1; k < 16; k++) {
+        for (i = 0; i < 256; i++) {
+            uint32_t previous = SLICING_TABLES[k - 1][i];
+            SLICING_TABLES[k][i] = (previous >> 8) ^ CRC32_TABLE[previous & 0xFF];
+        }
+    }
+
+    // x^(2^k) is the square of x^(2^(k-1)). x^(2^32) = x^1 (mod P)
+    X_POWERS[0] = 1u << 30;  // x^1
+    for (k = 1; k < 32; k++) {
+        X_POWERS[k] = multiply_modulo_polynomial(X_POWERS[k - 1], X_POWERS[k - 1]);
+    }
+
+    best_kernel = crc32_slicing_by_16;
+#ifdef HAVE_PCLMUL_KERNEL
+    if (has_pclmul()) {
+        best_kernel = crc32_pclmul;
+    }
+#endif
+}
+
+
+/*
+ * Public functions
+ */
+
+
+uint32_t crc32_update(uint32_t checksum, const void* data, size_t data_len) {
+    pthread_once(&kernel_once, initialize_kernel);
+    // the CRC register is the inverted checksum, according to CRC-32 specification
+    return ~best_kernel(~checksum, data, data_len);
+}
+
+
+uint32_t crc32_combine_checksums(uint32_t checksum1, uint32_t checksum2, uint64_t len2) {
+    pthread_once(&kernel_once, initialize_kernel);
+    // appending len2 bytes multiplies the first checksum by x^(8*len2),
+    // and CRC-32 is linear, so the rest is the checksum of the second part
+    return multiply_modulo_polynomial(x_power_of_bytes(len2), checksum1) ^ checksum2;
+}
+
+
+int crc32_file_range(int file_fd, off_t offset, uint64_t* len, uint32_t* checksum) {
+    unsigned char* buffer = malloc(READ_CHUNK_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+    *checksum = 0;
+    uint64_t n_hashed = 0;
+    while (n_hashed < *len) {
+        size_t chunk_len = *len - n_hashed < READ_CHUNK_SIZE ? *len - n_hashed : READ_CHUNK_SIZE;
+        ssize_t bytes_read = pread(file_fd, buffer, chunk_len, offset + n_hashed);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            free(buffer);
+            return -1;
+        }
+        if (bytes_read == 0) {
+            // the file is shorter than expected
+            break;
+        }
+        *checksum = crc32_update(*checksum, buffer, bytes_read);
+        n_hashed += bytes_read;
+    }
+    free(buffer);
+    *len = n_hashed;
+    return 0;
+}
+
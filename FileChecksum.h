@@ -6,17 +6,49 @@
 #define FILE_CHECKSUM_H_
 
 
-#include <stdio.h>   /* file IO */
+#include <stddef.h>
 #include <stdint.h>  /* integer types of exact size */
+#include <sys/types.h>
 
 
 /**
- * Compute the checksum of the given file
+ * Update the CRC-32 checksum of some data with the bytes that follow it.
+ * The fastest kernel supported by the CPU is used (carry-less multiplication
+ * folding, or slicing-by-16 tables), and all kernels give the same result.
  *
- * @param fd The file descriptor for the file
- * @return   The CRC-32 checksum of the file
+ * @param checksum The checksum of the previous data, or 0 if there is none
+ * @param data     The following bytes
+ * @param data_len Number of bytes
+ * @return The checksum of the previous data and the following bytes
  */
-uint_fast32_t crc32_file_checksum(FILE *fd);
+uint32_t crc32_update(uint32_t checksum, const void* data, size_t data_len);
+
+
+/**
+ * Find the checksum of two pieces of data put one after the other, from
+ * the checksums of the pieces, without reading the data again.
+ * This lets the pieces of a large file be hashed in parallel.
+ *
+ * @param checksum1 Checksum of the first piece
+ * @param checksum2 Checksum of the second piece
+ * @param len2      Length of the second piece
+ * @return Checksum of the first piece followed by the second
+ */
+uint32_t crc32_combine_checksums(uint32_t checksum1, uint32_t checksum2, uint64_t len2);
+
+
+/**
+ * Compute the checksum of a range of a file. The file offset is not
+ * changed, so several threads can hash ranges of the same descriptor.
+ *
+ * @param file_fd  Descriptor of the file
+ * @param offset   Offset of the range in the file
+ * @param len      [in, out] Length of the range. Set to the number of bytes
+ *                 hashed, which is less if the file ends before the range
+ * @param checksum [out] The CRC-32 checksum of the range
+ * @return 0 if success, -1 if error
+ */
+int crc32_file_range(int file_fd, off_t offset, uint64_t* len, uint32_t* checksum);
 
 
 #endif // FILE_CHECKSUM_H_
@@ -0,0 +1,121 @@
+#include "FileTable.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/** Number of files the array holds when first allocated */
+#define INITIAL_FILE_CAPACITY 64
+
+/** Number of bytes the arena holds when first allocated */
+#define INITIAL_NAMES_CAPACITY 2048
+
+
+/*
+ * Helper functions
+ */
+
+
+int compare_file_checksums(const void* a, const void* b) {
+	const struct FileInfo* file_a = a;
+	const struct FileInfo* file_b = b;
+	if (file_a->checksum != file_b->checksum) {
+		return file_a->checksum < file_b->checksum ? -1 : 1;
+	}
+	return 0;
+}
+
+
+int compare_file_names(const void* a, const void* b, void* names) {
+	const struct FileInfo* file_a = a;
+	const struct FileInfo* file_b = b;
+	return strcmp((const char*)names + file_a->name_offset, (const char*)names + file_b->name_offset);
+}
+
+
+/**
+ * Make room for one more file, and a name of the given length
+ * @return 0 if success, -1 if out of memory
+ */
+int reserve_file_info(struct FileTable* table, size_t name_len) {
+	if (table->n_files == table->capacity) {
+		int new_capacity = table->capacity == 0 ? INITIAL_FILE_CAPACITY : table->capacity * 2;
+		struct FileInfo* new_files = realloc(table->files, new_capacity * sizeof(struct FileInfo));
+		if (new_files == NULL) {
+			return -1;
+		}
+		table->files = new_files;
+		table->capacity = new_capacity;
+	}
+
+	size_t names_len = table->names_len + name_len + 1;
+	if (names_len > table->names_capacity) {
+		size_t new_capacity = table->names_capacity == 0 ? INITIAL_NAMES_CAPACITY : table->names_capacity;
+		while (new_capacity < names_len) {
+			new_capacity *= 2;
+		}
+		char* new_names = realloc(table->names, new_capacity);
+		if (new_names == NULL) {
+			return -1;
+		}
+		table->names = new_names;
+		table->names_capacity = new_capacity;
+	}
+	return 0;
+}
+
+
+/*
+ * Public functions
+ */
+
+
+void initialize_file_table(struct FileTable* table) {
+	table->files = NULL;
+	table->n_files = 0;
+	table->capacity = 0;
+	table->names = NULL;
+	table->names_len = 0;
+	table->names_capacity = 0;
+}
+
+
+int add_file_info(struct FileTable* table, const char* name, size_t name_len, uint32_t checksum) {
+	if (reserve_file_info(table, name_len) < 0) {
+		return -1;
+	}
+	struct FileInfo* file = &table->files[table->n_files];
+	file->name_offset = table->names_len;
+	file->checksum = checksum;
+	memcpy(table->names + table->names_len, name, name_len);
+	table->names[table->names_len + name_len] = 0;
+	table->names_len += name_len + 1;
+	table->n_files++;
+	return 0;
+}
+
+
+const char* get_file_name(const struct FileTable* table, const struct FileInfo* file) {
+	return table->names + file->name_offset;
+}
+
+
+void sort_files_by_checksum(struct FileTable* table) {
+	if (table->n_files > 1) {
+		qsort(table->files, table->n_files, sizeof(struct FileInfo), compare_file_checksums);
+	}
+}
+
+
+void sort_files_by_name(struct FileTable* table) {
+	if (table->n_files > 1) {
+		qsort_r(table->files, table->n_files, sizeof(struct FileInfo), compare_file_names, table->names);
+	}
+}
+
+
+void free_file_table(struct FileTable* table) {
+	free(table->files);
+	free(table->names);
+	initialize_file_table(table);
+}
@@ -0,0 +1,89 @@
+/**
+ * A list of files with their checksums, stored contiguously: the infos in
+ * one array, and the names packed one after the other in an arena. Adding
+ * a file only allocates when the array or the arena is full, walking the
+ * list stays within a few cache lines per file, and the whole list is
+ * released with a single call.
+ */
+
+#ifndef FILE_TABLE_H_
+#define FILE_TABLE_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * The name and checksum of a file in a table
+ */
+struct FileInfo {
+	/** Offset of the null-terminated name in the name arena of the table.
+	 *  An offset rather than a pointer, since the arena may move as it grows */
+	uint32_t name_offset;
+	uint32_t checksum;
+};
+
+
+/**
+ * The files, in insertion order unless sorted
+ */
+struct FileTable {
+	struct FileInfo* files;
+	/** Number of files in the table */
+	int n_files;
+	/** Number of files the array can hold */
+	int capacity;
+	/** Arena of the names */
+	char* names;
+	/** Number of bytes used in the arena */
+	size_t names_len;
+	/** Number of bytes the arena can hold */
+	size_t names_capacity;
+};
+
+
+/**
+ * Initialize an empty table
+ */
+void initialize_file_table(struct FileTable* table);
+
+
+/**
+ * Add a file at the end of the table
+ * @param name     Name of the file, not necessarily null-terminated
+ * @param name_len Length of the name
+ * @return 0 if success, -1 if out of memory
+ */
+int add_file_info(struct FileTable* table, const char* name, size_t name_len, uint32_t checksum);
+
+
+/**
+ * @return The null-terminated name of a file of the table. The pointer is
+ *         valid until the next file is added
+ */
+const char* get_file_name(const struct FileTable* table, const struct FileInfo* file);
+
+
+/**
+ * Sort the files of a table by checksum, so that the files with a given
+ * checksum can be found by a binary search or a merge
+ */
+void sort_files_by_checksum(struct FileTable* table);
+
+
+/**
+ * Sort the files of a table by name, so that two tables can be merged to
+ * find the files only one of them has
+ */
+void sort_files_by_name(struct FileTable* table);
+
+
+/**
+ * Release the memory of the table. The table is left empty, and can be
+ * reused
+ */
+void free_file_table(struct FileTable* table);
+
+
+#endif // FILE_TABLE_H_
@@ -0,0 +1,186 @@
+#include "GroupCommit.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/** Guards the queue and the state of every request */
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signaled when a request is queued, or when a batch is full */
+static pthread_cond_t has_requests;
+/** Requests waiting for the next sync, in the order they were queued */
+static struct CommitRequest* queue_head = NULL;
+static struct CommitRequest* queue_tail = NULL;
+/** Number of files added to the queued requests */
+static int n_queued_files = 0;
+/** When the first of the queued requests was queued */
+static struct timespec queued_time;
+
+/** Directory of the filesystem to sync */
+static int sync_dir_fd = -1;
+/** Time a queued request waits for others before the sync, in ms */
+static int commit_window_ms = 0;
+
+
+/*
+ * Helper functions
+ */
+
+
+/**
+ * Wait until the queue holds a request, then until its window is over or
+ * the batch is full. The commit lock must be held.
+ */
+void wait_for_batch_window() {
+	while (queue_head == NULL) {
+		pthread_cond_wait(&has_requests, &commit_lock);
+	}
+	struct timespec deadline = queued_time;
+	deadline.tv_sec += commit_window_ms / 1000;
+	deadline.tv_nsec += (long)(commit_window_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	while (n_queued_files < MAX_COMMIT_BATCH_FILES) {
+		if (pthread_cond_timedwait(&has_requests, &commit_lock, &deadline) != 0) {
+			break;
+		}
+	}
+}
+
+
+/**
+ * Tell the owner of a synced request. The commit lock must be held.
+ */
+void finish_commit_request(struct CommitRequest* request, int result) {
+	request->state = COMMIT_DONE;
+	request->result = result;
+	uint64_t one = 1;
+	if (write(request->event_fd, &one, sizeof(one)) < 0) {
+		printf("Error when waking up the owner of a commit\n");
+	}
+}
+
+
+/**
+ * Thread routine: sync the queued requests in batches, forever
+ */
+void* run_committer(void* unused) {
+	pthread_mutex_lock(&commit_lock);
+	while (1) {
+		wait_for_batch_window();
+		// the files added from now on wait for the next sync
+		struct CommitRequest* batch = queue_head;
+		queue_head = queue_tail = NULL;
+		n_queued_files = 0;
+		struct CommitRequest* request;
+		for (request = batch; request != NULL; request = request->next) {
+			request->state = COMMIT_SYNCING;
+		}
+		pthread_mutex_unlock(&commit_lock);
+
+		// one sync makes the contents, links and logs of all the files
+		// durable, whichever users and directories they belong to
+		int result = syncfs(sync_dir_fd);
+		if (result < 0) {
+			printf("Error when syncing stored files\n");
+		}
+
+		pthread_mutex_lock(&commit_lock);
+		while (batch != NULL) {
+			request = batch;
+			batch = request->next;
+			request->next = NULL;
+			finish_commit_request(request, result < 0 ? -1 : 0);
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Public functions
+ */
+
+
+int start_group_commit(const char* dir_path, int window_ms) {
+	sync_dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (sync_dir_fd < 0) {
+		return -1;
+	}
+	commit_window_ms = window_ms;
+	// windows are measured on a clock that isn't set back
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&has_requests, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, run_committer, NULL) != 0) {
+		close(sync_dir_fd);
+		sync_dir_fd = -1;
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+
+int initialize_commit_request(struct CommitRequest* request) {
+	request->state = COMMIT_IDLE;
+	request->result = 0;
+	request->next = NULL;
+	request->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return request->event_fd < 0 ? -1 : 0;
+}
+
+
+bool add_to_commit_request(struct CommitRequest* request) {
+	pthread_mutex_lock(&commit_lock);
+	if (request->state == COMMIT_SYNCING || request->state == COMMIT_DONE) {
+		pthread_mutex_unlock(&commit_lock);
+		return false;
+	}
+	if (request->state == COMMIT_IDLE) {
+		request->state = COMMIT_QUEUED;
+		if (queue_head == NULL) {
+			queue_head = request;
+			clock_gettime(CLOCK_MONOTONIC, &queued_time);
+			pthread_cond_signal(&has_requests);
+		} else {
+			queue_tail->next = request;
+		}
+		queue_tail = request;
+	}
+	n_queued_files++;
+	// a full batch doesn't wait for the end of its window
+	if (n_queued_files == MAX_COMMIT_BATCH_FILES) {
+		pthread_cond_signal(&has_requests);
+	}
+	pthread_mutex_unlock(&commit_lock);
+	return true;
+}
+
+
+bool collect_commit_result(struct CommitRequest* request, int* result) {
+	// the event is consumed even if it's stale, e.g. collected already
+	uint64_t n_events;
+	while (read(request->event_fd, &n_events, sizeof(n_events)) > 0) {
+	}
+	pthread_mutex_lock(&commit_lock);
+	bool is_done = request->state == COMMIT_DONE;
+	if (is_done) {
+		*result = request->result;
+		request->state = COMMIT_IDLE;
+	}
+	pthread_mutex_unlock(&commit_lock);
+	return is_done;
+}
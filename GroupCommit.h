@@ -0,0 +1,87 @@
+/**
+ * Durability of uploads at the cost of one sync per batch rather than one
+ * per file. Stored uploads join a commit request, and a committer thread
+ * syncs the filesystem of the server's data once for all the requests
+ * queued during a window of time, then tells each request's owner.
+ *
+ * A request belongs to a single thread, which adds files to it until the
+ * committer takes it, then waits for it to be done: its event descriptor
+ * becomes readable, and the result is collected with collect_commit_result.
+ * A thread keeps adding files meanwhile by using a second request.
+ */
+
+#ifndef GROUP_COMMIT_H_
+#define GROUP_COMMIT_H_
+
+
+#include <stdbool.h>
+
+
+/** Number of files past which a batch is synced without waiting for the
+ *  end of its window */
+#define MAX_COMMIT_BATCH_FILES 256
+
+
+/**
+ * Where a commit request is in its cycle
+ */
+enum CommitState {
+	/** No file was added since the result was collected */
+	COMMIT_IDLE = 0,
+	/** Files were added, waiting for the committer */
+	COMMIT_QUEUED,
+	/** Taken by the committer, which is syncing. No file can be added */
+	COMMIT_SYNCING,
+	/** Synced, the result is waiting to be collected */
+	COMMIT_DONE,
+};
+
+
+/**
+ * Files of one thread that are synced together
+ */
+struct CommitRequest {
+	/** Readable once the request is done. Watched by the owner's event loop */
+	int event_fd;
+	/** Guarded by the committer's lock, like the fields below */
+	enum CommitState state;
+	/** 0 if the files are durable, -1 if the sync failed */
+	int result;
+	/** Next request queued for the committer */
+	struct CommitRequest* next;
+};
+
+
+/**
+ * Start the committer thread. Must be called once, before any request is made.
+ * @param dir_path   A directory of the filesystem to sync
+ * @param window_ms  Time a queued request waits for others before the sync
+ * @return 0 if success, -1 if error
+ */
+int start_group_commit(const char* dir_path, int window_ms);
+
+
+/**
+ * Initialize an idle request, and its event descriptor
+ * @return 0 if success, -1 if error
+ */
+int initialize_commit_request(struct CommitRequest* request);
+
+
+/**
+ * Add a stored file to a request, queueing the request if it isn't already
+ * @return false if the request is syncing or done, so the file must be
+ *         added to another request
+ */
+bool add_to_commit_request(struct CommitRequest* request);
+
+
+/**
+ * Collect the result of a done request, which becomes idle again
+ * @param result [out] 0 if the files are durable, -1 if they may be lost
+ * @return false if the request is not done
+ */
+bool collect_commit_result(struct CommitRequest* request, int* result);
+
+
+#endif // GROUP_COMMIT_H_
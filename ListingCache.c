@@ -0,0 +1,324 @@
+#include "ListingCache.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "StringHash.h"
+
+
+/** Number of buckets of the table when first allocated */
+#define INITIAL_BUCKET_COUNT 256
+
+/** Bounds of the cache. The least recently used users are evicted past them */
+#define MAX_CACHED_LISTINGS 4096
+#define MAX_CACHED_LISTING_BYTES (16 * 1024 * 1024)
+
+/** A directory modified less than this long before it is scanned may be
+ *  modified again within the same timestamp, without its modification time
+ *  changing. Its listing is not cached */
+#define RACY_WINDOW_NS 1000000000LL
+
+
+/**
+ * The cached listing of a user
+ */
+struct CachedListing {
+	char* username;
+	uint32_t hash;
+	/** Changed whenever one of the user's files is written. Taken from a
+	 *  clock shared by all entries, so that an entry evicted then created
+	 *  again never has a generation read from the old one */
+	uint64_t generation;
+	/** Encoded listing, or NULL if there is none */
+	char* listing;
+	size_t listing_len;
+	/** Stat data of the directory the listing was built from */
+	dev_t dir_device;
+	ino_t dir_inode;
+	int64_t dir_mtime_ns;
+	struct CachedListing* next;
+	/** Neighbors in the order of use, most recent first */
+	struct CachedListing* lru_prev;
+	struct CachedListing* lru_next;
+};
+
+
+/**
+ * Hash table of the listings, by user name
+ */
+struct ListingTable {
+	struct CachedListing** buckets;
+	int n_buckets;
+	int n_entries;
+	/** Most and least recently used entries */
+	struct CachedListing* lru_head;
+	struct CachedListing* lru_tail;
+	/** Total length of the cached listings */
+	size_t n_listing_bytes;
+	/** Last generation given to an entry */
+	uint64_t generation_clock;
+};
+
+
+static struct ListingTable listings = {NULL, 0, 0, NULL, NULL, 0, 0};
+static pthread_mutex_t listings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Helper functions
+ */
+
+
+int64_t get_dir_mtime_ns(const struct stat* dir_stat) {
+	return (int64_t)dir_stat->st_mtim.tv_sec * 1000000000 + dir_stat->st_mtim.tv_nsec;
+}
+
+
+/**
+ * Double the number of buckets, once the chains get long.
+ * The lock must be held.
+ */
+void grow_listing_table() {
+	int new_n_buckets = listings.n_buckets * 2;
+	struct CachedListing** new_buckets = calloc(new_n_buckets, sizeof(struct CachedListing*));
+	if (new_buckets == NULL) {
+		// keep the longer chains
+		return;
+	}
+	int i;
+	for (i = 0; i < listings.n_buckets; i++) {
+		struct CachedListing* entry = listings.buckets[i];
+		while (entry != NULL) {
+			struct CachedListing* next = entry->next;
+			int bucket = entry->hash & (new_n_buckets - 1);
+			entry->next = new_buckets[bucket];
+			new_buckets[bucket] = entry;
+			entry = next;
+		}
+	}
+	free(listings.buckets);
+	listings.buckets = new_buckets;
+	listings.n_buckets = new_n_buckets;
+}
+
+
+/**
+ * Find the entry of a user. The lock must be held.
+ * @return The entry, or NULL if there is none
+ */
+struct CachedListing* find_cached_listing(const char* username) {
+	if (listings.buckets == NULL) {
+		return NULL;
+	}
+	uint32_t hash = hash_string(username);
+	struct CachedListing* entry = listings.buckets[hash & (listings.n_buckets - 1)];
+	while (entry != NULL) {
+		if (entry->hash == hash && strcmp(entry->username, username) == 0) {
+			return entry;
+		}
+		entry = entry->next;
+	}
+	return NULL;
+}
+
+
+/**
+ * Remove an entry from the order of use. The lock must be held.
+ */
+void unlink_lru_entry(struct CachedListing* entry) {
+	if (entry->lru_prev != NULL) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	} else {
+		listings.lru_head = entry->lru_next;
+	}
+	if (entry->lru_next != NULL) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	} else {
+		listings.lru_tail = entry->lru_prev;
+	}
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+
+/**
+ * Make an entry the most recently used. The lock must be held.
+ */
+void touch_cached_listing(struct CachedListing* entry) {
+	if (listings.lru_head == entry) {
+		return;
+	}
+	if (entry->lru_prev != NULL) {
+		unlink_lru_entry(entry);
+	}
+	entry->lru_next = listings.lru_head;
+	if (listings.lru_head != NULL) {
+		listings.lru_head->lru_prev = entry;
+	}
+	listings.lru_head = entry;
+	if (listings.lru_tail == NULL) {
+		listings.lru_tail = entry;
+	}
+}
+
+
+/**
+ * Release the listing of an entry, keeping the entry.
+ * The lock must be held.
+ */
+void clear_cached_listing(struct CachedListing* entry) {
+	listings.n_listing_bytes -= entry->listing_len;
+	free(entry->listing);
+	entry->listing = NULL;
+	entry->listing_len = 0;
+}
+
+
+/**
+ * Remove the least recently used entries while the cache is over its
+ * bounds. The lock must be held.
+ * @param kept Entry that is never evicted, the one being used
+ */
+void evict_cached_listings(const struct CachedListing* kept) {
+	while ((listings.n_entries > MAX_CACHED_LISTINGS
+			|| listings.n_listing_bytes > MAX_CACHED_LISTING_BYTES)
+			&& listings.lru_tail != NULL && listings.lru_tail != kept) {
+		struct CachedListing* entry = listings.lru_tail;
+		unlink_lru_entry(entry);
+		struct CachedListing** link = &listings.buckets[entry->hash & (listings.n_buckets - 1)];
+		while (*link != entry) {
+			link = &(*link)->next;
+		}
+		*link = entry->next;
+		listings.n_entries--;
+		clear_cached_listing(entry);
+		free(entry->username);
+		free(entry);
+	}
+}
+
+
+/**
+ * Find the entry of a user, and create it if there is none. The entry
+ * becomes the most recently used. The lock must be held.
+ * @return The entry, or NULL if out of memory
+ */
+struct CachedListing* get_cached_listing(const char* username) {
+	struct CachedListing* entry = find_cached_listing(username);
+	if (entry != NULL) {
+		touch_cached_listing(entry);
+		return entry;
+	}
+	if (listings.buckets == NULL) {
+		listings.buckets = calloc(INITIAL_BUCKET_COUNT, sizeof(struct CachedListing*));
+		if (listings.buckets == NULL) {
+			return NULL;
+		}
+		listings.n_buckets = INITIAL_BUCKET_COUNT;
+	}
+
+	uint32_t hash = hash_string(username);
+	entry = calloc(1, sizeof(struct CachedListing));
+	if (entry == NULL) {
+		return NULL;
+	}
+	entry->username = strdup(username);
+	if (entry->username == NULL) {
+		free(entry);
+		return NULL;
+	}
+	entry->hash = hash;
+	entry->generation = ++listings.generation_clock;
+	if (listings.n_entries >= listings.n_buckets * 2) {
+		grow_listing_table();
+	}
+	int bucket = hash & (listings.n_buckets - 1);
+	entry->next = listings.buckets[bucket];
+	listings.buckets[bucket] = entry;
+	listings.n_entries++;
+	touch_cached_listing(entry);
+	evict_cached_listings(entry);
+	return entry;
+}
+
+
+/*
+ * Public functions
+ */
+
+
+ssize_t read_cached_listing(const char* username, const struct stat* dir_stat,
+		char* buffer, size_t buff_len, uint64_t* generation) {
+	ssize_t listing_len = -1;
+	pthread_mutex_lock(&listings_lock);
+	struct CachedListing* entry = get_cached_listing(username);
+	if (entry != NULL) {
+		*generation = entry->generation;
+		if (entry->listing != NULL
+				&& entry->dir_device == dir_stat->st_dev
+				&& entry->dir_inode == dir_stat->st_ino
+				&& entry->dir_mtime_ns == get_dir_mtime_ns(dir_stat)
+				&& entry->listing_len <= buff_len) {
+			memcpy(buffer, entry->listing, entry->listing_len);
+			listing_len = entry->listing_len;
+		}
+	} else {
+		// nothing can be stored for this user
+		*generation = UINT64_MAX;
+	}
+	pthread_mutex_unlock(&listings_lock);
+	return listing_len;
+}
+
+
+void store_cached_listing(const char* username, uint64_t generation,
+		const struct stat* dir_stat, const char* listing, size_t listing_len) {
+	// a listing of a directory modified just before the scan may miss a
+	// change that didn't move the modification time
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int64_t now_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	if (get_dir_mtime_ns(dir_stat) >= now_ns - RACY_WINDOW_NS) {
+		return;
+	}
+
+	char* listing_copy = malloc(listing_len > 0 ? listing_len : 1);
+	if (listing_copy == NULL) {
+		return;
+	}
+	memcpy(listing_copy, listing, listing_len);
+
+	// an entry evicted during the scan is not created again: a file may
+	// have been written meanwhile
+	pthread_mutex_lock(&listings_lock);
+	struct CachedListing* entry = find_cached_listing(username);
+	if (entry != NULL && entry->generation == generation) {
+		clear_cached_listing(entry);
+		entry->listing = listing_copy;
+		entry->listing_len = listing_len;
+		entry->dir_device = dir_stat->st_dev;
+		entry->dir_inode = dir_stat->st_ino;
+		entry->dir_mtime_ns = get_dir_mtime_ns(dir_stat);
+		listings.n_listing_bytes += listing_len;
+		listing_copy = NULL;
+		touch_cached_listing(entry);
+		evict_cached_listings(entry);
+	}
+	pthread_mutex_unlock(&listings_lock);
+	// not stored if a file was written during the scan
+	free(listing_copy);
+}
+
+
+void invalidate_cached_listing(const char* username) {
+	// a user without entry has no scan in progress either
+	pthread_mutex_lock(&listings_lock);
+	struct CachedListing* entry = find_cached_listing(username);
+	if (entry != NULL) {
+		entry->generation = ++listings.generation_clock;
+		clear_cached_listing(entry);
+	}
+	pthread_mutex_unlock(&listings_lock);
+}
@@ -0,0 +1,56 @@
+/**
+ * A cache of the encoded list response of each user, shared by all client
+ * handlers, so that listing a directory that didn't change is a copy.
+ * An entry is only trusted while the user's directory keeps the inode and
+ * modification time it had when the entry was built, which catches files
+ * added, removed or renamed behind the server's back. Files written by the
+ * server invalidate the entry explicitly. A file modified in place by
+ * another program is not noticed until the directory changes.
+ * The cache is bounded in entries and bytes: the least recently used users
+ * are evicted past them.
+ */
+
+#ifndef LISTING_CACHE_H_
+#define LISTING_CACHE_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+/**
+ * Copy the cached listing of a user, if it is still valid
+ * @param dir_stat   Current stat data of the user's directory
+ * @param buffer     Buffer to copy the listing to
+ * @param buff_len   Size of the buffer
+ * @param generation [out] Version of the user's entry. When the listing is
+ *                   not cached, it must be given to store_cached_listing,
+ *                   so that a listing built while a file was written is
+ *                   never stored
+ * @return Length of the listing, or -1 if it is not cached, stale, or
+ *         larger than the buffer
+ */
+ssize_t read_cached_listing(const char* username, const struct stat* dir_stat,
+		char* buffer, size_t buff_len, uint64_t* generation);
+
+
+/**
+ * Cache the listing of a user, unless the user's files were written since
+ * the generation was read
+ * @param generation Generation given by read_cached_listing, before the
+ *                   directory was scanned
+ * @param dir_stat   Stat data of the directory, before it was scanned
+ */
+void store_cached_listing(const char* username, uint64_t generation,
+		const struct stat* dir_stat, const char* listing, size_t listing_len);
+
+
+/**
+ * Drop the cached listing of a user, after one of the user's files is written
+ */
+void invalidate_cached_listing(const char* username);
+
+
+#endif // LISTING_CACHE_H_
@@ -0,0 +1,859 @@
+#include "PackStore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "FileChecksum.h"
+#include "StringHash.h"
+#include "UserRegistry.h"
+
+
+/** Segment of a user's pack, in the user's directory */
+#define PACK_FILE_NAME ".pack"
+/** Segment being written by a compaction */
+#define COMPACT_FILE_NAME ".pack.compact"
+
+#define PACK_RECORD_MAGIC 0x4b434150u // "PACK"
+/** Flag of a record saying that its file is removed */
+#define RECORD_REMOVED 1
+/** Longest name a record may hold */
+#define MAX_PACKED_NAME_LEN 255
+
+/** Number of packs kept loaded while no thread uses them. Each holds
+ *  2 descriptors */
+#define MAX_IDLE_PACKS 128
+/** Number of buckets of the index of a pack when first allocated */
+#define INITIAL_ENTRY_BUCKETS 64
+
+/** Size of the reads when a segment is replayed or copied */
+#define SEGMENT_BUFFER_SIZE (256 * 1024)
+
+/** A segment is compacted once its dead records take this many bytes,
+ *  and more than its live records */
+#define MIN_COMPACTED_LEN (1024 * 1024)
+
+
+/**
+ * What each record of a segment starts with, followed by the name of the
+ * file, then its content
+ */
+struct PackRecordHeader {
+	uint32_t magic;
+	/** CRC-32 of the rest of the header and of the name, so that a record
+	 *  cut short by a crash is not mistaken for a file */
+	uint32_t header_checksum;
+	uint64_t data_len;
+	/** CRC-32 of the content */
+	uint32_t checksum;
+	uint16_t name_len;
+	uint16_t flags;
+};
+
+
+/**
+ * Where a packed file is in the segment
+ */
+struct PackEntry {
+	char* name;
+	uint32_t hash;
+	uint64_t record_offset;
+	uint64_t data_len;
+	uint32_t checksum;
+	/** Number of the last listing that found a regular file of the same name */
+	uint64_t listing_mark;
+	struct PackEntry* next;
+};
+
+
+/**
+ * The pack of a user, with the index of its files
+ */
+struct Pack {
+	struct UserRegistryEntry registry_entry;
+
+	/** Held while the pack is used, except while a compaction copies the
+	 *  records that can't change anymore */
+	pthread_mutex_t lock;
+	/** Whether the index was built from the segment */
+	bool is_loaded;
+	/** Descriptor of the user directory, -1 until loaded */
+	int dir_fd;
+	/** Descriptor of the segment, -1 if the user has no pack yet */
+	int segment_fd;
+	/** Length of the valid records of the segment, where the next is appended */
+	uint64_t segment_len;
+	/** Total length of the records of the files in the index */
+	uint64_t live_len;
+	/** Whether the pack waits for the compactor or is being compacted.
+	 *  The compactor holds the pack meanwhile, so it isn't evicted */
+	bool is_compacting;
+	/** Next pack waiting for the compactor */
+	struct Pack* next_compaction;
+
+	struct PackEntry** buckets;
+	int n_buckets;
+	int n_entries;
+	uint64_t n_listings;
+};
+
+
+/**
+ * Where a compaction moves a live record
+ */
+struct RecordMove {
+	uint64_t old_offset;
+	uint64_t new_offset;
+	uint64_t len;
+};
+
+
+struct UserRegistryEntry* create_pack();
+void destroy_pack(struct UserRegistryEntry* entry);
+
+static struct UserRegistry packs = USER_REGISTRY_INITIALIZER(MAX_IDLE_PACKS,
+		create_pack, destroy_pack);
+
+/** Packs waiting to be compacted, by a single thread started when first needed */
+static struct Pack* compaction_head = NULL;
+static struct Pack* compaction_tail = NULL;
+static pthread_mutex_t compaction_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t has_compactions = PTHREAD_COND_INITIALIZER;
+static pthread_once_t compactor_once = PTHREAD_ONCE_INIT;
+static bool is_compactor_started = false;
+
+
+/*
+ * Helper functions
+ */
+
+
+uint64_t get_record_len(size_t name_len, uint64_t data_len) {
+	return sizeof(struct PackRecordHeader) + name_len + data_len;
+}
+
+
+uint32_t checksum_record_header(const struct PackRecordHeader* header, const char* name) {
+	const size_t checked_offset = offsetof(struct PackRecordHeader, data_len);
+	uint32_t checksum = crc32_update(0, (const char*)header + checked_offset,
+			sizeof(struct PackRecordHeader) - checked_offset);
+	return crc32_update(checksum, name, header->name_len);
+}
+
+
+int compare_record_moves(const void* a, const void* b) {
+	uint64_t offset_a = ((const struct RecordMove*)a)->old_offset;
+	uint64_t offset_b = ((const struct RecordMove*)b)->old_offset;
+	return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+
+struct PackEntry* find_pack_entry(struct Pack* pack, const char* name) {
+	if (pack->n_buckets == 0) {
+		return NULL;
+	}
+	uint32_t hash = hash_string(name);
+	struct PackEntry* entry = pack->buckets[hash & (pack->n_buckets - 1)];
+	while (entry != NULL && (entry->hash != hash || strcmp(entry->name, name) != 0)) {
+		entry = entry->next;
+	}
+	return entry;
+}
+
+
+/**
+ * Double the number of buckets of the index, once the chains get long
+ */
+void grow_pack_index(struct Pack* pack) {
+	int new_n_buckets = pack->n_buckets == 0 ? INITIAL_ENTRY_BUCKETS : pack->n_buckets * 2;
+	struct PackEntry** new_buckets = calloc(new_n_buckets, sizeof(struct PackEntry*));
+	if (new_buckets == NULL) {
+		// keep the longer chains
+		return;
+	}
+	int i;
+	for (i = 0; i < pack->n_buckets; i++) {
+		struct PackEntry* entry = pack->buckets[i];
+		while (entry != NULL) {
+			struct PackEntry* next = entry->next;
+			int bucket = entry->hash & (new_n_buckets - 1);
+			entry->next = new_buckets[bucket];
+			new_buckets[bucket] = entry;
+			entry = next;
+		}
+	}
+	free(pack->buckets);
+	pack->buckets = new_buckets;
+	pack->n_buckets = new_n_buckets;
+}
+
+
+/**
+ * Index a record of a file, replacing the record of the same name if any
+ * @return 0 if success, -1 if out of memory
+ */
+int put_pack_entry(struct Pack* pack, const char* name, uint64_t record_offset,
+		uint64_t data_len, uint32_t checksum) {
+	size_t name_len = strlen(name);
+	struct PackEntry* entry = find_pack_entry(pack, name);
+	if (entry != NULL) {
+		pack->live_len -= get_record_len(name_len, entry->data_len);
+	} else {
+		if (pack->n_entries >= pack->n_buckets) {
+			grow_pack_index(pack);
+		}
+		if (pack->n_buckets == 0) {
+			return -1;
+		}
+		entry = calloc(1, sizeof(struct PackEntry));
+		if (entry == NULL) {
+			return -1;
+		}
+		entry->name = strdup(name);
+		if (entry->name == NULL) {
+			free(entry);
+			return -1;
+		}
+		entry->hash = hash_string(name);
+		int bucket = entry->hash & (pack->n_buckets - 1);
+		entry->next = pack->buckets[bucket];
+		pack->buckets[bucket] = entry;
+		pack->n_entries++;
+	}
+	entry->record_offset = record_offset;
+	entry->data_len = data_len;
+	entry->checksum = checksum;
+	pack->live_len += get_record_len(name_len, data_len);
+	return 0;
+}
+
+
+/**
+ * Remove a file from the index, if it is there
+ */
+void delete_pack_entry(struct Pack* pack, const char* name) {
+	if (pack->n_buckets == 0) {
+		return;
+	}
+	uint32_t hash = hash_string(name);
+	struct PackEntry** link = &pack->buckets[hash & (pack->n_buckets - 1)];
+	while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->name, name) != 0)) {
+		link = &(*link)->next;
+	}
+	struct PackEntry* entry = *link;
+	if (entry == NULL) {
+		return;
+	}
+	*link = entry->next;
+	pack->live_len -= get_record_len(strlen(entry->name), entry->data_len);
+	pack->n_entries--;
+	free(entry->name);
+	free(entry);
+}
+
+
+/**
+ * Empty the index of a pack
+ */
+void clear_pack_index(struct Pack* pack) {
+	int i;
+	for (i = 0; i < pack->n_buckets; i++) {
+		while (pack->buckets[i] != NULL) {
+			struct PackEntry* entry = pack->buckets[i];
+			pack->buckets[i] = entry->next;
+			free(entry->name);
+			free(entry);
+		}
+	}
+	pack->n_entries = 0;
+	pack->live_len = 0;
+}
+
+
+/**
+ * Build the index by reading the records of the segment in order. Records
+ * are read through a large buffer, so that small files cost no read each.
+ * The segment ends at the first invalid record, which is the one being
+ * appended when the server stopped: it is cut off.
+ * @return 0 if success, -1 if error
+ */
+int replay_pack_segment(struct Pack* pack) {
+	struct stat segment_stat;
+	if (fstat(pack->segment_fd, &segment_stat) < 0) {
+		return -1;
+	}
+	uint64_t file_len = segment_stat.st_size;
+	char* buffer = malloc(SEGMENT_BUFFER_SIZE);
+	if (buffer == NULL) {
+		return -1;
+	}
+	uint64_t buffer_start = 0;
+	size_t buffer_len = 0;
+	uint64_t offset = 0;
+	while (offset < file_len) {
+		// the header and name of the record must be in the buffer
+		uint64_t needed_len = sizeof(struct PackRecordHeader) + MAX_PACKED_NAME_LEN;
+		if (needed_len > file_len - offset) {
+			needed_len = file_len - offset;
+		}
+		if (offset + needed_len > buffer_start + buffer_len) {
+			ssize_t n_read = pread(pack->segment_fd, buffer, SEGMENT_BUFFER_SIZE, offset);
+			if (n_read < 0) {
+				free(buffer);
+				return -1;
+			}
+			buffer_start = offset;
+			buffer_len = n_read;
+		}
+		const char* record = buffer + (offset - buffer_start);
+		size_t available_len = buffer_start + buffer_len - offset;
+
+		struct PackRecordHeader header;
+		if (available_len < sizeof(header)) {
+			break;
+		}
+		memcpy(&header, record, sizeof(header));
+		const char* name = record + sizeof(header);
+		if (header.magic != PACK_RECORD_MAGIC || header.name_len == 0
+				|| header.name_len > MAX_PACKED_NAME_LEN
+				|| available_len < sizeof(header) + header.name_len
+				|| checksum_record_header(&header, name) != header.header_checksum
+				|| header.data_len > file_len - offset - sizeof(header) - header.name_len) {
+			break;
+		}
+		char name_copy[MAX_PACKED_NAME_LEN + 1];
+		memcpy(name_copy, name, header.name_len);
+		name_copy[header.name_len] = 0;
+		if (header.flags & RECORD_REMOVED) {
+			delete_pack_entry(pack, name_copy);
+		} else if (put_pack_entry(pack, name_copy, offset, header.data_len, header.checksum) < 0) {
+			free(buffer);
+			return -1;
+		}
+		offset += get_record_len(header.name_len, header.data_len);
+	}
+	free(buffer);
+
+	if (offset < file_len) {
+		printf("Pack: dropping %llu bytes of incomplete records\n",
+				(unsigned long long)(file_len - offset));
+		if (ftruncate(pack->segment_fd, offset) < 0) {
+			return -1;
+		}
+	}
+	pack->segment_len = offset;
+	return 0;
+}
+
+
+/**
+ * Open the segment of a pack and build its index. The pack lock must be held.
+ * @return 0 if success, -1 if error
+ */
+int load_pack(struct Pack* pack, int user_dir_fd) {
+	pack->dir_fd = openat(user_dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (pack->dir_fd < 0) {
+		return -1;
+	}
+	// left by a compaction that was interrupted
+	unlinkat(pack->dir_fd, COMPACT_FILE_NAME, 0);
+
+	pack->segment_fd = openat(pack->dir_fd, PACK_FILE_NAME, O_RDWR | O_CLOEXEC);
+	if (pack->segment_fd >= 0 && replay_pack_segment(pack) < 0) {
+		clear_pack_index(pack);
+		close(pack->segment_fd);
+		pack->segment_fd = -1;
+		errno = EIO;
+	}
+	if (pack->segment_fd < 0 && errno != ENOENT) {
+		close(pack->dir_fd);
+		pack->dir_fd = -1;
+		return -1;
+	}
+	// with no segment, the user has no packed file yet
+	pack->is_loaded = true;
+	return 0;
+}
+
+
+/**
+ * Allocate an unloaded pack, for the registry
+ */
+struct UserRegistryEntry* create_pack() {
+	struct Pack* pack = calloc(1, sizeof(struct Pack));
+	if (pack == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&pack->lock, NULL);
+	pack->dir_fd = -1;
+	pack->segment_fd = -1;
+	return &pack->registry_entry;
+}
+
+
+/**
+ * Close and free a pack evicted by the registry. It isn't being compacted
+ */
+void destroy_pack(struct UserRegistryEntry* entry) {
+	struct Pack* pack = (struct Pack*) entry;
+	clear_pack_index(pack);
+	free(pack->buckets);
+	if (pack->segment_fd >= 0) {
+		close(pack->segment_fd);
+	}
+	if (pack->dir_fd >= 0) {
+		close(pack->dir_fd);
+	}
+	pthread_mutex_destroy(&pack->lock);
+	free(pack);
+}
+
+
+/**
+ * Unlock a pack locked by lock_pack
+ */
+void unlock_pack(struct Pack* pack) {
+	pthread_mutex_unlock(&pack->lock);
+	release_user_entry(&packs, &pack->registry_entry);
+}
+
+
+/**
+ * Find the pack of a user, load it if needed, and lock it
+ * @return The locked pack, or NULL if error
+ */
+struct Pack* lock_pack(const char* username, int user_dir_fd) {
+	struct Pack* pack = (struct Pack*) acquire_user_entry(&packs, username);
+	if (pack == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&pack->lock);
+	if (!pack->is_loaded && load_pack(pack, user_dir_fd) < 0) {
+		unlock_pack(pack);
+		return NULL;
+	}
+	return pack;
+}
+
+
+/**
+ * Write all the parts of a record at the given offset
+ * @return 0 if success, -1 if error
+ */
+int write_record_parts(int file_fd, struct iovec* parts, int n_parts, off_t offset) {
+	while (n_parts > 0) {
+		ssize_t n_written = pwritev(file_fd, parts, n_parts, offset);
+		if (n_written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n_written < 0) {
+			return -1;
+		}
+		offset += n_written;
+		// skip the parts written completely, and the start of the next one
+		while (n_parts > 0 && (size_t)n_written >= parts->iov_len) {
+			n_written -= parts->iov_len;
+			parts++;
+			n_parts--;
+		}
+		if (n_parts > 0) {
+			parts->iov_base = (char*)parts->iov_base + n_written;
+			parts->iov_len -= n_written;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Append a record to the segment, creating the segment if needed.
+ * The pack lock must be held.
+ * @param record_offset [out] Offset of the record
+ * @return 0 if success, -1 if error
+ */
+int append_pack_record(struct Pack* pack, const char* name, const void* data, size_t data_len,
+		uint32_t checksum, uint16_t flags, uint64_t* record_offset) {
+	if (pack->segment_fd < 0) {
+		pack->segment_fd = openat(pack->dir_fd, PACK_FILE_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+		if (pack->segment_fd < 0) {
+			return -1;
+		}
+		pack->segment_len = 0;
+	}
+
+	struct PackRecordHeader header;
+	header.magic = PACK_RECORD_MAGIC;
+	header.data_len = data_len;
+	header.checksum = checksum;
+	header.name_len = strlen(name);
+	header.flags = flags;
+	header.header_checksum = checksum_record_header(&header, name);
+	struct iovec parts[3] = {
+		{&header, sizeof(header)},
+		{(void*)name, header.name_len},
+		{(void*)data, data_len},
+	};
+	if (write_record_parts(pack->segment_fd, parts, data_len > 0 ? 3 : 2, pack->segment_len) < 0) {
+		// the next record overwrites what was written
+		return -1;
+	}
+	*record_offset = pack->segment_len;
+	pack->segment_len += get_record_len(header.name_len, data_len);
+	return 0;
+}
+
+
+/**
+ * Copy a range of a file to another
+ * @return 0 if success, -1 if error
+ */
+int copy_file_bytes(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset,
+		uint64_t len, char* buffer) {
+	while (len > 0) {
+		size_t chunk_len = len < SEGMENT_BUFFER_SIZE ? len : SEGMENT_BUFFER_SIZE;
+		ssize_t n_read = pread(src_fd, buffer, chunk_len, src_offset);
+		if (n_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n_read <= 0) {
+			return -1;
+		}
+		struct iovec part = {buffer, n_read};
+		if (write_record_parts(dst_fd, &part, 1, dst_offset) < 0) {
+			return -1;
+		}
+		src_offset += n_read;
+		dst_offset += n_read;
+		len -= n_read;
+	}
+	return 0;
+}
+
+
+/**
+ * Copy the live records of a segment to a new one, in order. Adjacent
+ * records are copied together
+ * @param moves Records to copy, sorted by offset. Their new offsets are set
+ * @return Length of the new segment, or -1 if error
+ */
+int64_t copy_live_records(int src_fd, int dst_fd, struct RecordMove* moves, int n_moves) {
+	char* buffer = malloc(SEGMENT_BUFFER_SIZE);
+	if (buffer == NULL) {
+		return -1;
+	}
+	uint64_t new_len = 0;
+	int i = 0;
+	while (i < n_moves) {
+		uint64_t run_offset = moves[i].old_offset;
+		uint64_t run_len = 0;
+		while (i < n_moves && moves[i].old_offset == run_offset + run_len) {
+			moves[i].new_offset = new_len + run_len;
+			run_len += moves[i].len;
+			i++;
+		}
+		if (copy_file_bytes(src_fd, run_offset, dst_fd, new_len, run_len, buffer) < 0) {
+			free(buffer);
+			return -1;
+		}
+		new_len += run_len;
+	}
+	free(buffer);
+	return new_len;
+}
+
+
+/**
+ * Give the index the offsets of the records in the compacted segment
+ * @param end      Length of the old segment when the compaction started
+ * @param tail_offset Offset of the records appended since, in the new segment
+ * @return 0 if success, -1 if a record was not moved
+ */
+int move_pack_entries(struct Pack* pack, const struct RecordMove* moves, int n_moves,
+		uint64_t end, uint64_t tail_offset) {
+	// checked first, so that the index is changed completely or not at all
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		int i;
+		for (i = 0; i < pack->n_buckets; i++) {
+			struct PackEntry* entry;
+			for (entry = pack->buckets[i]; entry != NULL; entry = entry->next) {
+				uint64_t new_offset;
+				if (entry->record_offset >= end) {
+					new_offset = tail_offset + (entry->record_offset - end);
+				} else {
+					struct RecordMove key = {entry->record_offset, 0, 0};
+					const struct RecordMove* move = bsearch(&key, moves, n_moves,
+							sizeof(struct RecordMove), compare_record_moves);
+					if (move == NULL) {
+						return -1;
+					}
+					new_offset = move->new_offset;
+				}
+				if (pass == 1) {
+					entry->record_offset = new_offset;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Rewrite a segment with only its live records. The records present when
+ * the compaction starts never change, so they are copied without the lock.
+ * The records appended meanwhile are copied with the lock held, then the
+ * new segment replaces the old one. Downloads that hold the old segment
+ * keep reading it.
+ * @return 0 if success, -1 if error
+ */
+int compact_pack_segment(struct Pack* pack) {
+	pthread_mutex_lock(&pack->lock);
+	int n_moves = pack->n_entries;
+	struct RecordMove* moves = malloc((n_moves > 0 ? n_moves : 1) * sizeof(struct RecordMove));
+	int src_fd = moves != NULL ? fcntl(pack->segment_fd, F_DUPFD_CLOEXEC, 0) : -1;
+	uint64_t end = pack->segment_len;
+	int n = 0;
+	int i;
+	for (i = 0; src_fd >= 0 && i < pack->n_buckets; i++) {
+		struct PackEntry* entry;
+		for (entry = pack->buckets[i]; entry != NULL; entry = entry->next) {
+			moves[n].old_offset = entry->record_offset;
+			moves[n].len = get_record_len(strlen(entry->name), entry->data_len);
+			n++;
+		}
+	}
+	n_moves = n;
+	if (src_fd < 0) {
+		pack->is_compacting = false;
+		pthread_mutex_unlock(&pack->lock);
+		free(moves);
+		return -1;
+	}
+	pthread_mutex_unlock(&pack->lock);
+
+	qsort(moves, n_moves, sizeof(struct RecordMove), compare_record_moves);
+	int dst_fd = openat(pack->dir_fd, COMPACT_FILE_NAME, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	int64_t new_len = dst_fd >= 0 ? copy_live_records(src_fd, dst_fd, moves, n_moves) : -1;
+	close(src_fd);
+	// the bulk of the new segment is synced without the lock, so that the
+	// sync before the rename only has the tail left to write
+	if (new_len >= 0 && fdatasync(dst_fd) < 0) {
+		new_len = -1;
+	}
+
+	int result = -1;
+	pthread_mutex_lock(&pack->lock);
+	if (new_len >= 0) {
+		char* buffer = malloc(SEGMENT_BUFFER_SIZE);
+		uint64_t tail_len = pack->segment_len - end;
+		// the new segment must be durable before it replaces the old one,
+		// which may hold files confirmed as durable
+		if (buffer != NULL
+				&& copy_file_bytes(pack->segment_fd, end, dst_fd, new_len, tail_len, buffer) == 0
+				&& fdatasync(dst_fd) == 0
+				&& move_pack_entries(pack, moves, n_moves, end, new_len) == 0) {
+			result = renameat(pack->dir_fd, COMPACT_FILE_NAME, pack->dir_fd, PACK_FILE_NAME);
+		}
+		free(buffer);
+		if (result == 0) {
+			fsync(pack->dir_fd);
+			close(pack->segment_fd);
+			pack->segment_fd = dst_fd;
+			pack->segment_len = new_len + tail_len;
+			dst_fd = -1;
+		}
+	}
+	pack->is_compacting = false;
+	pthread_mutex_unlock(&pack->lock);
+
+	if (dst_fd >= 0) {
+		close(dst_fd);
+		unlinkat(pack->dir_fd, COMPACT_FILE_NAME, 0);
+	}
+	free(moves);
+	return result;
+}
+
+
+/**
+ * Thread routine: compact the queued packs one at a time, forever
+ */
+void* run_compactor(void* unused) {
+	while (1) {
+		pthread_mutex_lock(&compaction_lock);
+		while (compaction_head == NULL) {
+			pthread_cond_wait(&has_compactions, &compaction_lock);
+		}
+		struct Pack* pack = compaction_head;
+		compaction_head = pack->next_compaction;
+		if (compaction_head == NULL) {
+			compaction_tail = NULL;
+		}
+		pack->next_compaction = NULL;
+		pthread_mutex_unlock(&compaction_lock);
+
+		if (compact_pack_segment(pack) < 0) {
+			printf("Pack: compaction of %s failed\n", pack->registry_entry.username);
+		}
+		release_user_entry(&packs, &pack->registry_entry);
+	}
+	return NULL;
+}
+
+
+/**
+ * Start the compactor thread
+ */
+void start_compactor() {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, run_compactor, NULL) == 0) {
+		pthread_detach(thread);
+		is_compactor_started = true;
+	}
+}
+
+
+/**
+ * Queue the pack for the compactor, if enough of its segment is dead.
+ * The pack lock must be held.
+ */
+void compact_pack_if_needed(struct Pack* pack) {
+	uint64_t dead_len = pack->segment_len - pack->live_len;
+	if (pack->is_compacting || dead_len < MIN_COMPACTED_LEN || dead_len < pack->live_len) {
+		return;
+	}
+	pthread_once(&compactor_once, start_compactor);
+	if (!is_compactor_started) {
+		return;
+	}
+	pack->is_compacting = true;
+	pin_user_entry(&packs, &pack->registry_entry);
+	pthread_mutex_lock(&compaction_lock);
+	if (compaction_tail != NULL) {
+		compaction_tail->next_compaction = pack;
+	} else {
+		compaction_head = pack;
+	}
+	compaction_tail = pack;
+	pthread_cond_signal(&has_compactions);
+	pthread_mutex_unlock(&compaction_lock);
+}
+
+
+/*
+ * Public functions
+ */
+
+
+bool is_pack_file(const char* name) {
+	return strcmp(name, PACK_FILE_NAME) == 0 || strcmp(name, COMPACT_FILE_NAME) == 0;
+}
+
+
+int store_packed_file(const char* username, int user_dir_fd, const char* file_name,
+		const void* data, size_t data_len, uint32_t checksum) {
+	if (strlen(file_name) > MAX_PACKED_NAME_LEN) {
+		return -1;
+	}
+	struct Pack* pack = lock_pack(username, user_dir_fd);
+	if (pack == NULL) {
+		return -1;
+	}
+	uint64_t record_offset;
+	int result = append_pack_record(pack, file_name, data, data_len, checksum, 0, &record_offset);
+	if (result == 0) {
+		result = put_pack_entry(pack, file_name, record_offset, data_len, checksum);
+		compact_pack_if_needed(pack);
+	}
+	unlock_pack(pack);
+	return result;
+}
+
+
+int remove_packed_file(const char* username, int user_dir_fd, const char* file_name) {
+	struct Pack* pack = lock_pack(username, user_dir_fd);
+	if (pack == NULL) {
+		return -1;
+	}
+	int result = 0;
+	if (find_pack_entry(pack, file_name) != NULL) {
+		uint64_t record_offset;
+		result = append_pack_record(pack, file_name, NULL, 0, 0, RECORD_REMOVED, &record_offset);
+		if (result == 0) {
+			delete_pack_entry(pack, file_name);
+			compact_pack_if_needed(pack);
+		}
+	}
+	unlock_pack(pack);
+	return result;
+}
+
+
+int open_packed_file(const char* username, int user_dir_fd, const char* file_name,
+		off_t* offset, size_t* len) {
+	struct Pack* pack = lock_pack(username, user_dir_fd);
+	if (pack == NULL) {
+		return -1;
+	}
+	int file_fd = -1;
+	struct PackEntry* entry = find_pack_entry(pack, file_name);
+	if (entry != NULL) {
+		file_fd = fcntl(pack->segment_fd, F_DUPFD_CLOEXEC, 0);
+		*offset = entry->record_offset + get_record_len(strlen(entry->name), 0);
+		*len = entry->data_len;
+	}
+	unlock_pack(pack);
+	return file_fd;
+}
+
+
+int find_packed_file(const char* username, int user_dir_fd, const char* file_name,
+		uint64_t* len, uint32_t* checksum) {
+	struct Pack* pack = lock_pack(username, user_dir_fd);
+	if (pack == NULL) {
+		return -1;
+	}
+	struct PackEntry* entry = find_pack_entry(pack, file_name);
+	if (entry != NULL) {
+		*len = entry->data_len;
+		*checksum = entry->checksum;
+	}
+	unlock_pack(pack);
+	return entry != NULL ? 0 : -1;
+}
+
+
+int add_packed_files(const char* username, int user_dir_fd, struct FileTable* files) {
+	struct Pack* pack = lock_pack(username, user_dir_fd);
+	if (pack == NULL) {
+		return -1;
+	}
+	// mark the packed files hidden by a regular file
+	uint64_t mark = ++pack->n_listings;
+	int i;
+	for (i = 0; i < files->n_files && pack->n_entries > 0; i++) {
+		struct PackEntry* entry = find_pack_entry(pack, get_file_name(files, &files->files[i]));
+		if (entry != NULL) {
+			entry->listing_mark = mark;
+		}
+	}
+	int result = 0;
+	for (i = 0; i < pack->n_buckets && result == 0; i++) {
+		struct PackEntry* entry;
+		for (entry = pack->buckets[i]; entry != NULL && result == 0; entry = entry->next) {
+			if (entry->listing_mark != mark) {
+				result = add_file_info(files, entry->name, strlen(entry->name), entry->checksum);
+			}
+		}
+	}
+	unlock_pack(pack);
+	return result;
+}
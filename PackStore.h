@@ -0,0 +1,90 @@
+/**
+ * A log-structured store for the small files of a user, so that thousands
+ * of cover images, playlists or lyrics cost neither an inode nor a stat
+ * each. The files are appended to a single segment file in the user's
+ * directory (.pack), as records holding the name, checksum and content of
+ * the file. Removing a file appends a record saying so.
+ *
+ * The extents of the files are indexed in memory, built by reading the
+ * segment sequentially when the user's files are first needed. Listing
+ * packed files is then a walk of the index, and reading one is a range of
+ * the segment. Once most of the segment is made of replaced or removed
+ * files, it is rewritten in the background with only the live records.
+ *
+ * A regular file of the user's directory hides a packed file of the same
+ * name, so that either can replace the other atomically: a packed file
+ * replaces a regular one by being appended, then unlinking the regular one.
+ *
+ * Like catalogs, the packs no thread has used for the longest are closed
+ * past a bound (see UserRegistry), and loaded again when needed.
+ */
+
+#ifndef PACK_STORE_H_
+#define PACK_STORE_H_
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "FileTable.h"
+
+
+/**
+ * @return true if a file of a user directory belongs to the pack store
+ */
+bool is_pack_file(const char* name);
+
+
+/**
+ * Append a file to the user's pack, replacing the packed file of the same
+ * name if any. The caller then removes the regular file of the same name.
+ * @param user_dir_fd Descriptor of the user's directory
+ * @param checksum    CRC-32 of the content, given back by listings
+ * @return 0 if success, -1 if error
+ */
+int store_packed_file(const char* username, int user_dir_fd, const char* file_name,
+		const void* data, size_t data_len, uint32_t checksum);
+
+
+/**
+ * Remove a file from the user's pack, if it is there. Called after a
+ * regular file of the same name is stored
+ * @return 0 if success or the file is not packed, -1 if error
+ */
+int remove_packed_file(const char* username, int user_dir_fd, const char* file_name);
+
+
+/**
+ * Find a packed file
+ * @param offset [out] Offset of the content in the returned file
+ * @param len    [out] Length of the content
+ * @return A new descriptor of the segment holding the file, which stays
+ *         readable even if the segment is compacted meanwhile, or -1 if
+ *         the file is not packed
+ */
+int open_packed_file(const char* username, int user_dir_fd, const char* file_name,
+		off_t* offset, size_t* len);
+
+
+/**
+ * Find the length and checksum of a packed file
+ * @param len      [out] Length of the content
+ * @param checksum [out] CRC-32 of the content
+ * @return 0 if success, -1 if the file is not packed
+ */
+int find_packed_file(const char* username, int user_dir_fd, const char* file_name,
+		uint64_t* len, uint32_t* checksum);
+
+
+/**
+ * Add the packed files of a user to a listing of the user's regular files,
+ * except those hidden by a regular file
+ * @param files Table holding the regular files of the user's directory
+ * @return 0 if success, -1 if error
+ */
+int add_packed_files(const char* username, int user_dir_fd, struct FileTable* files);
+
+
+#endif // PACK_STORE_H_
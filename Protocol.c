@@ -1,8 +1,50 @@
 #include "Protocol.h"
 
 #include <arpa/inet.h>  /* htons, ntohs */
+#include <endian.h>     /* be64toh, htobe64 */
+#include <errno.h>
+#include <netinet/in.h> /* IPPROTO_TCP */
+#include <netinet/tcp.h> /* TCP_CORK */
+#include <poll.h>       /* poll */
 #include <stdio.h>      /* file IO */
 #include <string.h>     /* memcpy */
+#include <sys/sendfile.h> /* sendfile */
+#include <sys/socket.h> /* recv, send */
+#include <unistd.h>     /* read */
+
+
+size_t get_header_len(uint8_t version) {
+    if (version == VERSION_1) {
+        return HEADER_LEN_V1;
+    }
+    if (version == VERSION_2) {
+        return HEADER_LEN_V2;
+    }
+    return 0;
+}
+
+
+uint64_t get_packet_len(const char* buffer) {
+    if ((uint8_t)buffer[0] == VERSION_1) {
+        const struct PacketHeader* header = (const struct PacketHeader*)buffer;
+        return ntohs(header->packet_len);
+    }
+    const struct PacketHeaderV2* header = (const struct PacketHeaderV2*)buffer;
+    return be64toh(header->packet_len);
+}
+
+
+int wait_for_socket(int socket, short events) {
+    struct pollfd poll_fd;
+    poll_fd.fd = socket;
+    poll_fd.events = events;
+    while (poll(&poll_fd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
 
 /**
@@ -12,12 +54,28 @@
  * @param  buff_len    Maximum length of the buffer
  * @param  n_received  Number of bytes already received before this call
  * @param  target_len  The least number of bytes to be received in total
- * @return Number of bytes read in total, or -1 if error
+ * @return Number of bytes read in total, or -1 if error.
+ *         If the socket is non-blocking and no byte at all is available,
+ *         return 0 without consuming anything
  */
 ssize_t receive_packet_until(int socket, char* buffer, size_t buff_len, int n_received, int target_len) {
     while(n_received < target_len) {
         int n_new_bytes = recv(socket, buffer + n_received, 
                                buff_len - n_received, 0);
+        if (n_new_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (n_received == 0) {
+                // nothing to read yet
+                return 0;
+            }
+            // the rest of the packet is still in flight
+            if (wait_for_socket(socket, POLLIN) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (n_new_bytes < 0 && errno == EINTR) {
+            continue;
+        }
         if (n_new_bytes <= 0) {
             // fail to recv
             return -1;
@@ -35,14 +93,27 @@ ssize_t receive_packet(int socket ,char* buffer, size_t buff_len) {
     // the full packet header, which contains the packet length, then
     // use that length as stopping condition for the rest of the loop.
 
-    // receive the header, and find the packet length
-    n_received = receive_packet_until(socket, buffer, buff_len, 0, HEADER_LEN);
+    // receive the start of the header, which tells the version
+    n_received = receive_packet_until(socket, buffer, buff_len, 0, MIN_HEADER_LEN);
     if (n_received <= 0) {
-        // failed to receive data
+        // failed to receive data, or no data available yet
+        return n_received;
+    }
+
+    // receive the rest of the header, and find the packet length
+    size_t header_len = get_header_len(buffer[0]);
+    if (header_len == 0 || header_len > buff_len) {
+        // unsupported version
+        return -1;
+    }
+    n_received = receive_packet_until(socket, buffer, buff_len, n_received, header_len);
+    if (n_received < 0) {
+        return -1;
+    }
+    uint64_t packet_len = get_packet_len(buffer);
+    if (packet_len < header_len) {
         return -1;
     }
-    struct PacketHeader* header = (struct PacketHeader*)buffer;
-    int packet_len = ntohs(header->packet_len);
     
     // don't receive entire packet if it's too large
     if (packet_len > buff_len) {
@@ -59,30 +130,66 @@ ssize_t receive_packet(int socket ,char* buffer, size_t buff_len) {
 }
 
 
+ssize_t send_packet(int socket, const char* buffer, size_t packet_len) {
+    size_t n_sent = 0;
+    while (n_sent < packet_len) {
+        ssize_t n_new_bytes = send(socket, buffer + n_sent, 
+                                   packet_len - n_sent, MSG_NOSIGNAL);
+        if (n_new_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // socket buffer is full, wait until the peer reads some data
+            if (wait_for_socket(socket, POLLOUT) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (n_new_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_new_bytes < 0) {
+            return -1;
+        }
+        n_sent += n_new_bytes;
+    }
+    return n_sent;
+}
+
+
 /**
  * Helper function to write packet header 
+ * @return Length of the header
  */
-void make_header(char* buffer, enum PacketType type, uint16_t packet_len, uint32_t token) {
-    struct PacketHeader* header = (struct PacketHeader*) buffer;
-    header->version = VERSION;
+size_t make_header(char* buffer, uint8_t version, enum PacketType type, uint64_t packet_len, uint32_t token) {
+    if (version == VERSION_1) {
+        struct PacketHeader* header = (struct PacketHeader*) buffer;
+        header->version = version;
+        header->type = type;
+        header->packet_len = htons(packet_len);
+        header->session_token = token;
+        return HEADER_LEN_V1;
+    }
+    struct PacketHeaderV2* header = (struct PacketHeaderV2*) buffer;
+    header->version = version;
     header->type = type;
-    header->packet_len = htons(packet_len);
+    header->reserved = 0;
     header->session_token = token;
+    header->packet_len = htobe64(packet_len);
+    return HEADER_LEN_V2;
 }
 
 
-ssize_t make_header_only_packet(char* buffer, size_t buff_len, enum PacketType type, uint32_t token) {
+ssize_t make_header_only_packet(char* buffer, size_t buff_len, uint8_t version, enum PacketType type, uint32_t token) {
     /* make sure buffer has enough length */
-    if (buff_len < HEADER_LEN) {
+    size_t header_len = get_header_len(version);
+    if (buff_len < header_len) {
         return -1;
     }
-    make_header(buffer, type, HEADER_LEN, token);
-    return HEADER_LEN;
+    return make_header(buffer, version, type, header_len, token);
 }
 
 
 ssize_t make_logon_request(char* buffer, 
                      size_t buff_len, 
+                     uint8_t version,
                      bool is_new_account,
                      const char* username, 
                      const char* password) {
@@ -91,7 +198,7 @@ ssize_t make_logon_request(char* buffer,
     
     size_t user_len = strlen(username) + 1; // include null terminator
     size_t pass_len = strlen(password) + 1; // include null terminator
-    size_t packet_len = HEADER_LEN + user_len + pass_len;
+    size_t packet_len = get_header_len(version) + user_len + pass_len;
     // if buffer too small, return with error
     if (buff_len < packet_len) {
         return -1;
@@ -100,12 +207,12 @@ ssize_t make_logon_request(char* buffer,
     /* write header */
 
     enum PacketType type = is_new_account? TYPE_SIGNUP_REQUEST : TYPE_LOGON_REQUEST;
-    make_header(buffer, type, packet_len, 0);
+    size_t header_len = make_header(buffer, version, type, packet_len, 0);
 
     /* write data */
 
     // write user name (including null terminator)
-    buffer += HEADER_LEN;
+    buffer += header_len;
     memcpy(buffer, username, user_len);
 
     // write password (including null terminator)
@@ -115,54 +222,68 @@ ssize_t make_logon_request(char* buffer,
 }
 
 
-ssize_t make_token_response(char* buffer, size_t buff_len, uint32_t token) {
-    return make_header_only_packet(buffer, buff_len, TYPE_TOKEN_RESPONSE, token);
+ssize_t make_token_response(char* buffer, size_t buff_len, uint8_t version, uint32_t token) {
+    return make_header_only_packet(buffer, buff_len, version, TYPE_TOKEN_RESPONSE, token);
 }
 
 
-ssize_t make_leave_request(char* buffer, size_t buff_len, uint32_t token) {
-    return make_header_only_packet(buffer, buff_len, TYPE_LEAVE_REQUEST, token);
+ssize_t make_leave_request(char* buffer, size_t buff_len, uint8_t version, uint32_t token) {
+    return make_header_only_packet(buffer, buff_len, version, TYPE_LEAVE_REQUEST, token);
 }
 
 
-ssize_t make_list_request(char* buffer, size_t buff_len, uint32_t token) {
-    return make_header_only_packet(buffer, buff_len, TYPE_LIST_REQUEST, token);
+ssize_t make_list_request(char* buffer, size_t buff_len, uint8_t version, uint32_t token) {
+    return make_header_only_packet(buffer, buff_len, version, TYPE_LIST_REQUEST, token);
 }
 
 
-ssize_t make_list_response(char* buffer, size_t buff_len, uint32_t token, 
-        struct FileInfo* file_info, int n_files) {
-    // make sure buffer is big enough for packet
-    size_t packet_len = HEADER_LEN + (MAX_FILE_NAME_LEN + 4) * n_files;
-    if (buff_len < packet_len) {
+ssize_t make_list_body(char* buffer, size_t buff_len, const struct FileTable* files) {
+    // make sure buffer is big enough for body
+    size_t body_len = (MAX_FILE_NAME_LEN + 4) * files->n_files;
+    if (buff_len < body_len) {
         return -1;
     }
 
-    // write header
-    make_header(buffer, TYPE_LIST_RESPONSE, packet_len, token);
-    buffer += HEADER_LEN;
-
     // write data
     int i;
-    for (i = 0; i < n_files; i++) {
-        // file name
-        memcpy(buffer, file_info->name, MAX_FILE_NAME_LEN);
+    for (i = 0; i < files->n_files; i++) {
+        const struct FileInfo* file_info = &files->files[i];
+        // file name, padded with null characters
+        strncpy(buffer, get_file_name(files, file_info), MAX_FILE_NAME_LEN);
         buffer += MAX_FILE_NAME_LEN;
         // 4-byte checksum
         uint32_t checksum_network_endian = htonl(file_info->checksum);
         memcpy(buffer, &checksum_network_endian, 4);
         buffer += 4;
-        file_info = file_info->next;
     }
 
+    return body_len;
+}
+
+
+ssize_t make_list_response(char* buffer, size_t buff_len, uint8_t version, uint32_t token,
+        const char* list_body, size_t body_len) {
+    // make sure buffer is big enough for packet
+    size_t header_len = get_header_len(version);
+    size_t packet_len = header_len + body_len;
+    if (buff_len < packet_len) {
+        return -1;
+    }
+
+    // write data, unless it was encoded in place, then header
+    if (list_body != buffer + header_len) {
+        memmove(buffer + header_len, list_body, body_len);
+    }
+    make_header(buffer, version, TYPE_LIST_RESPONSE, packet_len, token);
     return packet_len;
 }
 
 
 ssize_t make_file_request(
-        char* buffer, size_t buff_len, uint32_t token, const char* file_name) {
+        char* buffer, size_t buff_len, uint8_t version, uint32_t token, const char* file_name) {
     size_t file_name_len = strlen(file_name) + 1;  // include null terminator
-    size_t packet_len = HEADER_LEN + file_name_len;
+    size_t header_len = get_header_len(version);
+    size_t packet_len = header_len + file_name_len;
 
     // make sure buffer is big enough for packet
     if (buff_len < packet_len) {
@@ -170,38 +291,99 @@ ssize_t make_file_request(
     }
 
     // write header and data
-    make_header(buffer, TYPE_FILE_REQUEST, packet_len, token);
-    memcpy(buffer + HEADER_LEN, file_name, file_name_len);
+    make_header(buffer, version, TYPE_FILE_REQUEST, packet_len, token);
+    memcpy(buffer + header_len, file_name, file_name_len);
     return packet_len;
 }
 
 
-ssize_t make_file_transfer_header(char* buffer, size_t buff_len, uint32_t token, uint16_t data_len) {
-    if (buff_len < HEADER_LEN) {
+ssize_t make_file_transfer_header(char* buffer, size_t buff_len, uint8_t version, uint32_t token, uint64_t data_len) {
+    size_t header_len = get_header_len(version);
+    if (buff_len < header_len) {
+        return -1;
+    }
+    // version 1 can only describe packets up to 64KB
+    if (version == VERSION_1 && header_len + data_len > UINT16_MAX) {
+        return -1;
+    }
+    return make_header(buffer, version, TYPE_FILE_TRANSFER, header_len + data_len, token);
+}
+
+
+ssize_t make_file_upload_header(char* buffer, size_t buff_len, uint8_t version, uint32_t token,
+        const char* file_name, uint64_t file_len) {
+    ssize_t header_len = make_file_transfer_header(buffer, buff_len, version, token,
+            MAX_FILE_NAME_LEN + file_len);
+    if (header_len < 0 || buff_len < header_len + MAX_FILE_NAME_LEN) {
         return -1;
     }
-    make_header(buffer, TYPE_FILE_TRANSFER, HEADER_LEN + data_len, token);
-    return HEADER_LEN;
+    // strncpy pads the rest of the name with zeros
+    strncpy(buffer + header_len, file_name, MAX_FILE_NAME_LEN);
+    return header_len + MAX_FILE_NAME_LEN;
 }
 
 
-ssize_t make_file_transfer_body(char* buffer, size_t buff_len, FILE* file) {
-    return fread(buffer, 1, buff_len, file);
+void set_socket_cork(int socket, bool is_corked) {
+    int value = is_corked;
+    setsockopt(socket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
+
+ssize_t send_file_content(int socket, int file_fd, size_t file_len, char* buffer, size_t buff_len) {
+    size_t n_sent = 0;
+
+    // zero-copy: let the kernel move pages from the file to the socket
+    while (n_sent < file_len) {
+        ssize_t n_new_bytes = sendfile(socket, file_fd, NULL, file_len - n_sent);
+        if (n_new_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_for_socket(socket, POLLOUT) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (n_new_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_new_bytes < 0 && (errno == EINVAL || errno == ENOSYS) && n_sent == 0) {
+            // sendfile is not supported for this file, copy it instead
+            break;
+        }
+        if (n_new_bytes <= 0) {
+            // error, or the file is shorter than expected
+            return -1;
+        }
+        n_sent += n_new_bytes;
+    }
+
+    // fallback: copy through the buffer
+    while (n_sent < file_len) {
+        size_t chunk_len = file_len - n_sent < buff_len ? file_len - n_sent : buff_len;
+        ssize_t n_new_bytes = read(file_fd, buffer, chunk_len);
+        if (n_new_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_new_bytes <= 0 || send_packet(socket, buffer, n_new_bytes) < 0) {
+            return -1;
+        }
+        n_sent += n_new_bytes;
+    }
+    return n_sent;
 }
 
 
-ssize_t make_file_received_packet(char* buffer, size_t buff_len, uint32_t token) {
-    return make_header_only_packet(buffer, buff_len, TYPE_FILE_RECEIVED, token);
+ssize_t make_file_received_packet(char* buffer, size_t buff_len, uint8_t version, uint32_t token) {
+    return make_header_only_packet(buffer, buff_len, version, TYPE_FILE_RECEIVED, token);
 }
 
 
-ssize_t make_error_response(char* buffer, size_t buff_len, uint32_t token, enum ErrorType error) {
-    size_t packet_len = HEADER_LEN + 1;
+ssize_t make_error_response(char* buffer, size_t buff_len, uint8_t version, uint32_t token, enum ErrorType error) {
+    size_t header_len = get_header_len(version);
+    size_t packet_len = header_len + 1;
     if (buff_len < packet_len) {
         return -1;
     }
-    make_header(buffer, TYPE_ERROR, packet_len, token);
-    buffer[HEADER_LEN] = error;
+    make_header(buffer, version, TYPE_ERROR, packet_len, token);
+    buffer[header_len] = error;
     return packet_len;
 }
 
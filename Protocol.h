@@ -15,8 +15,11 @@
 #include "StorageService.h"
 
 
-/** Protocol version */
-static const uint8_t VERSION = 0x1;
+/** Protocol versions */
+static const uint8_t VERSION_1 = 0x1;
+static const uint8_t VERSION_2 = 0x2;
+/** Latest protocol version, used by the client */
+static const uint8_t VERSION = 0x2;
 
 /* 
  * Packet types 
@@ -44,69 +47,198 @@ enum ErrorType {
     ERROR_INVALID_PASSWORD,
     ERROR_FILE_NOT_EXIST,
     ERROR_FILE_UPLOAD_FAILED,
+    ERROR_FILE_TOO_LARGE,
 };
 
 
 /**
- * Common packet header
+ * Packet header of protocol version 1.
+ * The version, type and token fields are at the same place in all versions,
+ * so they can be read through this struct whatever the version.
  */
 struct PacketHeader {
     /** Protocol version */
     uint8_t  version;
     /** Request type */
     uint8_t  type;
-    /** Token specific to an user and a session */
+    /** Length of the packet, including the header */
     uint16_t packet_len;
     /** Token specific to an user and a session */
     uint32_t session_token;
 };
 
-static const size_t HEADER_LEN = sizeof(struct PacketHeader);
+
+/**
+ * Packet header of protocol version 2, with a 64-bit packet length so that
+ * files larger than 64KB can be transferred
+ */
+struct PacketHeaderV2 {
+    /** Protocol version */
+    uint8_t  version;
+    /** Request type */
+    uint8_t  type;
+    /** Unused, must be 0 */
+    uint16_t reserved;
+    /** Token specific to an user and a session */
+    uint32_t session_token;
+    /** Length of the packet, including the header */
+    uint64_t packet_len;
+};
+
+static const size_t HEADER_LEN_V1 = sizeof(struct PacketHeader);
+static const size_t HEADER_LEN_V2 = sizeof(struct PacketHeaderV2);
+/** Number of bytes needed to know the version of a packet */
+static const size_t MIN_HEADER_LEN = sizeof(struct PacketHeader);
+static const size_t MAX_HEADER_LEN = sizeof(struct PacketHeaderV2);
 
 
+/**
+ * Find the header length of a protocol version
+ * @return Length of the header, or 0 if the version is not supported
+ */
+size_t get_header_len(uint8_t version);
+
+
+/**
+ * Find the total length of a packet from its header
+ * @param  buffer Buffer starting with a full packet header, of a supported version
+ * @return Length of the packet, including the header
+ */
+uint64_t get_packet_len(const char* buffer);
+
+
+/**
+ * Block until the socket is ready for the given events.
+ * Used when a non-blocking socket runs out of data (or buffer space)
+ * in the middle of a packet.
+ * @param  events Poll events to wait for (POLLIN, POLLOUT)
+ * @return 0 if the socket is ready, -1 if error
+ */
+int wait_for_socket(int socket, short events);
+
+
+/**
+ * Receive one full packet, of any supported version, from a TCP socket
+ * @param  socket   TCP socket to read from. May be non-blocking
+ * @param  buffer   Buffer to read into
+ * @param  buff_len Maximum length of the buffer
+ * @return Length of the packet, -1 if error or the connection is closed,
+ *         or 0 if the socket is non-blocking and no data is available yet.
+ *         If the packet is longer than the buffer, only the first buff_len
+ *         bytes are received
+ */
 ssize_t receive_packet(int socket ,char* buffer, size_t buff_len);
 
+
+/**
+ * Send an entire packet, retrying on partial writes.
+ * If the socket is non-blocking and its buffer is full, wait until
+ * the socket becomes writable again.
+ * @return Number of bytes sent (packet_len), or -1 if error
+ */
+ssize_t send_packet(int socket, const char* buffer, size_t packet_len);
+
+
+/*
+ * Packet builders. The version argument is the protocol version of the
+ * packet, and must be supported.
+ */
+
+
 /**
  * Make the logon packet containing user name and password
  * Return length of packet, or -1 if fail
  */
 ssize_t make_logon_request(char* buffer, 
                           size_t buff_len, 
+                          uint8_t version,
                           bool is_new_account,
                           const char* username, 
                           const char* password);
 
 
-ssize_t make_token_response(char* buffer, size_t buff_len, uint32_t token);
+ssize_t make_token_response(char* buffer, size_t buff_len, uint8_t version, uint32_t token);
 
 
 /**
  * Make the packet indicating client is leaving the server
  * @return Length of packet, or -1 if error
  */
-ssize_t make_leave_request(char* buffer, size_t buff_len, uint32_t token);
+ssize_t make_leave_request(char* buffer, size_t buff_len, uint8_t version, uint32_t token);
 
 
-ssize_t make_list_request(char* buffer, size_t buff_len, uint32_t token);
+ssize_t make_list_request(char* buffer, size_t buff_len, uint8_t version, uint32_t token);
 
 
-ssize_t make_list_response(char* buffer, size_t buff_len, uint32_t token, 
-        struct FileInfo* file_info, int n_files);
+/**
+ * Encode a list of files, as the body of a list response
+ * @return Length of the body, or -1 if the buffer is too small
+ */
+ssize_t make_list_body(char* buffer, size_t buff_len, const struct FileTable* files);
+
+
+/**
+ * Make a list response around a body made by make_list_body. The body is
+ * copied after the header, unless it was encoded there already
+ * @return Length of packet, or -1 if error
+ */
+ssize_t make_list_response(char* buffer, size_t buff_len, uint8_t version, uint32_t token,
+        const char* list_body, size_t body_len);
 
 
 ssize_t make_file_request(
-        char* buffer, size_t buff_len, uint32_t token, const char* file_name);
+        char* buffer, size_t buff_len, uint8_t version, uint32_t token, const char* file_name);
+
 
+/**
+ * Make the header of a file transfer packet, whose data follows separately
+ * @param  data_len Length of the data following the header
+ * @return Length of the header, or -1 if the buffer is too small or the
+ *         packet is too long for the protocol version
+ */
+ssize_t make_file_transfer_header(char* buffer, size_t buff_len, uint8_t version, uint32_t token, uint64_t data_len);
 
-ssize_t make_file_transfer_header(char* buffer, size_t buff_len, uint32_t token, uint16_t data_len);
+
+/**
+ * Make the start of a file upload packet: the header, then the file name
+ * padded to MAX_FILE_NAME_LEN bytes. The file content follows separately,
+ * or right after them in the buffer, so that everything is sent at once.
+ * @param  file_len Length of the file content
+ * @return Length of the header and file name, or -1 if the buffer is too
+ *         small or the packet is too long for the protocol version
+ */
+ssize_t make_file_upload_header(char* buffer, size_t buff_len, uint8_t version, uint32_t token,
+        const char* file_name, uint64_t file_len);
 
 
-ssize_t make_file_transfer_body(char* buffer, size_t buff_len, FILE* file);
+/**
+ * Hold back or release partial packets on a TCP socket. While corked,
+ * separate writes (e.g. a header and the file after it) are merged into
+ * full packets. Uncorking sends whatever is left right away.
+ */
+void set_socket_cork(int socket, bool is_corked);
+
+
+/**
+ * Send the content of a file as the body of a file transfer packet.
+ * The file is streamed straight from the page cache with sendfile(),
+ * or copied through the buffer with read/send if sendfile is not
+ * supported for this file.
+ * If the socket is non-blocking and its buffer is full, wait until
+ * the socket becomes writable again.
+ * @param  socket   Socket to send to
+ * @param  file_fd  Descriptor of the file, positioned at the start
+ * @param  file_len Number of bytes to send
+ * @param  buffer   Buffer for the read/send fallback
+ * @param  buff_len Length of the buffer
+ * @return Number of bytes sent (file_len), or -1 if error
+ */
+ssize_t send_file_content(int socket, int file_fd, size_t file_len, char* buffer, size_t buff_len);
 
 
-ssize_t make_file_received_packet(char* buffer, size_t buff_len, uint32_t token);
+ssize_t make_file_received_packet(char* buffer, size_t buff_len, uint8_t version, uint32_t token);
 
 
-ssize_t make_error_response(char* buffer, size_t buff_len, uint32_t token, enum ErrorType error);
+ssize_t make_error_response(char* buffer, size_t buff_len, uint8_t version, uint32_t token, enum ErrorType error);
 
 #endif // PROTOCOL_H_
\ No newline at end of file
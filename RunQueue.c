@@ -0,0 +1,55 @@
+#include "RunQueue.h"
+
+#include <stddef.h>
+
+
+void initialize_run_queue(struct RunQueue* queue) {
+	queue->sentinel.prev = &queue->sentinel;
+	queue->sentinel.next = &queue->sentinel;
+	queue->sentinel.context = NULL;
+	queue->n_entries = 0;
+}
+
+
+void initialize_run_queue_entry(struct RunQueueEntry* entry, void* context) {
+	entry->prev = NULL;
+	entry->next = NULL;
+	entry->context = context;
+}
+
+
+bool is_queued(const struct RunQueueEntry* entry) {
+	return entry->next != NULL;
+}
+
+
+void push_run_queue(struct RunQueue* queue, struct RunQueueEntry* entry) {
+	struct RunQueueEntry* tail = queue->sentinel.prev;
+	entry->prev = tail;
+	entry->next = &queue->sentinel;
+	tail->next = entry;
+	queue->sentinel.prev = entry;
+	queue->n_entries++;
+}
+
+
+struct RunQueueEntry* pop_run_queue(struct RunQueue* queue) {
+	struct RunQueueEntry* head = queue->sentinel.next;
+	if (head == &queue->sentinel) {
+		return NULL;
+	}
+	remove_from_run_queue(queue, head);
+	return head;
+}
+
+
+void remove_from_run_queue(struct RunQueue* queue, struct RunQueueEntry* entry) {
+	if (!is_queued(entry)) {
+		return;
+	}
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->prev = NULL;
+	entry->next = NULL;
+	queue->n_entries--;
+}
@@ -0,0 +1,73 @@
+/**
+ * A FIFO queue of tasks waiting for their turn, used to share a thread
+ * fairly between connections (deficit round-robin).
+ * The queue is intrusive: each task embeds its own RunQueueEntry, so
+ * queueing and removing a task are O(1) and never allocate.
+ */
+
+#ifndef RUN_QUEUE_H_
+#define RUN_QUEUE_H_
+
+
+#include <stdbool.h>
+
+
+/**
+ * Link of a task in a run queue
+ */
+struct RunQueueEntry {
+	struct RunQueueEntry* prev;
+	struct RunQueueEntry* next;
+	/** Arbitrary data for the owner of the queue */
+	void* context;
+};
+
+
+/**
+ * A circular doubly-linked list of entries, around a sentinel
+ */
+struct RunQueue {
+	struct RunQueueEntry sentinel;
+	/** Number of entries in the queue */
+	int n_entries;
+};
+
+
+/**
+ * Initialize an empty queue
+ */
+void initialize_run_queue(struct RunQueue* queue);
+
+
+/**
+ * Initialize an entry that is not in any queue
+ */
+void initialize_run_queue_entry(struct RunQueueEntry* entry, void* context);
+
+
+/**
+ * @return true if the entry is waiting in a queue
+ */
+bool is_queued(const struct RunQueueEntry* entry);
+
+
+/**
+ * Add an entry at the tail of the queue. The entry must not be queued.
+ */
+void push_run_queue(struct RunQueue* queue, struct RunQueueEntry* entry);
+
+
+/**
+ * Remove the entry at the head of the queue
+ * @return The removed entry, or NULL if the queue is empty
+ */
+struct RunQueueEntry* pop_run_queue(struct RunQueue* queue);
+
+
+/**
+ * Remove an entry from the queue it is in. Do nothing if it is not queued.
+ */
+void remove_from_run_queue(struct RunQueue* queue, struct RunQueueEntry* entry);
+
+
+#endif // RUN_QUEUE_H_
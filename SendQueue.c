@@ -0,0 +1,248 @@
+#include "SendQueue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+/** Size of the buffer used to copy a file when sendfile is not supported */
+#define FILE_COPY_CHUNK 8192
+
+/** Max number of buffer segments gathered into one sendmsg() */
+#define MAX_GATHERED_SEGMENTS 16
+
+
+/**
+ * Add a segment at the tail of the queue
+ * @return 0 if success, -1 if out of memory
+ */
+int push_segment(struct SendQueue* queue, enum SegmentType type,
+		char* data, int file_fd, off_t offset, size_t data_len) {
+	struct SendSegment* segment = malloc(sizeof(struct SendSegment));
+	if (segment == NULL) {
+		return -1;
+	}
+	segment->type = type;
+	segment->data = data;
+	segment->file_fd = file_fd;
+	segment->offset = offset;
+	segment->end = offset + data_len;
+	segment->next = NULL;
+
+	if (queue->tail == NULL) {
+		queue->head = segment;
+	} else {
+		queue->tail->next = segment;
+	}
+	queue->tail = segment;
+	queue->n_pending += data_len;
+	return 0;
+}
+
+
+/**
+ * Remove the segment at the head of the queue, releasing its buffer or file
+ */
+void pop_segment(struct SendQueue* queue) {
+	struct SendSegment* segment = queue->head;
+	queue->n_pending -= segment->end - segment->offset;
+	queue->head = segment->next;
+	if (queue->head == NULL) {
+		queue->tail = NULL;
+	}
+	if (segment->type != SEGMENT_FILE) {
+		free(segment->data);
+	}
+	if (segment->file_fd >= 0) {
+		close(segment->file_fd);
+	}
+	free(segment);
+}
+
+
+/**
+ * Mark the first n bytes of the queue as sent, releasing the segments
+ * that are sent completely
+ */
+void consume_send_queue(struct SendQueue* queue, size_t n) {
+	while (n > 0) {
+		struct SendSegment* segment = queue->head;
+		size_t segment_len = segment->end - segment->offset;
+		if (n < segment_len) {
+			segment->offset += n;
+			queue->n_pending -= n;
+			return;
+		}
+		n -= segment_len;
+		pop_segment(queue);
+	}
+}
+
+
+/**
+ * Send the buffer segments at the head of the queue with a single
+ * sendmsg(), up to max_len bytes. If more data follows right after them,
+ * the kernel is told to hold the last packet, so that consecutive
+ * responses (or a header and the start of a file) share packets.
+ * @return Number of bytes sent, or -1 if error (errno is set)
+ */
+ssize_t send_buffer_segments(struct SendQueue* queue, int socket, size_t max_len) {
+	struct iovec parts[MAX_GATHERED_SEGMENTS];
+	int n_parts = 0;
+	size_t len = 0;
+	struct SendSegment* segment = queue->head;
+	while (segment != NULL && segment->type == SEGMENT_BUFFER
+			&& n_parts < MAX_GATHERED_SEGMENTS && len < max_len) {
+		size_t part_len = segment->end - segment->offset;
+		if (part_len > max_len - len) {
+			part_len = max_len - len;
+		}
+		parts[n_parts].iov_base = segment->data + segment->offset;
+		parts[n_parts].iov_len = part_len;
+		n_parts++;
+		len += part_len;
+		segment = segment->next;
+	}
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = parts;
+	message.msg_iovlen = n_parts;
+	int flags = MSG_NOSIGNAL;
+	if (segment != NULL && len < max_len) {
+		flags |= MSG_MORE;
+	}
+	return sendmsg(socket, &message, flags);
+}
+
+
+/**
+ * Send part of a file segment, from its current offset
+ * @return Number of bytes sent, or -1 if error (errno is set)
+ */
+ssize_t send_file_range(struct SendSegment* segment, int socket, size_t len) {
+	off_t offset = segment->offset;
+	// zero-copy: let the kernel move pages from the file to the socket
+	ssize_t n_sent = sendfile(socket, segment->file_fd, &offset, len);
+	if (n_sent >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+		return n_sent;
+	}
+
+	// sendfile is not supported for this file, copy a chunk of it instead.
+	// Only the bytes the socket accepts are consumed, the rest is read again
+	char chunk[FILE_COPY_CHUNK];
+	ssize_t n_read = pread(segment->file_fd, chunk,
+			len < FILE_COPY_CHUNK ? len : FILE_COPY_CHUNK, segment->offset);
+	if (n_read <= 0) {
+		return -1;
+	}
+	return send(socket, chunk, n_read, MSG_NOSIGNAL);
+}
+
+
+void initialize_send_queue(struct SendQueue* queue) {
+	queue->head = NULL;
+	queue->tail = NULL;
+	queue->n_pending = 0;
+}
+
+
+bool is_send_queue_empty(const struct SendQueue* queue) {
+	return queue->head == NULL;
+}
+
+
+int push_buffer_segment(struct SendQueue* queue, char* data, size_t data_len) {
+	if (push_segment(queue, SEGMENT_BUFFER, data, -1, 0, data_len) < 0) {
+		free(data);
+		return -1;
+	}
+	return 0;
+}
+
+
+int push_file_segment(struct SendQueue* queue, int file_fd, off_t offset, size_t data_len) {
+	if (data_len == 0) {
+		// nothing to send. Not queueing it also keeps a packet held back
+		// by MSG_MORE from waiting for data that never comes
+		close(file_fd);
+		return 0;
+	}
+	if (push_segment(queue, SEGMENT_FILE, NULL, file_fd, offset, data_len) < 0) {
+		close(file_fd);
+		return -1;
+	}
+	return 0;
+}
+
+
+int push_path_segment(struct SendQueue* queue, const char* path, off_t offset, size_t data_len) {
+	if (data_len == 0) {
+		return 0;
+	}
+	char* path_copy = strdup(path);
+	if (path_copy == NULL) {
+		return -1;
+	}
+	if (push_segment(queue, SEGMENT_PATH, path_copy, -1, offset, data_len) < 0) {
+		free(path_copy);
+		return -1;
+	}
+	return 0;
+}
+
+
+ssize_t flush_send_queue(struct SendQueue* queue, int socket, size_t max_len) {
+	size_t n_sent = 0;
+	while (queue->head != NULL && n_sent < max_len) {
+		struct SendSegment* segment = queue->head;
+		size_t len = segment->end - segment->offset;
+		if (len == 0) {
+			pop_segment(queue);
+			continue;
+		}
+		if (len > max_len - n_sent) {
+			len = max_len - n_sent;
+		}
+
+		if (segment->type == SEGMENT_PATH && segment->file_fd < 0) {
+			segment->file_fd = open(segment->data, O_RDONLY | O_CLOEXEC);
+			if (segment->file_fd < 0) {
+				return -1;
+			}
+		}
+
+		ssize_t n_new_bytes;
+		if (segment->type == SEGMENT_BUFFER) {
+			n_new_bytes = send_buffer_segments(queue, socket, max_len - n_sent);
+		} else {
+			n_new_bytes = send_file_range(segment, socket, len);
+		}
+		if (n_new_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// the socket is full, the rest waits for it to be writable
+			break;
+		}
+		if (n_new_bytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n_new_bytes <= 0) {
+			// error, or the file is shorter than expected
+			return -1;
+		}
+		consume_send_queue(queue, n_new_bytes);
+		n_sent += n_new_bytes;
+	}
+	return n_sent;
+}
+
+
+void clear_send_queue(struct SendQueue* queue) {
+	while (queue->head != NULL) {
+		pop_segment(queue);
+	}
+}
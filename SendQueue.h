@@ -0,0 +1,116 @@
+/**
+ * A FIFO queue of data waiting to be sent on a non-blocking socket.
+ * Each segment is either a buffer in memory or a range of a file, which
+ * is sent with sendfile() without being copied to user space. A file may
+ * be given by its path, and is then opened only once its turn comes, so
+ * that a response made of many files holds one descriptor at a time.
+ * The queue owns its segments: buffers are freed and files are closed
+ * once they are sent, or when the queue is cleared.
+ */
+
+#ifndef SEND_QUEUE_H_
+#define SEND_QUEUE_H_
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/**
+ * What a segment of a send queue holds
+ */
+enum SegmentType {
+	SEGMENT_BUFFER = 0,
+	SEGMENT_FILE,
+	/** A file segment whose file is opened when it starts being sent */
+	SEGMENT_PATH,
+};
+
+
+/**
+ * Part of the data waiting to be sent
+ */
+struct SendSegment {
+	enum SegmentType type;
+	/** Data of a buffer segment, or path of a path segment */
+	char* data;
+	/** Descriptor of a file segment. -1 until a path segment is opened */
+	int file_fd;
+	/** Offset of the next byte to send, in the data or in the file */
+	off_t offset;
+	/** Offset past the last byte to send */
+	off_t end;
+	struct SendSegment* next;
+};
+
+
+/**
+ * A singly-linked list of segments, sent from head to tail
+ */
+struct SendQueue {
+	struct SendSegment* head;
+	struct SendSegment* tail;
+	/** Number of bytes queued but not sent yet */
+	size_t n_pending;
+};
+
+
+/**
+ * Initialize an empty queue
+ */
+void initialize_send_queue(struct SendQueue* queue);
+
+
+/**
+ * @return true if nothing is waiting to be sent
+ */
+bool is_send_queue_empty(const struct SendQueue* queue);
+
+
+/**
+ * Add a buffer at the tail of the queue. The queue takes ownership of the
+ * buffer, which must have been allocated with malloc.
+ * @return 0 if success, -1 if out of memory (the buffer is freed anyway)
+ */
+int push_buffer_segment(struct SendQueue* queue, char* data, size_t data_len);
+
+
+/**
+ * Add a range of a file at the tail of the queue. The queue takes
+ * ownership of the descriptor.
+ * @param offset   Offset of the first byte to send
+ * @param data_len Number of bytes to send
+ * @return 0 if success, -1 if out of memory (the file is closed anyway)
+ */
+int push_file_segment(struct SendQueue* queue, int file_fd, off_t offset, size_t data_len);
+
+
+/**
+ * Add a range of a file, given by its path, at the tail of the queue.
+ * The file is opened once all the segments before it are sent.
+ * @param offset   Offset of the first byte to send
+ * @param data_len Number of bytes to send
+ * @return 0 if success, -1 if out of memory
+ */
+int push_path_segment(struct SendQueue* queue, const char* path, off_t offset, size_t data_len);
+
+
+/**
+ * Send as much of the queue as the socket accepts, up to max_len bytes.
+ * If sendfile is not supported for a file, the file is copied through
+ * a small buffer instead. A path segment whose file can't be opened is
+ * an error.
+ * @return Number of bytes sent, or -1 if error. Less than max_len bytes
+ *         are sent if the queue becomes empty or the socket becomes full
+ */
+ssize_t flush_send_queue(struct SendQueue* queue, int socket, size_t max_len);
+
+
+/**
+ * Drop everything in the queue, releasing buffers and files
+ */
+void clear_send_queue(struct SendQueue* queue);
+
+
+#endif // SEND_QUEUE_H_
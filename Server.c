@@ -2,10 +2,26 @@
  * Run a server
  */
 
+#include <pthread.h>  // for running one client handler per thread
+#include <stdbool.h>
+#include <string.h>
+#include <sys/resource.h>  // for raising the limit of open descriptors
 #include <time.h>  // for setting random seed
 
 #include "NetworkHeader.h"
 #include "ClientHandler.h"
+#include "StorageService.h"
+
+
+#define DEFAULT_THREADS 1
+#define DEFAULT_MAX_CONNECTIONS 65536
+#define DEFAULT_SHARD_LEVELS 2
+#define DEFAULT_STORAGE_MODE STORAGE_FILES
+/** Longest window of the group commit, in ms */
+#define MAX_COMMIT_WINDOW_MS 1000
+/** Descriptors needed besides client sockets (listeners, epoll, files,
+ *  idle catalogs and packs, ...) */
+#define RESERVED_DESCRIPTORS 576
 
 
 /**
@@ -28,15 +44,47 @@ void die_with_error(const char* message, const char* detail);
  * @param argv        Array of command line arguments
  * @param server      [out] Address of the variable to store server IP
  * @param port        [out] Address of the variable to store the port string
+ * @param n_threads   [out] Address of the variable to store the number of threads
+ * @param max_connections [out] Address of the variable to store the max
+ *                    number of connections
+ * @param n_workers   [out] Address of the variable to store the number of
+ *                    checksum workers
+ * @param n_shard_levels [out] Address of the variable to store the number
+ *                    of shard levels above user directories
+ * @param storage_mode [out] Address of the variable to store where the
+ *                    contents of files are stored
+ * @param packed_kb   [out] Address of the variable to store the max size
+ *                    of packed files, in KB
+ * @param commit_window_ms [out] Address of the variable to store the window
+ *                    of the group commit, in ms
+ */
+void parse_arguments(int argc, char* argv[], int* port, int* n_threads, int* max_connections,
+		int* n_workers, int* n_shard_levels, enum StorageMode* storage_mode, int* packed_kb,
+		int* commit_window_ms);
+
+
+/**
+ * Raise the limit on the number of open descriptors, so that the server
+ * can hold the given number of connections. Warn if the hard limit is too low.
  */
-void parse_arguments(int argc, char* argv[], int* port);
+void raise_descriptor_limit(int max_connections);
 
 
 /**
- * Create the server socket at the specified port
+ * Create the non-blocking server socket at the specified port
+ * @param server_port The port to listen to
+ * @param reuse_port  Whether other sockets may listen to the same port,
+ *                    in which case the kernel load-balances new connections
+ *                    among them
  * @return the socket descriptor, or -1 if fail to create socket
  */
-int create_socket(int server_port);
+int create_socket(int server_port, bool reuse_port);
+
+
+/**
+ * Thread routine: serve clients with the given client handler forever
+ */
+void* serve_clients(void* handler);
 
 
 int main(int argc, char *argv[])
@@ -45,7 +93,15 @@ int main(int argc, char *argv[])
      * Parse arguments supplied to main program
      */
 	int server_port = atoi(SERVER_PORT);  // init with default value
-	parse_arguments(argc, argv, &server_port);
+	int n_threads = DEFAULT_THREADS;      // init with default value
+	int max_connections = DEFAULT_MAX_CONNECTIONS;  // init with default value
+	int n_workers = 0;  // 0 means one checksum worker per CPU
+	int n_shard_levels = DEFAULT_SHARD_LEVELS;  // init with default value
+	enum StorageMode storage_mode = DEFAULT_STORAGE_MODE;  // init with default value
+	int packed_kb = 0;  // 0 means no file is packed
+	int commit_window_ms = -1;  // -1 means uploads are not synced
+	parse_arguments(argc, argv, &server_port, &n_threads, &max_connections, &n_workers,
+			&n_shard_levels, &storage_mode, &packed_kb, &commit_window_ms);
 
 
 	/*
@@ -53,72 +109,52 @@ int main(int argc, char *argv[])
 	 */
 	// set seed for random calls in other services
 	srand(time(0));
-	int i;
-	int server_socket = create_socket(server_port);
-
- 	// keep track of which sockets has incoming data
-	fd_set activated_sockets;
-
-	// initial infos about connected clients
-	struct ClientInfo client_infos[MAX_CONNECTIONS];
-	memset(client_infos, 0, MAX_CONNECTIONS * sizeof(struct ClientInfo));
+	raise_descriptor_limit(max_connections);
 
 	// intialize client handler
+	set_checksum_workers(n_workers);
+	set_user_directory_levels(n_shard_levels);
+	set_storage_mode(storage_mode);
+	set_packed_file_size((size_t)packed_kb * 1024);
+	set_commit_window(commit_window_ms);
 	initialize_client_handler();
+	if (!is_storage_initialized()) {
+		die_with_error("Failed to initialize server", "User directories are in the way of the server's");
+	}
+	if (commit_window_ms >= 0 && !is_durable_storage()) {
+		die_with_error("Failed to initialize server", "Can't start the group commit");
+	}
+
+	// each thread has its own listening socket and its own client handler,
+	// so threads don't share any connection state
+	struct ClientHandler* handlers = malloc(n_threads * sizeof(struct ClientHandler));
+	if (handlers == NULL) {
+		die_with_error("Failed to initialize server", "Out of memory");
+	}
+	// connections are split evenly between threads
+	int max_thread_connections = (max_connections + n_threads - 1) / n_threads;
+	int i;
+	for (i = 0; i < n_threads; i++) {
+		int server_socket = create_socket(server_port, n_threads > 1);
+		if (create_client_handler(&handlers[i], server_socket, max_thread_connections) < 0) {
+			die_with_error("Failed to initialize server", "epoll_create1() failed");
+		}
+	}
 
 	/*
 	 * Do all the work here
 	 */
-	while (1) {
-		/*
-		 * add all sockets to monitored set
-		 */
-		// store the maximum socket descriptor for select()
-		int max_descriptor = server_socket;
-
-		// clear the set
-		FD_ZERO(&activated_sockets);
-		// add server socket into set
-		FD_SET(server_socket, &activated_sockets);
-		// add all client sockets to set
-		for (i = 0; i < MAX_CONNECTIONS; i++) {
-			// check for val
-			int client_socket = client_infos[i].client_socket;
-			if (client_socket > 0) {
-				FD_SET(client_socket, &activated_sockets);   
-            }
-            if(client_socket > max_descriptor) {
-                max_descriptor = client_socket;
-            }
-		}
-
-		/*
-		 * Wait for activity on some of the sockets
-		 */
-		int n_activities = select(max_descriptor + 1, &activated_sockets, NULL, NULL, NULL);
-		if (n_activities <= 0) {
-			continue;
-		}
-
-		/*
-		 * Handle activity for each activated socket
-		 */
-		// connection from new client
-		if (FD_ISSET(server_socket, &activated_sockets)) {
-			printf("\nHandling connection request\n");				
-			accept_client(server_socket, client_infos, MAX_CONNECTIONS);
-		}
-		// request from connected clients
-		for (i = 0; i < MAX_CONNECTIONS; i++) {
-			if (FD_ISSET(client_infos[i].client_socket, &activated_sockets)) {
-				printf("\nHandling client with client ID = %d\n", i);				
-				handle_client(&client_infos[i]);
-			}
+	// the main thread serves the first handler, other threads serve the rest
+	pthread_t thread;
+	for (i = 1; i < n_threads; i++) {
+		if (pthread_create(&thread, NULL, serve_clients, &handlers[i]) != 0) {
+			die_with_error("Failed to initialize server", "pthread_create() failed");
 		}
 	}
+	printf("Serving clients on port %d with %d thread(s)\n", server_port, n_threads);
+	serve_clients(&handlers[0]);
 
 	// not reached
-	close(server_socket);
 	return 0;
 }
 
@@ -137,12 +173,16 @@ void die_with_error(const char* message, const char* detail) {
 }
 
 
-void parse_arguments(int argc, char* argv[], int* port) {
+void parse_arguments(int argc, char* argv[], int* port, int* n_threads, int* max_connections,
+		int* n_workers, int* n_shard_levels, enum StorageMode* storage_mode, int* packed_kb,
+		int* commit_window_ms) {
 	static const char* USAGE_MESSAGE = 
-            "Usage:\n ./server [-p <port>]";
+            "Usage:\n ./server [-p <port>] [-t <threads>] [-c <max connections>] [-w <checksum workers>]"
+            " [-s <shard levels>] [-m <files|blobs|chunks>] [-k <max packed file KB>]"
+            " [-d <commit window ms>]";
     
     // there must be an odd number of arguments (program name and flag-value pairs)
-    if (argc % 2 == 0 || argc > 3) {
+    if (argc % 2 == 0 || argc > 17) {
         die_with_error(USAGE_MESSAGE, NULL);
     }
 
@@ -164,6 +204,53 @@ void parse_arguments(int argc, char* argv[], int* port) {
             case 'p':  // server port
                 *port = atoi(value);
                 break;
+            case 't':  // number of threads
+                *n_threads = atoi(value);
+                if (*n_threads <= 0) {
+                    die_with_error(USAGE_MESSAGE, "Number of threads must be positive");
+                }
+                break;
+            case 'c':  // max number of connections
+                *max_connections = atoi(value);
+                if (*max_connections <= 0) {
+                    die_with_error(USAGE_MESSAGE, "Max number of connections must be positive");
+                }
+                break;
+            case 'w':  // number of checksum workers
+                *n_workers = atoi(value);
+                if (*n_workers <= 0) {
+                    die_with_error(USAGE_MESSAGE, "Number of checksum workers must be positive");
+                }
+                break;
+            case 's':  // number of shard levels above user directories
+                *n_shard_levels = atoi(value);
+                if (*n_shard_levels < 0 || *n_shard_levels > 2) {
+                    die_with_error(USAGE_MESSAGE, "Number of shard levels must be between 0 and 2");
+                }
+                break;
+            case 'm':  // where the contents of files are stored
+                if (strcmp(value, "files") == 0) {
+                    *storage_mode = STORAGE_FILES;
+                } else if (strcmp(value, "blobs") == 0) {
+                    *storage_mode = STORAGE_BLOBS;
+                } else if (strcmp(value, "chunks") == 0) {
+                    *storage_mode = STORAGE_CHUNKS;
+                } else {
+                    die_with_error(USAGE_MESSAGE, "Storage mode must be files, blobs or chunks");
+                }
+                break;
+            case 'k':  // max size of the files packed in the user's log, in KB
+                *packed_kb = atoi(value);
+                if (*packed_kb < 0 || *packed_kb > 1024) {
+                    die_with_error(USAGE_MESSAGE, "Max packed file size must be between 0 and 1024 KB");
+                }
+                break;
+            case 'd':  // window of the group commit making uploads durable, in ms
+                *commit_window_ms = atoi(value);
+                if (*commit_window_ms < 0 || *commit_window_ms > MAX_COMMIT_WINDOW_MS) {
+                    die_with_error(USAGE_MESSAGE, "Commit window must be between 0 and 1000 ms");
+                }
+                break;
             default:   // unknown flag
                 die_with_error(USAGE_MESSAGE, "Unknown flag");
         }
@@ -171,15 +258,45 @@ void parse_arguments(int argc, char* argv[], int* port) {
 }
 
 
-int create_socket(int server_port) {
+void raise_descriptor_limit(int max_connections) {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+		return;
+	}
+	rlim_t needed = (rlim_t) max_connections + RESERVED_DESCRIPTORS;
+	if (limit.rlim_cur >= needed) {
+		return;
+	}
+	if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+		printf("Warning: descriptor limit %lu is too low for %d connections\n",
+				(unsigned long) limit.rlim_max, max_connections);
+		needed = limit.rlim_max;
+	}
+	limit.rlim_cur = needed;
+	setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+
+int create_socket(int server_port, bool reuse_port) {
 	int server_socket;
 	/*
 	 * Create the socket descriptor
 	 */
-	if ((server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+	if ((server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP)) < 0) {
 		die_with_error("Failed to initialize server", "socket() failed");
 	}
 
+	// allow restarting the server while old connections are in TIME_WAIT
+	int enable = 1;
+	if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0) {
+		die_with_error("Failed to initialize server", "setsockopt(SO_REUSEADDR) failed");
+	}
+
+	// let several sockets listen to the same port
+	if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+		die_with_error("Failed to initialize server", "setsockopt(SO_REUSEPORT) failed");
+	}
+
 	/*
 	 * Bind socket to local address
 	 */
@@ -198,9 +315,15 @@ int create_socket(int server_port) {
 	/*
 	 * Set to listen for multiple incomming connections
 	 */
-	if (listen(server_socket, MAX_CONNECTIONS) < 0) {
+	if (listen(server_socket, SOMAXCONN) < 0) {
 		die_with_error("Failed to initialize server", "listen() failed");
 	}
 
 	return server_socket;
 }
+
+
+void* serve_clients(void* handler) {
+	run_client_handler(handler);
+	return NULL;
+}
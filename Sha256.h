@@ -0,0 +1,49 @@
+/**
+ * SHA-256 (FIPS 180-4), computed incrementally as data arrives.
+ * Used to name file contents in the blob store, where two files share
+ * their storage only if their digests are equal.
+ */
+
+#ifndef SHA256_H_
+#define SHA256_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define SHA256_DIGEST_LEN 32
+
+
+/**
+ * The state of a digest being computed
+ */
+struct Sha256Context {
+	uint32_t state[8];
+	/** Number of bytes hashed so far */
+	uint64_t len;
+	/** Bytes of the current block not hashed yet */
+	unsigned char block[64];
+};
+
+
+/**
+ * Start a new digest
+ */
+void initialize_sha256(struct Sha256Context* context);
+
+
+/**
+ * Add data to a digest
+ */
+void update_sha256(struct Sha256Context* context, const void* data, size_t data_len);
+
+
+/**
+ * Finish a digest. The context must be initialized again to be reused.
+ * @param digest [out] The SHA256_DIGEST_LEN bytes of the digest
+ */
+void finish_sha256(struct Sha256Context* context, unsigned char* digest);
+
+
+#endif // SHA256_H_
@@ -1,28 +1,915 @@
 #include "StorageService.h"
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Catalog.h"
+#include "ChecksumIndex.h"
+#include "ChunkStore.h"
+#include "GroupCommit.h"
+#include "PackStore.h"
+#include "Sha256.h"
+#include "StringHash.h"
+#include "WorkerPool.h"
 
 
 #define DATABASE_DIR "serverdata"
 
+/** Root of the user directories, when they are sharded. Shards are named
+ *  by 2 hex digits, e.g. serverdata/shards/ab/cd/<user> */
+#define SHARDS_DIR_NAME "shards"
+#define SHARDS_DIR DATABASE_DIR "/" SHARDS_DIR_NAME
+
+/** Max number of shard levels above the user directories */
+#define MAX_SHARD_LEVELS 2
+
+/** Root of the blob store, holding the contents of files by their SHA-256
+ *  digest, e.g. serverdata/blobs/ab/ab12...ef */
+#define BLOBS_DIR_NAME "blobs"
+#define BLOBS_DIR DATABASE_DIR "/" BLOBS_DIR_NAME
+/** Length of the path to a blob, including null terminator */
+#define BLOB_PATH_LEN (sizeof(BLOBS_DIR) + 4 + 2 * SHA256_DIGEST_LEN)
+
+/** Directory where uploads are written when they are not written in
+ *  place, and where links are made before being moved to a user directory */
+#define STAGING_DIR_NAME "staging"
+#define STAGING_DIR DATABASE_DIR "/" STAGING_DIR_NAME
+/** Length of the path to a staged link, including null terminator */
+#define STAGING_PATH_LEN (sizeof(STAGING_DIR) + 48)
+/** Prefix of the names of the uploads written to a named file, when the
+ *  filesystem has no anonymous files. Followed by the inode number, so that
+ *  the file is found again from its descriptor */
+#define NAMED_UPLOAD_PREFIX STAGED_NAME_PREFIX "upload."
+
+/** Name of the extended attribute holding the digest of a blob */
+#define DIGEST_ATTRIBUTE_NAME "user.gmm.sha256"
+
+/** Number of tries at linking an upload to its blob, when the blob keeps
+ *  being removed meanwhile */
+#define MAX_PUBLISH_TRIES 8
+
+/** Files are hashed in ranges of this size, in parallel, so that a single
+ *  large file is hashed by several workers */
+#define CHECKSUM_RANGE_SIZE (32 * 1024 * 1024)
+
+
+struct PendingChecksum;
+
+
+/**
+ * The checksum of a range of a file, computed by a checksum worker
+ */
+struct ChecksumJob {
+	struct WorkerJob job;
+	/** The file the range belongs to */
+	struct PendingChecksum* file;
+	off_t offset;
+	/** Length of the range, then number of bytes actually hashed */
+	uint64_t len;
+	uint32_t checksum;
+	/** Whether the file could not be read */
+	bool is_failed;
+};
+
+
+/**
+ * A file that is not in the index, being hashed
+ */
+struct PendingChecksum {
+	/** Directory of the file to hash */
+	int dir_fd;
+	char name[MAX_FILE_NAME_LEN];
+	/** Stat data of the file before it is hashed */
+	struct stat file_stat;
+	/** The checksum, once the ranges are merged */
+	uint32_t checksum;
+	/** Jobs hashing the ranges of the file, in order */
+	struct ChecksumJob* ranges;
+	int n_ranges;
+	struct PendingChecksum* next;
+};
+
+
+/** Threads hashing files for list_files, shared by all listings. They
+ *  also make the listings that must scan a user directory, for the event
+ *  loops, which can't wait for the hashing */
+static struct WorkerPool checksum_pool;
+static pthread_once_t checksum_pool_once = PTHREAD_ONCE_INIT;
+/** Number of threads of the pool, or 0 for one per CPU */
+static int n_checksum_workers = 0;
+
+/** Number of shard levels above the user directories. With 0 levels, the
+ *  user directories are all in DATABASE_DIR (the flat layout) */
+static int n_shard_levels = MAX_SHARD_LEVELS;
+
+/** Where the contents of uploaded files are stored */
+static enum StorageMode storage_mode = STORAGE_FILES;
+
+/** Uploads up to this size are appended to the user's pack. 0 if none is */
+static size_t max_packed_file_size = 0;
+
+/** Window of the group commit, or -1 if uploads are not synced */
+static int commit_window_ms = -1;
+/** Whether the group commit is started */
+static bool is_commit_started = false;
+
+/** Whether the directories of the server are usable, which they aren't if
+ *  users of the flat layout are in the way */
+static bool is_storage_ready = false;
+
 
 /*
  * Helper functions
  */
 
+
+/**
+ * Start the checksum workers
+ */
+void initialize_checksum_pool() {
+	int n_threads = n_checksum_workers;
+	if (n_threads <= 0) {
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (create_worker_pool(&checksum_pool, n_threads) < 0) {
+		// the listing threads hash the files themselves
+		create_worker_pool(&checksum_pool, 0);
+	}
+}
+
+
+/**
+ * Job function: hash one range of a file
+ */
+void run_checksum_job(struct WorkerJob* job) {
+	struct ChecksumJob* checksum_job = (struct ChecksumJob*) job;
+	struct PendingChecksum* file = checksum_job->file;
+	int file_fd = openat(file->dir_fd, file->name, O_RDONLY | O_CLOEXEC);
+	if (file_fd < 0) {
+		checksum_job->is_failed = true;
+		return;
+	}
+	if (crc32_file_range(file_fd, checksum_job->offset, &checksum_job->len,
+			&checksum_job->checksum) < 0) {
+		checksum_job->is_failed = true;
+	}
+	close(file_fd);
+}
+
+
+/**
+ * Split a file into ranges, and queue a job hashing each range
+ * @return 0 if success, -1 if out of memory
+ */
+int submit_checksum_jobs(struct PendingChecksum* file, struct WorkerBatch* batch) {
+	uint64_t file_size = file->file_stat.st_size;
+	file->n_ranges = file_size / CHECKSUM_RANGE_SIZE + (file_size % CHECKSUM_RANGE_SIZE != 0);
+	if (file->n_ranges == 0) {
+		// an empty file still needs its checksum
+		file->n_ranges = 1;
+	}
+	file->ranges = malloc(file->n_ranges * sizeof(struct ChecksumJob));
+	if (file->ranges == NULL) {
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < file->n_ranges; i++) {
+		struct ChecksumJob* range = &file->ranges[i];
+		range->file = file;
+		range->offset = (off_t)i * CHECKSUM_RANGE_SIZE;
+		range->len = file_size - range->offset < CHECKSUM_RANGE_SIZE ?
+				file_size - range->offset : CHECKSUM_RANGE_SIZE;
+		range->is_failed = false;
+		submit_job(&checksum_pool, batch, &range->job, run_checksum_job);
+	}
+	return 0;
+}
+
+
+/**
+ * @return true if a directory entry may be a regular file (directly or
+ *         through a symbolic link), from its type when the file system
+ *         gives it, so that other entries are skipped without a stat
+ */
+bool may_be_regular_file(const struct dirent* entry) {
+	return entry->d_type == DT_REG || entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN;
+}
+
+
+/**
+ * @return true if a directory of DATABASE_DIR belongs to the server
+ *         rather than to a user of the flat layout
+ */
+bool is_reserved_directory(const char* name) {
+	return strcmp(name, SHARDS_DIR_NAME) == 0 || strcmp(name, BLOBS_DIR_NAME) == 0
+			|| strcmp(name, CHUNKS_DIR_NAME) == 0 || strcmp(name, STAGING_DIR_NAME) == 0;
+}
+
+
+/**
+ * Create the shard directories above a user directory, if missing
+ * @param user_dir_path Path to the user directory
+ */
+void create_shard_directories(const char* user_dir_path) {
+	char* path = strdup(user_dir_path);
+	if (path == NULL) {
+		return;
+	}
+	mkdir(SHARDS_DIR, 0777);
+	// the shards follow the root, 3 characters per level ("/ab")
+	char* shard_end = path + strlen(SHARDS_DIR);
+	int i;
+	for (i = 0; i < n_shard_levels; i++) {
+		shard_end += 3;
+		*shard_end = 0;
+		mkdir(path, 0777);
+		*shard_end = '/';
+	}
+	free(path);
+}
+
+
+/**
+ * Move the directory of a user from the flat layout to its shard, if the
+ * user still has one there. Renaming is atomic, so concurrent moves of the
+ * same user are safe: one of them wins, the others find nothing to move.
+ * @param user_dir_path Path to the user directory in its shard
+ * @return 0 if the directory was moved, -1 if not
+ */
+int move_flat_user_directory(const char* username, const char* user_dir_path) {
+	if (n_shard_levels == 0 || is_reserved_directory(username)) {
+		return -1;
+	}
+	char* flat_path = join_path(DATABASE_DIR, username);
+	// only directories are user directories (not the password file)
+	struct stat flat_stat;
+	int result = -1;
+	if (lstat(flat_path, &flat_stat) == 0 && S_ISDIR(flat_stat.st_mode)) {
+		result = rename(flat_path, user_dir_path);
+		if (result < 0 && errno == ENOENT) {
+			create_shard_directories(user_dir_path);
+			result = rename(flat_path, user_dir_path);
+		}
+	}
+	free(flat_path);
+	return result;
+}
+
+
+/**
+ * Write the path of the blob with the given digest, e.g.
+ * serverdata/blobs/ab/ab12...ef
+ * @param path [out] Buffer of BLOB_PATH_LEN bytes
+ */
+void format_blob_path(const unsigned char* digest, char* path) {
+	char* cursor = path + sprintf(path, "%s/%02x/", BLOBS_DIR, digest[0]);
+	int i;
+	for (i = 0; i < SHA256_DIGEST_LEN; i++) {
+		cursor += sprintf(cursor, "%02x", digest[i]);
+	}
+}
+
+
+/**
+ * Write a new unique name for a staged link
+ * @param path [out] Buffer of STAGING_PATH_LEN bytes
+ */
+void format_staging_path(char* path) {
+	static unsigned int n_staged_links = 0;
+	unsigned int id = __atomic_fetch_add(&n_staged_links, 1, __ATOMIC_RELAXED);
+	sprintf(path, "%s/" STAGED_NAME_PREFIX "%u", STAGING_DIR, id);
+}
+
+
+/**
+ * Write the path of the named file of an upload
+ * @param path [out] Buffer of STAGING_PATH_LEN bytes
+ */
+void format_named_upload_path(ino_t inode, char* path) {
+	sprintf(path, "%s/" NAMED_UPLOAD_PREFIX "%llu", STAGING_DIR, (unsigned long long)inode);
+}
+
+
+/**
+ * Create the file of an upload under a name of the staging directory, for
+ * filesystems that can't make it anonymous
+ * @return Descriptor of the file, or -1 if error
+ */
+int create_named_upload_file() {
+	char path[STAGING_PATH_LEN];
+	format_staging_path(path);
+	int file_fd = open(path, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0666);
+	if (file_fd < 0) {
+		return -1;
+	}
+	// renamed after its inode, which is known from the descriptor
+	char named_path[STAGING_PATH_LEN];
+	struct stat file_stat;
+	if (fstat(file_fd, &file_stat) < 0) {
+		unlink(path);
+		close(file_fd);
+		return -1;
+	}
+	format_named_upload_path(file_stat.st_ino, named_path);
+	if (rename(path, named_path) < 0) {
+		unlink(path);
+		close(file_fd);
+		return -1;
+	}
+	return file_fd;
+}
+
+
+/**
+ * Write the path an upload file can be linked or renamed from: its name in
+ * the staging directory if it has one, else its /proc/self/fd link. Must
+ * be called before the file is linked anywhere
+ * @param path [out] Buffer of STAGING_PATH_LEN bytes
+ * @return true if the file is named
+ */
+bool format_upload_path(int file_fd, char* path) {
+	struct stat file_stat;
+	if (fstat(file_fd, &file_stat) == 0 && file_stat.st_nlink > 0) {
+		format_named_upload_path(file_stat.st_ino, path);
+		return true;
+	}
+	sprintf(path, "/proc/self/fd/%d", file_fd);
+	return false;
+}
+
+
+/**
+ * Replace a file of a user directory atomically, with a new link to the
+ * given file. The link is made under a staging name, then renamed over
+ * the user's file
+ * @param source_path Path to the file to link, which may be a
+ *                    /proc/self/fd link to an anonymous file
+ * @return 0 if success, -1 if error (errno is ENOENT if the source is gone)
+ */
+int replace_user_file(int user_dir_fd, const char* file_name, const char* source_path) {
+	char staging_path[STAGING_PATH_LEN];
+	format_staging_path(staging_path);
+	if (linkat(AT_FDCWD, source_path, AT_FDCWD, staging_path, AT_SYMLINK_FOLLOW) < 0) {
+		return -1;
+	}
+	int result = renameat(AT_FDCWD, staging_path, user_dir_fd, file_name);
+	// renaming over another link to the same file does nothing
+	unlink(staging_path);
+	return result;
+}
+
+
+/**
+ * @return true if a name is one the server gives in the staging directory
+ */
+bool is_staged_file_name(const char* name) {
+	return strncmp(name, STAGED_NAME_PREFIX, strlen(STAGED_NAME_PREFIX)) == 0;
+}
+
+
+/**
+ * Delete the links previous runs of the server left in the staging
+ * directory, and only them
+ */
+void clear_staging_directory() {
+	DIR* dir = opendir(STAGING_DIR);
+	if (dir == NULL) {
+		return;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (is_staged_file_name(entry->d_name)) {
+			unlinkat(dirfd(dir), entry->d_name, 0);
+		}
+	}
+	closedir(dir);
+}
+
+
+/**
+ * Give a name in the blob store to an uploaded file, which becomes the
+ * blob of its content
+ * @param upload_path Path given by format_upload_path
+ * @return 0 if success, -1 if error (errno is EEXIST if the blob already
+ *         exists)
+ */
+int link_upload_as_blob(int file_fd, const char* upload_path, const unsigned char* digest,
+		const char* blob_path) {
+	// the digest lets the blob be found from any of its links
+	fsetxattr(file_fd, DIGEST_ATTRIBUTE_NAME, digest, SHA256_DIGEST_LEN, 0);
+	int result = linkat(AT_FDCWD, upload_path, AT_FDCWD, blob_path, AT_SYMLINK_FOLLOW);
+	if (result < 0 && errno == ENOENT) {
+		// first blob of its directory
+		char blob_dir_path[BLOB_PATH_LEN];
+		memcpy(blob_dir_path, blob_path, sizeof(BLOBS_DIR) + 2);
+		blob_dir_path[sizeof(BLOBS_DIR) + 2] = 0;
+		mkdir(blob_dir_path, 0777);
+		result = linkat(AT_FDCWD, upload_path, AT_FDCWD, blob_path, AT_SYMLINK_FOLLOW);
+	}
+	return result;
+}
+
+
+/**
+ * Remove a blob from the store if the file it was linked as is gone, and
+ * nothing else links to it
+ * @param file_fd Descriptor of the file that was replaced
+ */
+void release_replaced_blob(int file_fd) {
+	struct stat file_stat;
+	unsigned char digest[SHA256_DIGEST_LEN];
+	if (fstat(file_fd, &file_stat) < 0 || file_stat.st_nlink != 1
+			|| fgetxattr(file_fd, DIGEST_ATTRIBUTE_NAME, digest, SHA256_DIGEST_LEN) != SHA256_DIGEST_LEN) {
+		// not a blob, or still linked from a user directory
+		return;
+	}
+	// the last link may be the store's. If an upload links the blob again
+	// meanwhile, it keeps the content, only the blob store forgets it
+	char blob_path[BLOB_PATH_LEN];
+	format_blob_path(digest, blob_path);
+	struct stat blob_stat;
+	if (stat(blob_path, &blob_stat) == 0 && blob_stat.st_ino == file_stat.st_ino
+			&& blob_stat.st_dev == file_stat.st_dev) {
+		unlink(blob_path);
+	}
+}
+
+
+/**
+ * Thread routine: remove the blobs no user file links to anymore
+ */
+void* collect_unused_blobs(void* unused) {
+	int n_removed = 0;
+	// blobs linked since are in use, even if their file isn't linked yet
+	time_t start_time = time(NULL);
+
+	DIR* dir = opendir(BLOBS_DIR);
+	if (dir == NULL) {
+		return NULL;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		int sub_dir_fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (sub_dir_fd < 0) {
+			continue;
+		}
+		DIR* sub_dir = fdopendir(sub_dir_fd);
+		if (sub_dir == NULL) {
+			close(sub_dir_fd);
+			continue;
+		}
+		struct dirent* blob_entry;
+		while ((blob_entry = readdir(sub_dir)) != NULL) {
+			struct stat blob_stat;
+			if (blob_entry->d_name[0] == '.'
+					|| fstatat(sub_dir_fd, blob_entry->d_name, &blob_stat, AT_SYMLINK_NOFOLLOW) < 0) {
+				continue;
+			}
+			if (blob_stat.st_nlink == 1 && blob_stat.st_ctime < start_time) {
+				unlinkat(sub_dir_fd, blob_entry->d_name, 0);
+				n_removed++;
+			}
+		}
+		closedir(sub_dir);
+	}
+	closedir(dir);
+	if (n_removed > 0) {
+		printf("Removed %d unused blobs\n", n_removed);
+	}
+	return NULL;
+}
+
+
+/**
+ * Add the chunks listed by the files found in a directory and its
+ * subdirectories to a list
+ * @param depth Number of directory levels to descend below this one
+ * @param is_root Whether the directory is DATABASE_DIR, whose store
+ *                directories are skipped
+ * @return 0 if success, -1 if a chunk list can't be read, in which case
+ *         its chunks can't be told apart from unused ones
+ */
+int add_tree_chunks(struct ChunkList* used, int dir_fd, int depth, bool is_root) {
+	int entries_fd = dup(dir_fd);
+	DIR* dir = entries_fd >= 0 ? fdopendir(entries_fd) : NULL;
+	if (dir == NULL) {
+		if (entries_fd >= 0) {
+			close(entries_fd);
+		}
+		return -1;
+	}
+	int result = 0;
+	struct dirent* entry;
+	while (result == 0 && (entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' || (is_root && is_reserved_directory(entry->d_name)
+				&& strcmp(entry->d_name, SHARDS_DIR_NAME) != 0)) {
+			continue;
+		}
+		int fd = openat(dir_fd, entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		struct stat file_stat;
+		if (fd < 0 || fstat(fd, &file_stat) < 0) {
+			if (fd >= 0) {
+				close(fd);
+			}
+			continue;
+		}
+		if (S_ISDIR(file_stat.st_mode)) {
+			if (depth > 0) {
+				result = add_tree_chunks(used, fd, depth - 1, false);
+			}
+		} else if (S_ISREG(file_stat.st_mode) && is_chunk_list(fd)) {
+			result = add_listed_chunks(used, fd);
+			if (result < 0) {
+				printf("ERROR: Invalid chunk list %s\n", entry->d_name);
+			}
+		}
+		close(fd);
+	}
+	closedir(dir);
+	return result;
+}
+
+
+/**
+ * Remove the chunks no chunk list refers to anymore. Every user directory
+ * is read, so it must not run with the migration to shards, nor while
+ * files are uploaded
+ */
+void collect_unused_chunks() {
+	struct ChunkList used;
+	initialize_chunk_list(&used);
+	int dir_fd = open(DATABASE_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		return;
+	}
+	// the deepest files are in <shards dir>/ab/cd/<username>
+	if (add_tree_chunks(&used, dir_fd, MAX_SHARD_LEVELS + 2, true) == 0) {
+		int n_removed = remove_unlisted_chunks(&used);
+		if (n_removed > 0) {
+			printf("Removed %d unused chunks\n", n_removed);
+		}
+	}
+	close(dir_fd);
+	free_chunk_list(&used);
+}
+
+
+/**
+ * Thread routine: move the user directories left in the flat layout to
+ * their shards, while the server is running. Users that log on in the
+ * meantime are moved by create_user_directory
+ */
+void* migrate_flat_layout(void* unused) {
+	DIR* dir = opendir(DATABASE_DIR);
+	if (dir == NULL) {
+		return NULL;
+	}
+	int n_moved = 0;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' || (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)) {
+			continue;
+		}
+		char* user_dir_path = path_to_user(entry->d_name);
+		if (move_flat_user_directory(entry->d_name, user_dir_path) == 0) {
+			n_moved++;
+		}
+		free(user_dir_path);
+	}
+	closedir(dir);
+	if (n_moved > 0) {
+		printf("Moved %d user directories to their shards\n", n_moved);
+	}
+	return NULL;
+}
+
+
+/**
+ * @return true if an entry of a directory of the server was left there by
+ *         a user of the flat layout with the same name: the server only
+ *         puts directories there, and its links in the staging directory
+ */
+bool is_flat_user_entry(int dir_fd, const struct dirent* entry) {
+	if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0
+			|| is_staged_file_name(entry->d_name)) {
+		return false;
+	}
+	if (entry->d_type != DT_UNKNOWN) {
+		return entry->d_type != DT_DIR;
+	}
+	struct stat file_stat;
+	return fstatat(dir_fd, entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) == 0
+			&& !S_ISDIR(file_stat.st_mode);
+}
+
+
+/**
+ * Move the files a user of the flat layout left in a directory of the
+ * server, having its name, to the user's shard. The server's own entries
+ * stay, as the directory may already be used by the server.
+ * @return 0 if success, -1 if the directory holds files of such a user
+ *         which can't be moved, because the layout is flat
+ */
+int move_colliding_user_files(const char* name) {
+	char* dir_path = join_path(DATABASE_DIR, name);
+	DIR* dir = opendir(dir_path);
+	free(dir_path);
+	if (dir == NULL) {
+		return 0;
+	}
+	int user_dir_fd = -1;
+	int n_moved = 0;
+	int result = 0;
+	struct dirent* entry;
+	while (result == 0 && (entry = readdir(dir)) != NULL) {
+		if (!is_flat_user_entry(dirfd(dir), entry)) {
+			continue;
+		}
+		if (n_shard_levels == 0) {
+			printf("ERROR: %s/%s holds the files of user %s, but is a directory of the server.\n"
+					"       Start the server with shard levels (-s) to move them\n",
+					DATABASE_DIR, name, name);
+			result = -1;
+			break;
+		}
+		if (user_dir_fd < 0) {
+			char* user_dir_path = path_to_user(name);
+			create_shard_directories(user_dir_path);
+			mkdir(user_dir_path, 0777);
+			free(user_dir_path);
+			user_dir_fd = open_user_directory(name);
+			if (user_dir_fd < 0) {
+				result = -1;
+				break;
+			}
+		}
+		// one at a time, so that what a crash leaves is moved next time
+		if (renameat(dirfd(dir), entry->d_name, user_dir_fd, entry->d_name) == 0) {
+			n_moved++;
+		}
+	}
+	if (n_moved > 0) {
+		printf("Moved %d files of user %s to its shard\n", n_moved, name);
+	}
+	if (user_dir_fd >= 0) {
+		close(user_dir_fd);
+	}
+	closedir(dir);
+	return result;
+}
+
+
+/**
+ * Move the users of the flat layout named like a directory of the server
+ * out of the way, before the server's trees are made
+ * @return 0 if success, -1 if one can't be moved
+ */
+int move_colliding_users() {
+	const char* names[] = {SHARDS_DIR_NAME, BLOBS_DIR_NAME, CHUNKS_DIR_NAME, STAGING_DIR_NAME};
+	int result = 0;
+	size_t i;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (move_colliding_user_files(names[i]) < 0) {
+			result = -1;
+		}
+	}
+	return result;
+}
+
+
+/**
+ * Merge the checksums of the ranges of a hashed file into its checksum
+ * @return 0 if success, -1 if the file could not be read
+ */
+int merge_range_checksums(struct PendingChecksum* file) {
+	uint32_t checksum = 0;
+	int i;
+	for (i = 0; i < file->n_ranges; i++) {
+		if (file->ranges[i].is_failed) {
+			return -1;
+		}
+		checksum = crc32_combine_checksums(checksum, file->ranges[i].checksum, file->ranges[i].len);
+	}
+	file->checksum = checksum;
+	return 0;
+}
+
+
+/**
+ * Describe a file of a user as it is stored now: from the user directory,
+ * or from the user's pack if the directory has no such file
+ * @param entry [in, out] Entry with the name of the file, which is filled.
+ *              If the file doesn't exist, it is marked removed
+ * @param is_checksum_known Whether the checksum of the entry is set already
+ * @return 0 if success, -1 if the file doesn't exist or can't be read
+ */
+int describe_user_file(const char* username, int user_dir_fd, struct CatalogEntry* entry,
+		bool is_checksum_known) {
+	entry->is_packed = false;
+	entry->is_removed = false;
+	int file_fd = openat(user_dir_fd, entry->name, O_RDONLY | O_CLOEXEC);
+	if (file_fd < 0) {
+		if (errno == ENOENT && find_packed_file(username, user_dir_fd, entry->name,
+				&entry->size, &entry->checksum) == 0) {
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			entry->mtime_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+			entry->is_packed = true;
+			return 0;
+		}
+		entry->is_removed = true;
+		return -1;
+	}
+
+	struct stat file_stat;
+	int result = fstat(file_fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) ? 0 : -1;
+	if (result == 0) {
+		entry->size = file_stat.st_size;
+		entry->mtime_ns = (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+		// the size and checksum of a chunked file are in its chunk list
+		struct ChunkList chunks;
+		initialize_chunk_list(&chunks);
+		if (is_chunk_list(file_fd)) {
+			result = read_chunk_list(file_fd, &chunks);
+			entry->size = chunks.file_size;
+			entry->checksum = chunks.checksum;
+			free_chunk_list(&chunks);
+		} else if (!is_checksum_known
+				&& read_attached_checksum(user_dir_fd, entry->name, &file_stat, &entry->checksum) < 0) {
+			uint64_t len = file_stat.st_size;
+			result = crc32_file_range(file_fd, 0, &len, &entry->checksum);
+		}
+	}
+	close(file_fd);
+	if (result < 0) {
+		entry->is_removed = true;
+	}
+	return result;
+}
+
+
+/**
+ * Bring the catalog of a user up to date with the user directory and pack:
+ * set the files that are new or changed, remove those that are gone, then
+ * save the catalog if it never was. The catalog lock must be held.
+ * @return 0 if success, -1 if the directory could not be listed
+ */
+int rescan_user_catalog(struct Catalog* catalog, const char* username, int user_dir_fd) {
+	// the checksums are found as a listing would, hashing only what the
+	// checksum index doesn't know
+	struct FileTable files;
+	struct FileTable known_files;
+	initialize_file_table(&files);
+	initialize_file_table(&known_files);
+	int result = list_directory_files(user_dir_fd, &files) < 0
+			|| add_packed_files(username, user_dir_fd, &files) < 0
+			|| list_catalog_files(catalog, &known_files) < 0 ? -1 : 0;
+	sort_files_by_name(&files);
+	sort_files_by_name(&known_files);
+
+	// merge the two lists: a file only listed now is new, a file only in
+	// the catalog is gone, and a file in both may have changed
+	int n_changed = 0;
+	int i = 0;
+	int j = 0;
+	while (result == 0 && (i < files.n_files || j < known_files.n_files)) {
+		const char* name = i < files.n_files ? get_file_name(&files, &files.files[i]) : NULL;
+		const char* known_name = j < known_files.n_files
+				? get_file_name(&known_files, &known_files.files[j]) : NULL;
+		int order = name == NULL ? 1 : known_name == NULL ? -1 : strcmp(name, known_name);
+		struct CatalogEntry entry;
+		memset(&entry, 0, sizeof(entry));
+		if (order > 0) {
+			strncpy(entry.name, known_name, MAX_FILE_NAME_LEN - 1);
+			entry.is_removed = true;
+			result = put_catalog_entry(catalog, &entry);
+			n_changed++;
+		} else if (order < 0 || files.files[i].checksum != known_files.files[j].checksum) {
+			strncpy(entry.name, name, MAX_FILE_NAME_LEN - 1);
+			entry.checksum = files.files[i].checksum;
+			describe_user_file(username, user_dir_fd, &entry, true);
+			result = put_catalog_entry(catalog, &entry);
+			n_changed++;
+		}
+		i += order <= 0;
+		j += order >= 0;
+	}
+	free_file_table(&files);
+	free_file_table(&known_files);
+	if (result < 0) {
+		return -1;
+	}
+	if (!is_catalog_saved(catalog)) {
+		printf("Catalog: indexed %d files of %s\n", n_changed, username);
+		// if it can't be saved, the catalog is filled again next time
+		if (save_catalog(catalog) < 0) {
+			return 0;
+		}
+	} else if (n_changed > 0) {
+		printf("Catalog: %d files of %s changed outside the server\n", n_changed, username);
+	}
+	mark_catalog_current(catalog);
+	return 0;
+}
+
+
+/**
+ * Look again at the files whose update was cut short by a crash, and
+ * record them as they are. The catalog lock must be held.
+ * @return 0 if success, -1 if error
+ */
+int settle_user_catalog(struct Catalog* catalog, const char* username, int user_dir_fd) {
+	struct FileTable names;
+	initialize_file_table(&names);
+	int result = list_unsettled_files(catalog, &names);
+	int i;
+	for (i = 0; i < names.n_files && result == 0; i++) {
+		struct CatalogEntry entry;
+		memset(&entry, 0, sizeof(entry));
+		strncpy(entry.name, get_file_name(&names, &names.files[i]), MAX_FILE_NAME_LEN - 1);
+		describe_user_file(username, user_dir_fd, &entry, false);
+		result = put_catalog_entry(catalog, &entry);
+	}
+	free_file_table(&names);
+	return result;
+}
+
+
+/**
+ * Lock the catalog of a user, settled, but maybe not up to date with the
+ * directory
+ * @return The locked catalog, or NULL if error
+ */
+struct Catalog* lock_settled_catalog(const char* username, int user_dir_fd) {
+	struct Catalog* catalog = lock_catalog(username, user_dir_fd);
+	if (catalog == NULL) {
+		return NULL;
+	}
+	if (settle_user_catalog(catalog, username, user_dir_fd) < 0) {
+		unlock_catalog(catalog);
+		return NULL;
+	}
+	return catalog;
+}
+
+
 /**
- * Check if the path refers to a regular file (as opposed to a directory/sym link/etc.)
+ * Lock the catalog of a user, settled and up to date with the directory
+ * @return The locked catalog, or NULL if error
  */
-bool is_regular_file(const char *path)
-{
-    struct stat path_stat;
-    stat(path, &path_stat);
-    return S_ISREG(path_stat.st_mode);
+struct Catalog* lock_user_catalog(const char* username, int user_dir_fd) {
+	struct Catalog* catalog = lock_settled_catalog(username, user_dir_fd);
+	if (catalog != NULL && !is_catalog_current(catalog)
+			&& rescan_user_catalog(catalog, username, user_dir_fd) < 0) {
+		unlock_catalog(catalog);
+		return NULL;
+	}
+	return catalog;
+}
+
+
+/**
+ * Store the catalog of a user whose directory was just created, so that
+ * the first listing needn't scan it. If that fails, the first listing does.
+ */
+void create_empty_catalog(const char* username) {
+	int user_dir_fd = open_user_directory(username);
+	if (user_dir_fd < 0) {
+		return;
+	}
+	struct Catalog* catalog = lock_catalog(username, user_dir_fd);
+	if (catalog != NULL) {
+		if (!is_catalog_saved(catalog) && save_catalog(catalog) == 0) {
+			mark_catalog_current(catalog);
+		}
+		unlock_catalog(catalog);
+	}
+	close(user_dir_fd);
+}
+
+
+/**
+ * Job function: list the files of a user, scanning the user directory if
+ * needed
+ */
+void run_listing_job(struct WorkerJob* job) {
+	struct ListingRequest* request = (struct ListingRequest*) job;
+	request->result = list_user_files(request->username, request->user_dir_fd, &request->files);
 }
 
 
@@ -31,98 +918,464 @@ bool is_regular_file(const char *path)
  */
 
 
+void set_checksum_workers(int n_workers) {
+	n_checksum_workers = n_workers;
+}
+
+
+void set_user_directory_levels(int n_levels) {
+	n_shard_levels = n_levels < MAX_SHARD_LEVELS ? n_levels : MAX_SHARD_LEVELS;
+}
+
+
+void set_storage_mode(enum StorageMode mode) {
+	storage_mode = mode;
+}
+
+
+void set_packed_file_size(size_t max_size) {
+	max_packed_file_size = max_size;
+}
+
+
+void set_commit_window(int window_ms) {
+	commit_window_ms = window_ms;
+}
+
+
 void initialize_storage_service() {
 	// simply create the folder to store user files
 	mkdir(DATABASE_DIR, 0777);
+	if (move_colliding_users() < 0) {
+		return;
+	}
+	is_storage_ready = true;
+	mkdir(STAGING_DIR, 0777);
+	clear_staging_directory();
+	if (commit_window_ms >= 0) {
+		is_commit_started = start_group_commit(DATABASE_DIR, commit_window_ms) == 0;
+	}
+	if (storage_mode == STORAGE_BLOBS) {
+		mkdir(BLOBS_DIR, 0777);
+		// blobs left unused while the server was stopped are removed
+		// in the background
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, collect_unused_blobs, NULL) == 0) {
+			pthread_detach(thread);
+		}
+	}
+	if (storage_mode == STORAGE_CHUNKS) {
+		initialize_chunk_store();
+		// before any upload, and before users are moved
+		collect_unused_chunks();
+	}
+	if (n_shard_levels > 0) {
+		mkdir(SHARDS_DIR, 0777);
+		// users of the flat layout are moved in the background
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, migrate_flat_layout, NULL) == 0) {
+			pthread_detach(thread);
+		}
+	}
+}
+
+
+bool is_storage_initialized() {
+	return is_storage_ready;
+}
+
+
+bool is_durable_storage() {
+	return is_commit_started;
+}
+
+
+bool is_blob_storage() {
+	return storage_mode == STORAGE_BLOBS;
+}
+
+
+bool is_chunk_storage() {
+	return storage_mode == STORAGE_CHUNKS;
+}
+
+
+bool should_pack_file(uint64_t file_size) {
+	return file_size <= max_packed_file_size && max_packed_file_size > 0;
+}
+
+
+bool is_reserved_file_name(const char* file_name) {
+	return is_checksum_index_file(file_name) || is_pack_file(file_name) || is_catalog_file(file_name)
+			|| is_staged_file_name(file_name);
+}
+
+
+int create_upload_file(uint64_t file_size) {
+	// anonymous until it is committed, so an interrupted upload leaves
+	// nothing behind, and nobody reads a half-written file
+	int file_fd = open(STAGING_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+	if (file_fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+		// the filesystem (or kernel) has no anonymous files
+		file_fd = create_named_upload_file();
+	}
+	if (file_fd < 0 || storage_mode == STORAGE_CHUNKS || file_size == 0) {
+		// a chunked upload only writes its chunk list to the file
+		return file_fd;
+	}
+	// allocated at once, so the file is contiguous however slowly it
+	// arrives, and an upload that can't fit fails before it is received
+	if (fallocate(file_fd, 0, 0, file_size) < 0 && errno != EOPNOTSUPP) {
+		close(file_fd);
+		return -1;
+	}
+	return file_fd;
+}
+
+
+int commit_upload_file(int user_dir_fd, const char* file_name, int file_fd,
+		const unsigned char* digest) {
+	// the replaced file, whose blob may not be needed anymore
+	int old_fd = openat(user_dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+
+	char upload_path[STAGING_PATH_LEN];
+	bool is_named = format_upload_path(file_fd, upload_path);
+	int result = -1;
+	if (storage_mode != STORAGE_BLOBS) {
+		// the upload is the file (or its chunk list). A named file is
+		// simply moved
+		result = is_named ? renameat(AT_FDCWD, upload_path, user_dir_fd, file_name)
+				: replace_user_file(user_dir_fd, file_name, upload_path);
+	} else {
+		char blob_path[BLOB_PATH_LEN];
+		format_blob_path(digest, blob_path);
+		int i;
+		for (i = 0; i < MAX_PUBLISH_TRIES; i++) {
+			// the upload becomes the blob, unless the content is stored already
+			if (link_upload_as_blob(file_fd, upload_path, digest, blob_path) < 0 && errno != EEXIST) {
+				break;
+			}
+			result = replace_user_file(user_dir_fd, file_name, blob_path);
+			if (result == 0 || errno != ENOENT) {
+				break;
+			}
+			// the blob was removed since, publish it again
+		}
+	}
+
+	if (old_fd >= 0) {
+		if (result == 0) {
+			release_replaced_blob(old_fd);
+		}
+		close(old_fd);
+	}
+	return result;
+}
+
+
+void close_upload_file(int file_fd) {
+	// a named file, not moved by its commit, goes too
+	char upload_path[STAGING_PATH_LEN];
+	if (format_upload_path(file_fd, upload_path)) {
+		unlink(upload_path);
+	}
+	close(file_fd);
+}
+
+
+int remove_user_file(int user_dir_fd, const char* file_name) {
+	int file_fd = openat(user_dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+	if (file_fd < 0) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	int result = unlinkat(user_dir_fd, file_name, 0);
+	if (result == 0) {
+		release_replaced_blob(file_fd);
+	}
+	close(file_fd);
+	return result;
+}
+
+
+bool is_reserved_user_name(const char* username) {
+	return is_reserved_directory(username);
 }
 
 
 int create_user_directory(const char* username) {
+	if (n_shard_levels == 0 && is_reserved_directory(username)) {
+		// would be one of the server's directories
+		errno = EACCES;
+		return -1;
+	}
 	char* user_dir_path = path_to_user(username);
+	// a user of the flat layout keeps its files
+	if (move_flat_user_directory(username, user_dir_path) == 0) {
+		free(user_dir_path);
+		return 0;
+	}
 	printf("Create directory %s\n", user_dir_path);
 	int success = mkdir(user_dir_path, 0777);
+	if (success < 0 && errno == ENOENT) {
+		// first user of the shard
+		create_shard_directories(user_dir_path);
+		success = mkdir(user_dir_path, 0777);
+	}
 	free(user_dir_path);
+	if (success == 0) {
+		create_empty_catalog(username);
+	}
 	return success;
 }
 
 
-struct FileInfo* list_user_files(const char* username, int* n_files) {
-	/*
-	 * Construct path to user's directory
-	 */
-	char* dir_path = path_to_user(username);
+int open_user_directory(const char* username) {
+	if (n_shard_levels == 0 && is_reserved_directory(username)) {
+		errno = EACCES;
+		return -1;
+	}
+	char* user_dir_path = path_to_user(username);
+	int dir_fd = open(user_dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(user_dir_path);
+	return dir_fd;
+}
 
-	/*
-	 * Get a list of all user files
-	 */
-	struct FileInfo* file_list = list_files(dir_path, n_files);
 
-	free(dir_path);
-	return file_list;
+int list_user_files(const char* username, int user_dir_fd, struct FileTable* files) {
+	struct Catalog* catalog = lock_user_catalog(username, user_dir_fd);
+	if (catalog == NULL) {
+		return -1;
+	}
+	int result = list_catalog_files(catalog, files);
+	unlock_catalog(catalog);
+	return result;
 }
 
 
+int list_known_user_files(const char* username, int user_dir_fd, struct FileTable* files) {
+	struct Catalog* catalog = lock_settled_catalog(username, user_dir_fd);
+	if (catalog == NULL) {
+		return -1;
+	}
+	int result = is_catalog_current(catalog) ? list_catalog_files(catalog, files) : 1;
+	unlock_catalog(catalog);
+	return result;
+}
 
-struct FileInfo* list_files(const char* dir_path, int* n_files) {
-	*n_files = 0;
-	
-	// open the directory 
-	DIR* dir;
-	struct dirent* entry;
-	dir = opendir(dir_path);
-	if (dir == NULL) {
+
+struct ListingRequest* start_user_listing(const char* username, int user_dir_fd, int event_fd) {
+	struct ListingRequest* request = malloc(sizeof(struct ListingRequest));
+	if (request == NULL) {
+		return NULL;
+	}
+	request->username = strdup(username);
+	// the request outlives the client's descriptor if the client leaves
+	request->user_dir_fd = fcntl(user_dir_fd, F_DUPFD_CLOEXEC, 0);
+	if (request->username == NULL || request->user_dir_fd < 0) {
+		free(request->username);
+		free(request);
 		return NULL;
 	}
+	initialize_file_table(&request->files);
+	request->result = -1;
+	request->context = NULL;
+	request->next = NULL;
+
+	pthread_once(&checksum_pool_once, initialize_checksum_pool);
+	initialize_signaled_batch(&request->batch, event_fd);
+	submit_job(&checksum_pool, &request->batch, &request->job, run_listing_job);
+	if (!has_workers(&checksum_pool)) {
+		// nobody else can make the listing
+		wait_for_batch(&checksum_pool, &request->batch);
+	}
+	return request;
+}
+
+
+bool is_user_listing_done(struct ListingRequest* request) {
+	return is_batch_done(&checksum_pool, &request->batch);
+}
+
+
+void free_user_listing(struct ListingRequest* request) {
+	close_worker_batch(&request->batch);
+	free_file_table(&request->files);
+	close(request->user_dir_fd);
+	free(request->username);
+	free(request);
+}
+
+
+int find_user_file(const char* username, int user_dir_fd, const char* file_name,
+		struct CatalogEntry* entry) {
+	struct Catalog* catalog = lock_settled_catalog(username, user_dir_fd);
+	if (catalog == NULL) {
+		return -1;
+	}
+	const struct CatalogEntry* found = find_catalog_entry(catalog, file_name);
+	if (found != NULL) {
+		*entry = *found;
+	}
+	unlock_catalog(catalog);
+	return found != NULL ? 0 : -1;
+}
+
+
+int begin_file_update(const char* username, int user_dir_fd, const char* file_name) {
+	struct Catalog* catalog = lock_settled_catalog(username, user_dir_fd);
+	if (catalog == NULL) {
+		return -1;
+	}
+	int result = begin_catalog_update(catalog, file_name);
+	unlock_catalog(catalog);
+	return result;
+}
+
+
+int finish_file_update(const char* username, int user_dir_fd, const struct CatalogEntry* entry) {
+	struct Catalog* catalog = lock_settled_catalog(username, user_dir_fd);
+	if (catalog == NULL) {
+		return -1;
+	}
+	int result = finish_catalog_update(catalog, entry->name, entry);
+	unlock_catalog(catalog);
+	return result;
+}
+
+
+void abort_file_update(const char* username, int user_dir_fd, const char* file_name) {
+	struct Catalog* catalog = lock_settled_catalog(username, user_dir_fd);
+	if (catalog == NULL) {
+		return;
+	}
+	// the upload was anonymous, the file didn't change
+	finish_catalog_update(catalog, file_name, NULL);
+	unlock_catalog(catalog);
+}
+
 
-	// prepare buffer to concat dir_path with file name in dir
-	// in the form "<dir_path>/<file_name>"
-	size_t dir_path_len = strlen(dir_path);
-	char* file_path = malloc(dir_path_len + 1 + MAX_FILE_NAME_LEN);
-	memcpy(file_path, dir_path, dir_path_len);
-	file_path[dir_path_len] = '/';
-	char* file_path_name_part = file_path + dir_path_len + 1;
+
+int list_files(const char* dir_path, struct FileTable* files) {
+	int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		return -1;
+	}
+	int result = list_directory_files(dir_fd, files);
+	close(dir_fd);
+	return result;
+}
+
+
+int list_directory_files(int dir_fd, struct FileTable* files) {
+	// read the entries through a descriptor of our own, since closing the
+	// stream closes it. The files are then reached relative to dir_fd,
+	// without building their paths
+	int scan_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (scan_fd < 0) {
+		return -1;
+	}
+	DIR* dir = fdopendir(scan_fd);
+	if (dir == NULL) {
+		close(scan_fd);
+		return -1;
+	}
+
+	// checksums computed by the previous listings. Only files that changed
+	// since then are hashed again, in parallel by the checksum workers
+	struct ChecksumIndex old_index;
+	struct ChecksumIndex new_index;
+	load_checksum_index(&old_index, dir_fd);
+	initialize_checksum_index(&new_index);
+	pthread_once(&checksum_pool_once, initialize_checksum_pool);
+	struct WorkerBatch batch;
+	initialize_worker_batch(&batch);
+	struct PendingChecksum* pending_files = NULL;
+	bool is_index_changed = false;
+	bool is_out_of_memory = false;
 
 	// go through all regular files in directory, store the name and checksum
-	// in a linked list
-	struct FileInfo* info_list = NULL;
+	// in the table
+	struct dirent* entry;
 	while ((entry = readdir(dir)) != NULL) {
-		// create the path to this file (stored in file_path buffer)
-		memcpy(file_path_name_part, entry->d_name, MAX_FILE_NAME_LEN);
-		
-		// if not regular file, skip this entry
-		if (!is_regular_file(file_path)) {
+		// the index is not a user file, and other types of files are
+		// skipped without a stat when the type is known
+		size_t name_len = strnlen(entry->d_name, MAX_FILE_NAME_LEN);
+		if (name_len == MAX_FILE_NAME_LEN || !may_be_regular_file(entry)
+				|| is_reserved_file_name(entry->d_name)) {
 			continue;
 		}
 
-		// create a new linked list node to store file info
-		struct FileInfo* node = malloc(sizeof(struct FileInfo));
-		// store name with null terminator
-		memcpy(node->name, entry->d_name, MAX_FILE_NAME_LEN-1);
-		node->name[MAX_FILE_NAME_LEN-1] = 0;
-		// store checksum
-		FILE* fd = fopen(file_path, "r");
-		node->checksum = crc32_file_checksum(fd);
-		fclose(fd);
+		// if not regular file, skip this entry
+		struct stat file_stat;
+		if (fstatat(dir_fd, entry->d_name, &file_stat, 0) < 0 || !S_ISREG(file_stat.st_mode)) {
+			continue;
+		}
 
-		// add node to linked list
-		// here, we add the node to the top of list, because it's easier
-		node->next = info_list;
-		info_list = node;
-		(*n_files)++;
+		// find the checksum, from the index if the file didn't change, or
+		// from the file itself if it was computed during the upload.
+		// Otherwise the file is hashed by a worker while the scan goes on,
+		// and added to the table once hashed
+		uint32_t checksum;
+		const struct ChecksumIndexEntry* index_entry =
+				find_checksum_entry(&old_index, entry->d_name, &file_stat);
+		if (index_entry != NULL) {
+			checksum = index_entry->checksum;
+		} else if (read_attached_checksum(dir_fd, entry->d_name, &file_stat, &checksum) == 0) {
+			is_index_changed = true;
+		} else {
+			struct PendingChecksum* file = malloc(sizeof(struct PendingChecksum));
+			if (file == NULL) {
+				is_out_of_memory = true;
+				break;
+			}
+			file->dir_fd = dir_fd;
+			memcpy(file->name, entry->d_name, name_len + 1);
+			file->file_stat = file_stat;
+			if (submit_checksum_jobs(file, &batch) < 0) {
+				free(file);
+				is_out_of_memory = true;
+				break;
+			}
+			file->next = pending_files;
+			pending_files = file;
+			continue;
+		}
+		add_checksum_entry(&new_index, entry->d_name, &file_stat, checksum);
+		if (add_file_info(files, entry->d_name, name_len, checksum) < 0) {
+			is_out_of_memory = true;
+			break;
+		}
 	}
+	closedir(dir);
 
-	free(file_path);
-	return info_list;
-}
-
+	// gather the checksums computed by the workers
+	wait_for_batch(&checksum_pool, &batch);
+	close_worker_batch(&batch);
+	is_index_changed = is_index_changed || pending_files != NULL;
+	while (pending_files != NULL) {
+		struct PendingChecksum* file = pending_files;
+		pending_files = file->next;
+		if (merge_range_checksums(file) == 0) {
+			add_checksum_entry(&new_index, file->name, &file->file_stat, file->checksum);
+			if (add_file_info(files, file->name, strlen(file->name), file->checksum) < 0) {
+				is_out_of_memory = true;
+			}
+		}
+		free(file->ranges);
+		free(file);
+	}
 
-void free_file_info(struct FileInfo* file_info_list) {
-	struct FileInfo* head = file_info_list;
-	while (file_info_list != NULL) {
-		head = file_info_list;
-		file_info_list = file_info_list->next;
-		free(head);
+	// save the index if a file was hashed, added or removed
+	if (!is_out_of_memory && (is_index_changed || new_index.n_entries != old_index.n_entries)) {
+		save_checksum_index(&new_index, dir_fd);
+	}
+	free_checksum_index(&old_index);
+	free_checksum_index(&new_index);
+	if (is_out_of_memory) {
+		free_file_table(files);
+		return -1;
 	}
+	return 0;
 }
 
 
@@ -140,5 +1393,18 @@ char* join_path(const char* p1, const char* p2) {
 
 
 char* path_to_user(const char* username) {
-	return join_path(DATABASE_DIR, username);
+	if (n_shard_levels == 0) {
+		return join_path(DATABASE_DIR, username);
+	}
+
+	// <shards dir>/ab/cd/<username>, each level named by a byte of the hash
+	uint32_t hash = hash_string(username);
+	char* path = malloc(strlen(SHARDS_DIR) + 3 * n_shard_levels + 1 + strlen(username) + 1);
+	char* cursor = path + sprintf(path, "%s", SHARDS_DIR);
+	int i;
+	for (i = 0; i < n_shard_levels; i++) {
+		cursor += sprintf(cursor, "/%02x", (hash >> (24 - 8 * i)) & 0xff);
+	}
+	sprintf(cursor, "/%s", username);
+	return path;
 }
\ No newline at end of file
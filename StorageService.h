@@ -2,19 +2,64 @@
 #define STORAGE_SERVICE_H_
 
 
+#include <stdbool.h>
+
 #include "FileChecksum.h"
+#include "FileTable.h"
+#include "WorkerPool.h"
 
 
 #define MAX_FILE_NAME_LEN 64 // this includes null-terminator
 
+/** Prefix of the names files are linked under before being moved into
+ *  place, which no user file can have (see is_reserved_file_name). Those
+ *  the server left in its staging directory are removed at start */
+#define STAGED_NAME_PREFIX ".staged."
+
+
+struct CatalogEntry;
+
 
 /**
- * Define a linked list node to contain all file infos
+ * A listing of the files of a user, made by a storage worker because the
+ * user directory must be scanned first, which takes as long as hashing
+ * the files that changed. The thread asking for it doesn't wait: the end
+ * of the listing is signaled on an eventfd
  */
-struct FileInfo {
-	char name[MAX_FILE_NAME_LEN];
-	uint32_t checksum;
-	struct FileInfo* next;
+struct ListingRequest {
+	struct WorkerJob job;
+	struct WorkerBatch batch;
+	char* username;
+	/** Descriptor of the user directory, owned by the request */
+	int user_dir_fd;
+	/** The files, once listed */
+	struct FileTable files;
+	/** 0 if the files were listed, -1 if error */
+	int result;
+	/** Arbitrary data of the owner of the request */
+	void* context;
+	/** Link in a list of the owner of the request */
+	struct ListingRequest* next;
+};
+
+
+/**
+ * Where the contents of uploaded files are stored
+ */
+enum StorageMode {
+	/** Each file of each user is stored separately, in the user's directory */
+	STORAGE_FILES = 0,
+	/** Contents are stored once, in a blob store keyed by their SHA-256
+	 *  digest. A user's directory holds a hard link to the blob of each
+	 *  file, so the directory is the user's manifest of name -> blob, and
+	 *  the link count of a blob counts its references */
+	STORAGE_BLOBS,
+	/** Contents are split into content-defined chunks, each stored once
+	 *  in a chunk store keyed by its SHA-256 digest. A user's directory
+	 *  holds the chunk list of each file, so that files that differ by a
+	 *  few bytes share most of their storage. Chunks no list refers to
+	 *  are removed when the server starts */
+	STORAGE_CHUNKS,
 };
 
 
@@ -24,6 +69,145 @@ struct FileInfo {
 void initialize_storage_service();
 
 
+/**
+ * @return false if the service can't be used: users of the flat layout
+ *         named like directories of the server have files in them, which
+ *         can't be moved with 0 shard levels
+ */
+bool is_storage_initialized();
+
+
+/**
+ * Set the number of threads hashing files for list_files, e.g. to match
+ * the number of CPUs or the queue depth of the disk. Must be called before
+ * the first listing. By default, there is one thread per CPU.
+ */
+void set_checksum_workers(int n_workers);
+
+
+/**
+ * Set the number of shard levels above the user directories (0 to 2).
+ * Each level is a directory named by a byte of the hash of the user name,
+ * so that no directory holds more than a few users' directories.
+ * With 0 levels, all user directories are in the same directory (the flat
+ * layout). Otherwise, the user directories left in the flat layout are
+ * moved to their shards. Must be called before initialize_storage_service.
+ * By default, there are 2 levels.
+ */
+void set_user_directory_levels(int n_levels);
+
+
+/**
+ * Set where the contents of uploaded files are stored. Must be called
+ * before initialize_storage_service. Files stored in either mode are
+ * readable in the other. By default, files are stored separately.
+ */
+void set_storage_mode(enum StorageMode mode);
+
+
+/**
+ * Pack the uploads up to the given size in a log per user (see PackStore),
+ * rather than storing each in its own file. Files packed before stay
+ * readable when packing is disabled. By default, 0: no file is packed.
+ */
+void set_packed_file_size(size_t max_size);
+
+
+/**
+ * Make stored uploads durable in batches (see GroupCommit): the uploads
+ * stored within the given window of time are synced together. Must be
+ * called before initialize_storage_service. By default, -1: uploads are
+ * not synced.
+ */
+void set_commit_window(int window_ms);
+
+
+/**
+ * @return true if an upload of this size is appended to the user's pack
+ */
+bool should_pack_file(uint64_t file_size);
+
+
+/**
+ * @return true if a file name of a user directory is used by the server,
+ *         so that no user file may have it
+ */
+bool is_reserved_file_name(const char* file_name);
+
+
+/**
+ * @return true if stored uploads must be added to a commit request, and
+ *         only confirmed once it is done
+ */
+bool is_durable_storage();
+
+
+/**
+ * @return true if the contents of uploaded files are stored in the blob
+ *         store, in which case their SHA-256 digest must be computed
+ */
+bool is_blob_storage();
+
+
+/**
+ * @return true if the contents of uploaded files are split into chunks,
+ *         in which case uploads are written with a ChunkWriter, and the
+ *         upload file receives the chunk list
+ */
+bool is_chunk_storage();
+
+
+/**
+ * Create the file an upload is written to, in the staging directory. The
+ * file is anonymous until commit_upload_file is called, and vanishes if
+ * closed before by close_upload_file. Where the filesystem has no
+ * anonymous files, it is named in the staging directory meanwhile. Its
+ * space is allocated at once, except for a chunked upload, whose file only
+ * receives the chunk list.
+ * @param file_size Size of the uploaded file
+ * @return Descriptor of the file (readable and writable), or -1 if fail
+ *         (e.g. not enough space)
+ */
+int create_upload_file(uint64_t file_size);
+
+
+/**
+ * Store a completely written upload under its name in the user directory,
+ * replacing the previous file of that name atomically. With the blob
+ * store, the content is linked to its blob, which is created if no file
+ * had the same content. With the chunk store, the file must hold the
+ * chunk list of the upload (see finish_chunk_writer).
+ * @param file_fd Descriptor given by create_upload_file
+ * @param digest  SHA-256 digest of the content, only used with the blob store
+ * @return 0 if success, -1 if fail
+ */
+int commit_upload_file(int user_dir_fd, const char* file_name, int file_fd,
+		const unsigned char* digest);
+
+
+/**
+ * Close the file of an upload, which vanishes unless commit_upload_file
+ * stored it
+ */
+void close_upload_file(int file_fd);
+
+
+/**
+ * Delete a file of the user directory, releasing its blob if no other
+ * file links it
+ * @return 0 if success or the file doesn't exist, -1 if fail
+ */
+int remove_user_file(int user_dir_fd, const char* file_name);
+
+
+/**
+ * @return true if no new user may have this name, which is that of a
+ *         directory of the server in the flat layout. Whatever the layout,
+ *         so that it can be changed later
+ */
+bool is_reserved_user_name(const char* username);
+
+
 /**
  * Create the directory to store user's file
  * @return 0 if success, -1 if fail
@@ -32,34 +216,115 @@ int create_user_directory(const char* username);
 
 
 /**
- * Find the info of all files of a given user
+ * Open the directory of a user, so that the user's files can be reached
+ * relative to it with the *at() calls, without building their paths
+ * @return Descriptor of the directory, or -1 if fail
+ */
+int open_user_directory(const char* username);
+
+
+/**
+ * Find the info of all files of a given user, from the user's catalog
+ * (see Catalog). The catalog is built by listing the user directory the
+ * first time, and afterwards kept up to date by the updates of the files.
+ * It is brought up to date by listing the directory again whenever the
+ * directory changed behind the server's back, which may take as long as
+ * hashing the changed files: event loops use list_known_user_files.
  * @param  username  Name of user
- * @param  n_files   [out] Number of files found
- * @return Linked list of file infos.
- *         The memory for the linked list is dynamically allocated,
- *         so user must call free_file_info on the returned pointer
- *         after finishes using the linked list.
+ * @param  user_dir_fd Descriptor of the user's directory
+ * @param  files     [out] Initialized table, the files are added to.
+ *                   The table must be released with free_file_table
+ *                   after use
+ * @return 0 if success, -1 if fail
+ */
+int list_user_files(const char* username, int user_dir_fd, struct FileTable* files);
+
+
+/**
+ * Same as list_user_files, but only if the user directory needn't be
+ * scanned first, so that the call never waits for files to be hashed
+ * @return 0 if success, 1 if the directory must be scanned first (see
+ *         start_user_listing), -1 if fail
+ */
+int list_known_user_files(const char* username, int user_dir_fd, struct FileTable* files);
+
+
+/**
+ * Start listing the files of a user with list_user_files, on a storage
+ * worker. Once the listing is done, 1 is added to the eventfd.
+ * @param event_fd Eventfd of the caller, which may be shared by several
+ *                 listings: is_user_listing_done tells which are done
+ * @return The request, to be freed with free_user_listing once done, or
+ *         NULL if fail
+ */
+struct ListingRequest* start_user_listing(const char* username, int user_dir_fd, int event_fd);
+
+
+/**
+ * @return true if the files of a listing are listed. Doesn't wait
+ */
+bool is_user_listing_done(struct ListingRequest* request);
+
+
+/**
+ * Release a listing, once done
+ */
+void free_user_listing(struct ListingRequest* request);
+
+
+/**
+ * Find a file of a user in the user's catalog. The files changed behind
+ * the server's back are only known once the files are listed again
+ * @param entry [out] What the catalog knows about the file
+ * @return 0 if success, -1 if the user has no such file or error
+ */
+int find_user_file(const char* username, int user_dir_fd, const char* file_name,
+		struct CatalogEntry* entry);
+
+
+/**
+ * Log in the user's catalog that a file is about to be replaced. Must be
+ * followed by finish_file_update or abort_file_update.
+ * @return 0 if success, -1 if fail
+ */
+int begin_file_update(const char* username, int user_dir_fd, const char* file_name);
+
+
+/**
+ * Record a file in the user's catalog, once stored
+ * @param entry The stored file. Its generation is set by the catalog
+ * @return 0 if success, -1 if fail
+ */
+int finish_file_update(const char* username, int user_dir_fd, const struct CatalogEntry* entry);
+
+
+/**
+ * End an update of a file that was not stored. Called once the upload
+ * is discarded
  */
-struct FileInfo* list_user_files(const char* username, int* n_files);
+void abort_file_update(const char* username, int user_dir_fd, const char* file_name);
 
 
 /**
- * Find the info of all files in the given directory
+ * Find the info of all files in the given directory.
+ * Files that changed since the last listing are hashed in parallel. The
+ * calling thread waits for them, hashing files itself meanwhile, so an
+ * event loop lists files with start_user_listing instead.
  * @param  dir_path  path to directory
- * @param  n_files   [out] Number of files found
- * @return Pointer to a FileInfo struct, which represents the
- *         head of a linked list of FileInfo.
- *         The memory for the linked list is dynamically allocated,
- *         so user must call free_file_info on the returned pointer
- *         after finishes using the linked list.
+ * @param  files     [out] Initialized table, the files are added to.
+ *                   The table must be released with free_file_table
+ *                   after use
+ * @return 0 if success, -1 if fail (the table is left empty)
  */
-struct FileInfo* list_files(const char* dir_path, int* n_files);
+int list_files(const char* dir_path, struct FileTable* files);
 
 
 /**
- * Free the dynamically allocated list of file info
+ * Same as list_files, for a directory that is already open
+ * @param  dir_fd    Descriptor of the directory
+ * @param  files     [out] Initialized table, the files are added to
  */
-void free_file_info(struct FileInfo* file_info_list);
+int list_directory_files(int dir_fd, struct FileTable* files);
 
 
 /**
@@ -0,0 +1,21 @@
+#include "StringHash.h"
+
+
+/** Parameters of the 32-bit FNV-1a hash */
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+
+/*
+ * Public functions
+ */
+
+
+uint32_t hash_string(const char* string) {
+	uint32_t hash = FNV_OFFSET_BASIS;
+	while (*string != 0) {
+		hash ^= (unsigned char)*string++;
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
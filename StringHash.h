@@ -0,0 +1,20 @@
+/**
+ * Hash of the names (user and file names) that key the in-memory tables
+ * and pick the shards of user directories
+ */
+
+#ifndef STRING_HASH_H_
+#define STRING_HASH_H_
+
+
+#include <stdint.h>
+
+
+/**
+ * FNV-1a hash of a null-terminated string. The shards of user directories
+ * are picked from it, so it must never change
+ */
+uint32_t hash_string(const char* string);
+
+
+#endif // STRING_HASH_H_
@@ -0,0 +1,130 @@
+#include "UserRegistry.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "StringHash.h"
+
+
+/*
+ * Helper functions
+ */
+
+
+/**
+ * Remove an entry from the idle entries. The registry lock must be held.
+ */
+void unlink_idle_entry(struct UserRegistry* registry, struct UserRegistryEntry* entry) {
+	if (entry->idle_prev != NULL) {
+		entry->idle_prev->idle_next = entry->idle_next;
+	} else {
+		registry->idle_head = entry->idle_next;
+	}
+	if (entry->idle_next != NULL) {
+		entry->idle_next->idle_prev = entry->idle_prev;
+	} else {
+		registry->idle_tail = entry->idle_prev;
+	}
+	entry->idle_prev = entry->idle_next = NULL;
+	registry->n_idle--;
+}
+
+
+/**
+ * Remove the least recently used idle entries past the bound from the
+ * table. The registry lock must be held.
+ * @return The removed entries, linked by their next field, to be destroyed
+ *         once the lock is released
+ */
+struct UserRegistryEntry* evict_idle_entries(struct UserRegistry* registry) {
+	struct UserRegistryEntry* evicted = NULL;
+	while (registry->n_idle > registry->max_idle) {
+		struct UserRegistryEntry* entry = registry->idle_tail;
+		unlink_idle_entry(registry, entry);
+		struct UserRegistryEntry** link = &registry->buckets[entry->hash % USER_REGISTRY_BUCKETS];
+		while (*link != entry) {
+			link = &(*link)->next;
+		}
+		*link = entry->next;
+		entry->next = evicted;
+		evicted = entry;
+	}
+	return evicted;
+}
+
+
+/*
+ * Public functions
+ */
+
+
+struct UserRegistryEntry* acquire_user_entry(struct UserRegistry* registry, const char* username) {
+	uint32_t hash = hash_string(username);
+	pthread_mutex_lock(&registry->lock);
+	struct UserRegistryEntry** bucket = &registry->buckets[hash % USER_REGISTRY_BUCKETS];
+	struct UserRegistryEntry* entry = *bucket;
+	while (entry != NULL && (entry->hash != hash || strcmp(entry->username, username) != 0)) {
+		entry = entry->next;
+	}
+	if (entry == NULL) {
+		entry = registry->create();
+		if (entry != NULL) {
+			entry->username = strdup(username);
+			if (entry->username == NULL) {
+				registry->destroy(entry);
+				entry = NULL;
+			}
+		}
+		if (entry != NULL) {
+			entry->hash = hash;
+			entry->n_users = 0;
+			entry->idle_prev = entry->idle_next = NULL;
+			entry->next = *bucket;
+			*bucket = entry;
+		}
+	} else if (entry->n_users == 0) {
+		unlink_idle_entry(registry, entry);
+	}
+	if (entry != NULL) {
+		entry->n_users++;
+	}
+	pthread_mutex_unlock(&registry->lock);
+	return entry;
+}
+
+
+void pin_user_entry(struct UserRegistry* registry, struct UserRegistryEntry* entry) {
+	pthread_mutex_lock(&registry->lock);
+	entry->n_users++;
+	pthread_mutex_unlock(&registry->lock);
+}
+
+
+void release_user_entry(struct UserRegistry* registry, struct UserRegistryEntry* entry) {
+	pthread_mutex_lock(&registry->lock);
+	struct UserRegistryEntry* evicted = NULL;
+	entry->n_users--;
+	if (entry->n_users == 0) {
+		entry->idle_prev = NULL;
+		entry->idle_next = registry->idle_head;
+		if (registry->idle_head != NULL) {
+			registry->idle_head->idle_prev = entry;
+		} else {
+			registry->idle_tail = entry;
+		}
+		registry->idle_head = entry;
+		registry->n_idle++;
+		evicted = evict_idle_entries(registry);
+	}
+	pthread_mutex_unlock(&registry->lock);
+
+	// nothing can reach the evicted entries anymore
+	while (evicted != NULL) {
+		struct UserRegistryEntry* next = evicted->next;
+		char* username = evicted->username;
+		registry->destroy(evicted);
+		free(username);
+		evicted = next;
+	}
+}
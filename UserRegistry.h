@@ -0,0 +1,99 @@
+/**
+ * A table of per-user state (catalogs, packs) shared by all threads, which
+ * keeps only a bounded number of idle entries. An entry is in use while a
+ * thread holds it; once no thread does, it joins the idle entries, and the
+ * least recently used idle entries are destroyed past the bound, so that
+ * the descriptors and indexes of users gone quiet are released.
+ * The entries are intrusive: each state embeds its UserRegistryEntry as its
+ * first member.
+ */
+
+#ifndef USER_REGISTRY_H_
+#define USER_REGISTRY_H_
+
+
+#include <pthread.h>
+#include <stdint.h>
+
+
+/** Number of buckets of a registry, by user name */
+#define USER_REGISTRY_BUCKETS 4096
+
+
+struct UserRegistryEntry;
+
+
+/**
+ * Allocate the state of a user, zeroed apart from its own fields
+ * @return The entry embedded in the state, or NULL if out of memory
+ */
+typedef struct UserRegistryEntry* (*create_user_entry)(void);
+
+
+/**
+ * Release the state of a user: close its descriptors and free it. The
+ * user name is freed by the registry afterward
+ */
+typedef void (*destroy_user_entry)(struct UserRegistryEntry* entry);
+
+
+/**
+ * Link of the state of a user in a registry
+ */
+struct UserRegistryEntry {
+	char* username;
+	uint32_t hash;
+	/** Number of holders of the entry, guarded by the registry lock.
+	 *  Idle entries have none */
+	int n_users;
+	struct UserRegistryEntry* next;
+	/** Neighbors among the idle entries, most recently used first */
+	struct UserRegistryEntry* idle_prev;
+	struct UserRegistryEntry* idle_next;
+};
+
+
+/**
+ * The entries of all users, and the order in which idle ones were released
+ */
+struct UserRegistry {
+	pthread_mutex_t lock;
+	struct UserRegistryEntry* buckets[USER_REGISTRY_BUCKETS];
+	struct UserRegistryEntry* idle_head;
+	struct UserRegistryEntry* idle_tail;
+	int n_idle;
+	/** Idle entries kept past this many are destroyed */
+	int max_idle;
+	create_user_entry create;
+	destroy_user_entry destroy;
+};
+
+
+/**
+ * Static initializer of a registry
+ */
+#define USER_REGISTRY_INITIALIZER(max_idle, create, destroy) \
+	{PTHREAD_MUTEX_INITIALIZER, {NULL}, NULL, NULL, 0, (max_idle), (create), (destroy)}
+
+
+/**
+ * Find the entry of a user, creating it if there is none, and hold it
+ * @return The entry, or NULL if out of memory
+ */
+struct UserRegistryEntry* acquire_user_entry(struct UserRegistry* registry, const char* username);
+
+
+/**
+ * Hold an entry once more, which the caller holds already
+ */
+void pin_user_entry(struct UserRegistry* registry, struct UserRegistryEntry* entry);
+
+
+/**
+ * Stop holding an entry. Once no thread holds it, the entry is idle, and
+ * may be destroyed at any time
+ */
+void release_user_entry(struct UserRegistry* registry, struct UserRegistryEntry* entry);
+
+
+#endif // USER_REGISTRY_H_
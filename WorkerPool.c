@@ -0,0 +1,188 @@
+#include "WorkerPool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+/*
+ * Helper functions
+ */
+
+
+/**
+ * Remove the job at the head of the queue. The pool lock must be held.
+ * @return The job, or NULL if the queue is empty
+ */
+struct WorkerJob* pop_job(struct WorkerPool* pool) {
+	struct WorkerJob* job = pool->head;
+	if (job != NULL) {
+		pool->head = job->next;
+		if (pool->head == NULL) {
+			pool->tail = NULL;
+		}
+	}
+	return job;
+}
+
+
+/**
+ * Run a job without holding the pool lock, then mark it completed.
+ * The pool lock must be held when calling, and is held again on return.
+ */
+void run_job(struct WorkerPool* pool, struct WorkerJob* job) {
+	// the job may be freed by its submitter as soon as the batch completes
+	struct WorkerBatch* batch = job->batch;
+	pthread_mutex_unlock(&pool->lock);
+	job->run(job);
+	pthread_mutex_lock(&pool->lock);
+	batch->n_pending--;
+	if (batch->n_pending == 0) {
+		pthread_cond_broadcast(&batch->done);
+		// the submitter may free the batch once it reads the event, which
+		// it can't do before the pool lock is released
+		uint64_t one = 1;
+		if (batch->event_fd >= 0 && write(batch->event_fd, &one, sizeof(one)) < 0) {
+			printf("Error when signaling a completed batch\n");
+		}
+	}
+}
+
+
+/**
+ * Thread routine: run queued jobs until the pool stops
+ */
+void* run_worker(void* context) {
+	struct WorkerPool* pool = context;
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		struct WorkerJob* job = pop_job(pool);
+		if (job != NULL) {
+			run_job(pool, job);
+			continue;
+		}
+		if (pool->is_stopping) {
+			break;
+		}
+		pthread_cond_wait(&pool->has_jobs, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+
+/*
+ * Public functions
+ */
+
+
+int create_worker_pool(struct WorkerPool* pool, int n_threads) {
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->is_stopping = false;
+	pool->n_threads = 0;
+	pool->threads = NULL;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->has_jobs, NULL);
+	if (n_threads == 0) {
+		return 0;
+	}
+
+	pool->threads = malloc(n_threads * sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		destroy_worker_pool(pool);
+		return -1;
+	}
+	for (pool->n_threads = 0; pool->n_threads < n_threads; pool->n_threads++) {
+		if (pthread_create(&pool->threads[pool->n_threads], NULL, run_worker, pool) != 0) {
+			destroy_worker_pool(pool);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+void initialize_worker_batch(struct WorkerBatch* batch) {
+	batch->n_pending = 0;
+	pthread_cond_init(&batch->done, NULL);
+	batch->event_fd = -1;
+}
+
+
+void initialize_signaled_batch(struct WorkerBatch* batch, int event_fd) {
+	initialize_worker_batch(batch);
+	batch->event_fd = event_fd;
+}
+
+
+void submit_job(struct WorkerPool* pool, struct WorkerBatch* batch,
+		struct WorkerJob* job, job_function run) {
+	job->run = run;
+	job->batch = batch;
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail == NULL) {
+		pool->head = job;
+	} else {
+		pool->tail->next = job;
+	}
+	pool->tail = job;
+	batch->n_pending++;
+	pthread_cond_signal(&pool->has_jobs);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+void wait_for_batch(struct WorkerPool* pool, struct WorkerBatch* batch) {
+	pthread_mutex_lock(&pool->lock);
+	while (batch->n_pending > 0) {
+		// help instead of sleeping, as long as there is work queued
+		struct WorkerJob* job = pop_job(pool);
+		if (job != NULL) {
+			run_job(pool, job);
+		} else {
+			pthread_cond_wait(&batch->done, &pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+bool is_batch_done(struct WorkerPool* pool, struct WorkerBatch* batch) {
+	pthread_mutex_lock(&pool->lock);
+	bool is_done = batch->n_pending == 0;
+	pthread_mutex_unlock(&pool->lock);
+	return is_done;
+}
+
+
+bool has_workers(const struct WorkerPool* pool) {
+	return pool->n_threads > 0;
+}
+
+
+void close_worker_batch(struct WorkerBatch* batch) {
+	pthread_cond_destroy(&batch->done);
+}
+
+
+void destroy_worker_pool(struct WorkerPool* pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->is_stopping = true;
+	pthread_cond_broadcast(&pool->has_jobs);
+	pthread_mutex_unlock(&pool->lock);
+
+	int i;
+	for (i = 0; i < pool->n_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	free(pool->threads);
+	pool->threads = NULL;
+	pool->n_threads = 0;
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->has_jobs);
+}
@@ -0,0 +1,130 @@
+/**
+ * A fixed set of threads running jobs from a shared FIFO queue.
+ * Jobs are submitted in batches, and the submitter waits for its batch to
+ * complete. While waiting, the submitter runs queued jobs itself, so a
+ * batch always makes progress, even if every worker is busy.
+ * A thread that must not block, such as an event loop, instead has the
+ * completion of its batch signaled on an eventfd, and collects it from
+ * its callback.
+ */
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+
+#include <pthread.h>
+#include <stdbool.h>
+
+
+struct WorkerJob;
+struct WorkerBatch;
+
+
+/**
+ * Function doing the work of a job
+ */
+typedef void (*job_function)(struct WorkerJob* job);
+
+
+/**
+ * A unit of work. Usually embedded in a larger struct holding the job's
+ * input and output
+ */
+struct WorkerJob {
+	job_function run;
+	/** The batch the job belongs to */
+	struct WorkerBatch* batch;
+	struct WorkerJob* next;
+};
+
+
+/**
+ * A group of jobs whose completion is waited for together
+ */
+struct WorkerBatch {
+	/** Number of jobs of the batch not completed yet, guarded by the pool lock */
+	int n_pending;
+	/** Signaled when the last job of the batch completes */
+	pthread_cond_t done;
+	/** Eventfd written to when the last job of the batch completes, or -1 */
+	int event_fd;
+};
+
+
+/**
+ * The threads and their job queue
+ */
+struct WorkerPool {
+	pthread_t* threads;
+	int n_threads;
+	pthread_mutex_t lock;
+	/** Signaled when a job is queued, or when the pool is stopping */
+	pthread_cond_t has_jobs;
+	struct WorkerJob* head;
+	struct WorkerJob* tail;
+	bool is_stopping;
+};
+
+
+/**
+ * Start the threads of a pool
+ * @param n_threads Number of threads. With 0 threads, the jobs are all
+ *                  run by the threads waiting for them
+ * @return 0 if success, -1 if fail
+ */
+int create_worker_pool(struct WorkerPool* pool, int n_threads);
+
+
+/**
+ * Initialize an empty batch
+ */
+void initialize_worker_batch(struct WorkerBatch* batch);
+
+
+/**
+ * Initialize an empty batch whose completion is signaled on an eventfd,
+ * for submitters that don't wait for it
+ */
+void initialize_signaled_batch(struct WorkerBatch* batch, int event_fd);
+
+
+/**
+ * Queue a job, as part of a batch
+ */
+void submit_job(struct WorkerPool* pool, struct WorkerBatch* batch,
+		struct WorkerJob* job, job_function run);
+
+
+/**
+ * Wait until all jobs of a batch are completed, running queued jobs
+ * in the meantime. The batch can be reused afterward.
+ */
+void wait_for_batch(struct WorkerPool* pool, struct WorkerBatch* batch);
+
+
+/**
+ * @return true if all jobs of a batch are completed. Doesn't wait
+ */
+bool is_batch_done(struct WorkerPool* pool, struct WorkerBatch* batch);
+
+
+/**
+ * @return true if the pool has threads of its own. Otherwise, jobs only
+ *         run while their submitter waits for them
+ */
+bool has_workers(const struct WorkerPool* pool);
+
+
+/**
+ * Release the resources of a completed batch
+ */
+void close_worker_batch(struct WorkerBatch* batch);
+
+
+/**
+ * Stop the threads once the queued jobs are done, and release the pool
+ */
+void destroy_worker_pool(struct WorkerPool* pool);
+
+
+#endif // WORKER_POOL_H_